@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "asyncstream.hh"
+
+using std::vector;
+
+AsyncInputStream::AsyncInputStream (std::unique_ptr<AudioInputStream> in, size_t block_frames, size_t max_blocks) :
+  m_in (std::move (in)),
+  m_bit_depth (m_in->bit_depth()),
+  m_sample_rate (m_in->sample_rate()),
+  m_n_channels (m_in->n_channels()),
+  m_n_frames (m_in->n_frames()),
+  m_block_frames (block_frames),
+  m_max_blocks (max_blocks)
+{
+  m_thread = std::thread (&AsyncInputStream::reader_thread, this);
+}
+
+AsyncInputStream::~AsyncInputStream()
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_stop = true;
+  }
+  m_cond.notify_all();
+  m_thread.join();
+}
+
+void
+AsyncInputStream::reader_thread()
+{
+  while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock (m_mutex);
+        m_cond.wait (lock, [this] { return m_stop || m_blocks.size() < m_max_blocks; });
+        if (m_stop)
+          return;
+      }
+      vector<float> block;
+      Error err = m_in->read_frames (block, m_block_frames);
+
+      std::lock_guard<std::mutex> lock (m_mutex);
+      if (err || block.empty())
+        {
+          m_error = err;
+          m_eof   = true;
+        }
+      else
+        {
+          m_blocks.push_back (std::move (block));
+        }
+      m_cond.notify_all();
+      if (m_eof)
+        return;
+    }
+}
+
+Error
+AsyncInputStream::read_frames (vector<float>& samples, size_t count)
+{
+  samples.clear();
+  while (samples.size() < count * m_n_channels)
+    {
+      if (m_current_pos == m_current.size())
+        {
+          std::unique_lock<std::mutex> lock (m_mutex);
+          m_cond.wait (lock, [this] { return m_eof || !m_blocks.empty(); });
+          if (m_blocks.empty())
+            {
+              /* only report errors after all samples read before the error are consumed */
+              if (m_error)
+                return m_error;
+              break;
+            }
+          m_current = std::move (m_blocks.front());
+          m_current_pos = 0;
+          m_blocks.pop_front();
+          m_cond.notify_all();
+        }
+      const size_t n = std::min (count * m_n_channels - samples.size(), m_current.size() - m_current_pos);
+      samples.insert (samples.end(), m_current.begin() + m_current_pos, m_current.begin() + m_current_pos + n);
+      m_current_pos += n;
+    }
+  return Error::Code::NONE;
+}
+
+AsyncOutputStream::AsyncOutputStream (std::unique_ptr<AudioOutputStream> out, size_t max_blocks) :
+  m_out (std::move (out)),
+  m_bit_depth (m_out->bit_depth()),
+  m_sample_rate (m_out->sample_rate()),
+  m_n_channels (m_out->n_channels()),
+  m_max_blocks (max_blocks)
+{
+  m_thread = std::thread (&AsyncOutputStream::writer_thread, this);
+}
+
+AsyncOutputStream::~AsyncOutputStream()
+{
+  stop_thread();
+}
+
+void
+AsyncOutputStream::writer_thread()
+{
+  std::unique_lock<std::mutex> lock (m_mutex);
+  while (true)
+    {
+      m_cond.wait (lock, [this] { return m_stop || !m_blocks.empty(); });
+      if (m_blocks.empty()) /* stop requested, and everything is written */
+        return;
+
+      vector<float> block = std::move (m_blocks.front());
+      m_blocks.pop_front();
+      m_writing = true;
+      lock.unlock();
+
+      Error err = m_out->write_frames (block);
+
+      lock.lock();
+      m_writing = false;
+      if (err && !m_error)
+        m_error = err;
+      m_cond.notify_all();
+    }
+}
+
+void
+AsyncOutputStream::stop_thread()
+{
+  if (m_thread.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock (m_mutex);
+        m_stop = true;
+      }
+      m_cond.notify_all();
+      m_thread.join();
+    }
+}
+
+Error
+AsyncOutputStream::write_frames (const vector<float>& frames)
+{
+  std::unique_lock<std::mutex> lock (m_mutex);
+  m_cond.wait (lock, [this] { return m_error || m_blocks.size() < m_max_blocks; });
+  if (m_error)
+    return m_error;
+
+  m_blocks.push_back (frames);
+  m_cond.notify_all();
+  return Error::Code::NONE;
+}
+
+Error
+AsyncOutputStream::close()
+{
+  /* write all pending blocks */
+  stop_thread();
+
+  Error err = m_out->close();
+  if (m_error)
+    return m_error;
+  return err;
+}
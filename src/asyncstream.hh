@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_ASYNC_STREAM_HH
+#define AUDIOWMARK_ASYNC_STREAM_HH
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "audiostream.hh"
+
+/* input stream decorator: reads (decodes) ahead in a background thread
+ *
+ * the wrapped stream is read in blocks of block_frames, at most max_blocks are buffered
+ */
+class AsyncInputStream : public AudioInputStream
+{
+  std::unique_ptr<AudioInputStream> m_in;
+
+  int                       m_bit_depth = 0;
+  int                       m_sample_rate = 0;
+  int                       m_n_channels = 0;
+  size_t                    m_n_frames = 0;
+
+  size_t                    m_block_frames = 0;
+  size_t                    m_max_blocks = 0;
+
+  std::mutex                m_mutex;
+  std::condition_variable   m_cond;
+  std::deque<std::vector<float>> m_blocks;
+  bool                      m_eof = false;
+  bool                      m_stop = false;
+  Error                     m_error;
+  std::thread               m_thread;
+
+  std::vector<float>        m_current;
+  size_t                    m_current_pos = 0;
+
+  void reader_thread();
+public:
+  AsyncInputStream (std::unique_ptr<AudioInputStream> in, size_t block_frames, size_t max_blocks);
+  ~AsyncInputStream();
+
+  Error   read_frames (std::vector<float>& samples, size_t count) override;
+
+  int     bit_depth() const override    { return m_bit_depth; }
+  int     sample_rate() const override  { return m_sample_rate; }
+  int     n_channels() const override   { return m_n_channels; }
+  size_t  n_frames() const override     { return m_n_frames; }
+};
+
+/* output stream decorator: writes (encodes) behind in a background thread
+ *
+ * write_frames() only blocks if max_blocks writes are pending, errors are
+ * reported by the next write_frames() or close() call
+ */
+class AsyncOutputStream : public AudioOutputStream
+{
+  std::unique_ptr<AudioOutputStream> m_out;
+
+  int                       m_bit_depth = 0;
+  int                       m_sample_rate = 0;
+  int                       m_n_channels = 0;
+
+  size_t                    m_max_blocks = 0;
+
+  std::mutex                m_mutex;
+  std::condition_variable   m_cond;
+  std::deque<std::vector<float>> m_blocks;
+  bool                      m_writing = false;
+  bool                      m_stop = false;
+  Error                     m_error;
+  std::thread               m_thread;
+
+  void writer_thread();
+  void stop_thread();
+public:
+  AsyncOutputStream (std::unique_ptr<AudioOutputStream> out, size_t max_blocks);
+  ~AsyncOutputStream();
+
+  Error   write_frames (const std::vector<float>& frames) override;
+  Error   close() override;
+
+  int     bit_depth() const override    { return m_bit_depth; }
+  int     sample_rate() const override  { return m_sample_rate; }
+  int     n_channels() const override   { return m_n_channels; }
+};
+
+#endif /* AUDIOWMARK_ASYNC_STREAM_HH */
@@ -52,6 +52,9 @@ public:
 
   virtual Error write_frames (const std::vector<float>& frames) = 0;
   virtual Error close() = 0;
+
+  // for streams that only use the start of the audio: no more frames are needed
+  virtual bool  done() const { return false; }
 };
 
 #endif /* AUDIOWMARK_AUDIO_STREAM_HH */
@@ -28,6 +28,7 @@
 #include "wmcommon.hh"
 #include "shortcode.hh"
 #include "hls.hh"
+#include "hlscontext.hh"
 
 #include <assert.h>
 
@@ -66,6 +67,14 @@ print_usage()
   printf ("  --input-format raw    use raw stream as input\n");
   printf ("  --output-format raw   use raw stream as output\n");
   printf ("  --format raw          use raw stream as input and output\n");
+  printf ("  --output-rf64         write rf64 header for wav output to stdout (> 4 GB)\n");
+  printf ("\n");
+  printf ("  --low-latency         reduce streaming delay of add       [%.6g ms limiter blocks]\n", Params::limiter_block_size_ms_low_latency);
+  printf ("  --limiter-block-size <ms>\n");
+  printf ("                        limiter block size for add          [%.6g]\n", Params::limiter_block_size_ms);
+  printf ("  --jobs <n>            threads for add and mp3 decoding    [%d]\n", Params::jobs);
+  printf ("  --async-io            read/write audio in background threads\n");
+  printf ("  --downmix             get: analyze mix of all channels (faster)\n");
   printf ("\n");
   printf ("The options to set the raw stream parameters (such as --raw-rate\n");
   printf ("or --raw-channels) are documented in the README file.\n");
@@ -85,14 +94,35 @@ print_usage_hls()
   printf ("  * watermark one HLS segment:\n");
   printf ("    audiowmark hls-add <input_ts> <output_ts> <message_hex>\n");
   printf ("\n");
+  printf ("  * watermark HLS segments requested via unix domain socket:\n");
+  printf ("    audiowmark hls-server <socket_path>\n");
+  printf ("\n");
+  printf ("  * prepare HLS segments and render two watermarked variants of each segment:\n");
+  printf ("    audiowmark hls-prepare-ab <input_dir> <output_dir> <playlist_name> <audio_master>\n");
+  printf ("\n");
+  printf ("  * detect the variant used for each segment (using the manifest written by hls-prepare-ab):\n");
+  printf ("    audiowmark hls-get-ab <manifest> <input_wav>\n");
+  printf ("\n");
   printf ("Global options:\n");
   printf ("  -q, --quiet           disable information messages\n");
   printf ("  --bit-rate            set AAC bitrate\n");
   printf ("\n");
+  printf ("Prepare options:\n");
+  printf ("  --jobs <n>            prepare segments in parallel        [%d]\n", Params::jobs);
+  printf ("  --context-format <f>  store context as flac/float/int16/lz [flac]\n");
+  printf ("  --exact-bit-rate      detect bit rate from all segments (not only a few)\n");
+  printf ("  --analysis            store precomputed analysis (larger segments, faster hls-add)\n");
+  printf ("  --ab-bits <n>         hls-prepare-ab: bits in the segment selection pattern [%d]\n", Params::hls_ab_bits);
+  printf ("\n");
   printf ("Watermarking options:\n");
   printf ("  --strength <s>        set watermark strength              [%.6g]\n", Params::water_delta * 1000);
   printf ("  --short <bits>        enable short payload mode\n");
   printf ("  --key <file>          load watermarking key from file\n");
+  printf ("\n");
+  printf ("Server options:\n");
+  printf ("  --jobs <n>            number of requests handled in parallel\n");
+  printf ("  --context-cache <mb>  keep up to <mb> MB of decoded contexts in memory\n");
+  printf ("  --segment-dir <dir>   directory containing the prepared segments [.]\n");
 }
 
 Format
@@ -124,6 +154,8 @@ parse_encoding (const string& str)
     return RawFormat::Encoding::SIGNED;
   if (str == "unsigned")
     return RawFormat::Encoding::UNSIGNED;
+  if (str == "float")
+    return RawFormat::Encoding::FLOAT;
   error ("audiowmark: unsupported encoding '%s'\n", str.c_str());
   exit (1);
 }
@@ -465,6 +497,15 @@ parse_shared_options (ArgParser& ap)
         }
       Params::payload_short = true;
     }
+  if (ap.parse_opt ("--jobs", i))
+    {
+      if (i < 1)
+        {
+          error ("audiowmark: number of jobs must be at least 1\n");
+          exit (1);
+        }
+      Params::jobs = i;
+    }
   ap.parse_opt ("--frames-per-bit", Params::frames_per_bit);
   if (ap.parse_opt ("--linear"))
     {
@@ -482,6 +523,7 @@ parse_add_options (ArgParser& ap)
 {
   string s;
   int i;
+  float f;
 
   ap.parse_opt ("--set-input-label", Params::input_label);
   ap.parse_opt ("--set-output-label", Params::output_label);
@@ -556,10 +598,35 @@ parse_add_options (ArgParser& ap)
       Params::raw_input_format.set_sample_rate (i);
       Params::raw_output_format.set_sample_rate (i);
     }
+  if (ap.parse_opt ("--output-rf64"))
+    {
+      Params::output_rf64 = true;
+    }
+  if (ap.parse_opt ("--async-io"))
+    {
+      Params::async_io = true;
+    }
+  if (ap.parse_opt ("--low-latency"))
+    {
+      Params::limiter_block_size_ms = Params::limiter_block_size_ms_low_latency;
+    }
+  if (ap.parse_opt ("--limiter-block-size", f))
+    {
+      if (f < 1)
+        {
+          error ("audiowmark: limiter block size must be at least 1 ms\n");
+          exit (1);
+        }
+      Params::limiter_block_size_ms = f;
+    }
   if (ap.parse_opt ("--test-no-limiter"))
     {
       Params::test_no_limiter = true;
     }
+  if (ap.parse_opt ("--test-no-fast-resampler"))
+    {
+      Params::test_no_fast_resampler = true;
+    }
 }
 
 void
@@ -576,6 +643,44 @@ parse_get_options (ArgParser& ap)
     {
       Params::test_no_sync = true;
     }
+  if (ap.parse_opt ("--downmix"))
+    {
+      Params::downmix = true;
+    }
+}
+
+void
+parse_hls_prepare_options (ArgParser& ap)
+{
+  ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
+
+  if (ap.parse_opt ("--exact-bit-rate"))
+    Params::hls_exact_bit_rate = true;
+
+  if (ap.parse_opt ("--analysis"))
+    Params::hls_analysis = true;
+
+  string context_format;
+  if (ap.parse_opt ("--context-format", context_format))
+    {
+      Error err = hls_context_format_from_string (context_format, Params::hls_context_format);
+      if (err)
+        {
+          error ("audiowmark: %s\n", err.message());
+          exit (1);
+        }
+    }
+
+  int jobs;
+  if (ap.parse_opt ("--jobs", jobs))
+    {
+      if (jobs < 1)
+        {
+          error ("audiowmark: number of jobs must be at least 1\n");
+          exit (1);
+        }
+      Params::jobs = jobs;
+    }
 }
 
 int
@@ -612,13 +717,61 @@ main (int argc, char **argv)
       if (ap.parse_args (3, args))
         return hls_add (args[0], args[1], args[2]);
     }
-  else if (ap.parse_cmd ("hls-prepare"))
+  else if (ap.parse_cmd ("hls-server"))
     {
+      parse_shared_options (ap);
+
       ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
 
+      int cache_mb;
+      if (ap.parse_opt ("--context-cache", cache_mb))
+        {
+          if (cache_mb < 0)
+            {
+              error ("audiowmark: context cache size must not be negative\n");
+              return 1;
+            }
+          Params::hls_context_cache_mb = cache_mb;
+        }
+      string segment_dir = ".";
+      ap.parse_opt ("--segment-dir", segment_dir);
+
+      if (ap.parse_args (1, args))
+        return hls_server (args[0], segment_dir);
+    }
+  else if (ap.parse_cmd ("hls-prepare"))
+    {
+      parse_hls_prepare_options (ap);
+
       if (ap.parse_args (4, args))
         return hls_prepare (args[0], args[1], args[2], args[3]);
     }
+  else if (ap.parse_cmd ("hls-prepare-ab"))
+    {
+      parse_shared_options (ap);
+      parse_hls_prepare_options (ap);
+
+      int ab_bits;
+      if (ap.parse_opt ("--ab-bits", ab_bits))
+        {
+          if (ab_bits < 1)
+            {
+              error ("audiowmark: number of ab bits must be at least 1\n");
+              return 1;
+            }
+          Params::hls_ab_bits = ab_bits;
+        }
+      if (ap.parse_args (4, args))
+        return hls_prepare_ab (args[0], args[1], args[2], args[3]);
+    }
+  else if (ap.parse_cmd ("hls-get-ab"))
+    {
+      parse_shared_options (ap);
+      parse_get_options (ap);
+
+      if (ap.parse_args (2, args))
+        return hls_get_ab (args[0], args[1]);
+    }
   else if (ap.parse_cmd ("add"))
     {
       parse_shared_options (ap);
@@ -631,6 +784,7 @@ main (int argc, char **argv)
     {
       parse_shared_options (ap);
       parse_get_options (ap);
+      Params::mp3_jobs = true; /* parallel decoding keeps all ranges in memory, which is ok as get/cmp load the whole file anyway */
 
       if (ap.parse_args (1, args))
         return get_watermark (args[0], /* no ber */ "");
@@ -639,6 +793,7 @@ main (int argc, char **argv)
     {
       parse_shared_options (ap);
       parse_get_options (ap);
+      Params::mp3_jobs = true;
 
       if (ap.parse_args (2, args))
         return get_watermark (args[0], args[1]);
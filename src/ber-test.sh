@@ -55,7 +55,14 @@ do
     PATTERN=${PATTERN:0:$((AWM_PATTERN_BITS / 4))}
     echo in_pattern $PATTERN
     echo in_flags $AWM_PARAMS $AWM_PARAMS_ADD --test-key $SEED
-    audiowmark add "$i" ${AWM_FILE}.wav $PATTERN $AWM_PARAMS $AWM_PARAMS_ADD --test-key $SEED --quiet
+    IN_FILE="$i"
+    if [ "x$AWM_CHANNELS" != "x" ]; then
+      # test other channel layouts (like 1 for mono or 6 for 5.1)
+      ffmpeg -i "$i" -ac $AWM_CHANNELS ${AWM_FILE}.in.wav -v quiet -nostdin
+      IN_FILE=${AWM_FILE}.in.wav
+      echo in_channels $AWM_CHANNELS
+    fi
+    audiowmark add "$IN_FILE" ${AWM_FILE}.wav $PATTERN $AWM_PARAMS $AWM_PARAMS_ADD --test-key $SEED --quiet
     CUT=0
     if [ "x$AWM_ALWAYS_CUT" != x ]; then
       CUT="$AWM_ALWAYS_CUT"
@@ -108,21 +115,21 @@ do
       for CLIP in $(seq $AWM_MULTI_CLIP)
       do
         audiowmark test-clip $OUT_FILE ${OUT_FILE}.clip.wav $((CLIP_SEED++)) $AWM_CLIP --test-key $SEED
-        audiowmark cmp ${OUT_FILE}.clip.wav $PATTERN $AWM_PARAMS --test-key $SEED $TEST_CUT_ARGS
+        audiowmark cmp ${OUT_FILE}.clip.wav $PATTERN $AWM_PARAMS $AWM_PARAMS_GET --test-key $SEED $TEST_CUT_ARGS
         rm ${OUT_FILE}.clip.wav
         echo
       done
     elif [ "x$AWM_REPORT" == "xtruncv" ]; then
       for TRUNC in $AWM_TRUNCATE
       do
-        audiowmark cmp $OUT_FILE $PATTERN $AWM_PARAMS --test-key $SEED $TEST_CUT_ARGS --test-truncate $TRUNC | sed "s/^/$TRUNC /g"
+        audiowmark cmp $OUT_FILE $PATTERN $AWM_PARAMS $AWM_PARAMS_GET --test-key $SEED $TEST_CUT_ARGS --test-truncate $TRUNC | sed "s/^/$TRUNC /g"
         echo
       done
     else
-      audiowmark cmp $OUT_FILE $PATTERN $AWM_PARAMS --test-key $SEED $TEST_CUT_ARGS
+      audiowmark cmp $OUT_FILE $PATTERN $AWM_PARAMS $AWM_PARAMS_GET --test-key $SEED $TEST_CUT_ARGS
       echo
     fi
-    rm -f ${AWM_FILE}.wav $OUT_FILE # cleanup temp files
+    rm -f ${AWM_FILE}.wav ${AWM_FILE}.in.wav $OUT_FILE # cleanup temp files
   done
 done | {
   if [ "x$AWM_REPORT" == "xfer" ]; then
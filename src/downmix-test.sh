@@ -0,0 +1,44 @@
+#!/bin/bash
+# compare detection with and without --downmix for different channel layouts
+#
+# usage: downmix-test.sh <n_seeds> [ <ber-test args> ]
+#
+# columns: channels, frame error rate (fer, in %) and user cpu time for
+#          one "audiowmark get", without / with --downmix
+SEEDS="$1"
+MAX_SEED=$(($SEEDS - 1))
+shift 1
+echo "n seeds       : $SEEDS"
+echo "ber-test args : $@"
+if [ "x$AWM_CHANNEL_LAYOUTS" == "x" ]; then
+  AWM_CHANNEL_LAYOUTS="1 2 6"
+fi
+
+get_time()
+{
+  TIMEFORMAT=%U
+  { time audiowmark get "$@" >/dev/null; } 2>&1
+}
+
+for channels in $AWM_CHANNEL_LAYOUTS
+do
+  # cpu time: watermark the first test file once, then detect with both settings
+  IN_FILE=$(ls test/T* | head -1)
+  ffmpeg -i "$IN_FILE" -ac $channels dmx-$channels.in.wav -v quiet -nostdin
+  audiowmark add dmx-$channels.in.wav dmx-$channels.wav 0123456789abcdef0011223344556677 --quiet
+  T_NORMAL=$(get_time dmx-$channels.wav)
+  T_DOWNMIX=$(get_time dmx-$channels.wav --downmix)
+  rm -f dmx-$channels.in.wav dmx-$channels.wav
+
+  FER_NORMAL=$(for seed in $(seq 0 $MAX_SEED)
+  do
+    echo $(AWM_CHANNELS=$channels AWM_SEEDS=$seed AWM_REPORT="fer" ber-test.sh "$@")
+  done | awk '{bad += $1; files += $2} END { print bad * 100. / files }')
+
+  FER_DOWNMIX=$(for seed in $(seq 0 $MAX_SEED)
+  do
+    echo $(AWM_CHANNELS=$channels AWM_PARAMS_GET="--downmix" AWM_SEEDS=$seed AWM_REPORT="fer" ber-test.sh "$@")
+  done | awk '{bad += $1; files += $2} END { print bad * 100. / files }')
+
+  echo "$channels channels: fer $FER_NORMAL% / $FER_DOWNMIX% - cpu ${T_NORMAL}s / ${T_DOWNMIX}s"
+done
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fastresampler.hh"
+
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using std::vector;
+
+static double
+sinc (double x)
+{
+  x = fabs (x);
+  if (x < 1e-6)
+    return 1;
+  x *= M_PI;
+  return sin (x) / x;
+}
+
+static double
+window (double x)
+{
+  x = fabs (x);
+  if (x >= 1)
+    return 0;
+  x *= M_PI;
+  return 0.384 + 0.500 * cos (x) + 0.116 * cos (2 * x);
+}
+
+static uint
+gcd (uint a, uint b)
+{
+  while (b)
+    {
+      uint t = a % b;
+      a = b;
+      b = t;
+    }
+  return a;
+}
+
+FastResampler::FastResampler (int n_channels, int old_rate, int new_rate, int hlen) :
+  n_channels (n_channels)
+{
+  assert (supports (old_rate, new_rate));
+
+  const uint g = gcd (old_rate, new_rate);
+  n_phases   = new_rate / g;
+  phase_step = old_rate / g;
+
+  /* for downsampling, lower the cutoff and make the filter longer; like zita's Resampler::setup(),
+   * the cutoff is also reduced by frel = 1 - 2.6 / hlen to leave room for the transition band
+   */
+  const double ratio = std::min (double (new_rate) / old_rate, 1.0);
+  const double fr = (1 - 2.6 / hlen) * ratio;
+  const uint   hl = ceil (hlen / ratio);
+
+  /* filter table for phase t contains the 2 * hl coefficients for a window starting at
+   * the oldest input sample; the output position is between window[hl - 1] and window[hl]
+   */
+  window_size = 2 * hl;
+  n_taps = (window_size + 3) / 4 * 4;
+  coeffs.resize (n_phases * n_taps);
+  for (uint p = 0; p < n_phases; p++)
+    {
+      float *c = &coeffs[p * n_taps];
+      for (uint i = 0; i < window_size; i++)
+        {
+          const double t = (hl - 1 - double (i)) + double (p) / n_phases; /* distance from output position */
+          c[i] = fr * sinc (t * fr) * window (t / hl);
+        }
+    }
+
+  /* avoid timeshift: the first output sample is located at the first input sample */
+  input.resize (n_channels);
+  in_avail = hl - 1;
+  for (auto& in : input)
+    in.resize (in_avail + n_taps);
+}
+
+bool
+FastResampler::supports (int old_rate, int new_rate)
+{
+  return (old_rate == 48000 && new_rate == 44100) || (old_rate == 44100 && new_rate == 48000);
+}
+
+void
+FastResampler::compact()
+{
+  /* remove input which is no longer needed for computing output */
+  if (in_pos < 4096)
+    return;
+
+  for (auto& in : input)
+    in.erase (in.begin(), in.begin() + in_pos);
+  in_avail -= in_pos;
+  in_pos = 0;
+}
+
+void
+FastResampler::write_frames (const float *frames, size_t n_frames)
+{
+  compact();
+
+  for (uint c = 0; c < n_channels; c++)
+    {
+      vector<float>& in = input[c];
+
+      in.resize (in_avail + n_frames + n_taps); /* keep zero padding at end */
+      for (size_t i = 0; i < n_frames; i++)
+        in[in_avail + i] = frames[i * n_channels + c];
+    }
+  in_avail += n_frames;
+}
+
+size_t
+FastResampler::can_read_frames() const
+{
+  /* output sample j needs input samples [window_start, window_start + window_size), the rest
+   * of the n_taps samples read by dot_product() is either input or zero padding
+   */
+  if (in_pos + window_size > in_avail)
+    return 0;
+
+  const size_t max_advance = in_avail - window_size - in_pos;
+  return (max_advance * n_phases + n_phases - 1 - phase) / phase_step + 1;
+}
+
+static inline float
+dot_product (const float *a, const float *b, uint n)
+{
+#ifdef __SSE2__
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  uint i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      sum0 = _mm_add_ps (sum0, _mm_mul_ps (_mm_loadu_ps (a + i), _mm_loadu_ps (b + i)));
+      sum1 = _mm_add_ps (sum1, _mm_mul_ps (_mm_loadu_ps (a + i + 4), _mm_loadu_ps (b + i + 4)));
+    }
+  if (i < n) /* n is a multiple of 4 */
+    sum0 = _mm_add_ps (sum0, _mm_mul_ps (_mm_loadu_ps (a + i), _mm_loadu_ps (b + i)));
+
+  float sum[4];
+  _mm_storeu_ps (sum, _mm_add_ps (sum0, sum1));
+  return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+#else
+  float sum = 0;
+  for (uint i = 0; i < n; i++)
+    sum += a[i] * b[i];
+  return sum;
+#endif
+}
+
+void
+FastResampler::read_frames (float *frames, size_t n_frames)
+{
+  assert (n_frames <= can_read_frames());
+
+  for (size_t j = 0; j < n_frames; j++)
+    {
+      const float *c = &coeffs[phase * n_taps];
+      for (uint ch = 0; ch < n_channels; ch++)
+        frames[j * n_channels + ch] = dot_product (&input[ch][in_pos], c, n_taps);
+
+      phase += phase_step;
+      in_pos += phase / n_phases;
+      phase %= n_phases;
+    }
+}
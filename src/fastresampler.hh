@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_FAST_RESAMPLER_HH
+#define AUDIOWMARK_FAST_RESAMPLER_HH
+
+#include <vector>
+#include <sys/types.h>
+
+/* polyphase resampler for the common 48000 Hz <-> 44100 Hz case
+ *
+ * the filter design is the same as zita-resampler's Resampler (windowed sinc,
+ * hlen = half filter length at the lower sample rate, cutoff reduced by
+ * 1 - 2.6 / hlen), but the samples are stored per channel
+ * and each output sample is computed as one contiguous dot product, which
+ * can be vectorized
+ */
+class FastResampler
+{
+  uint  n_channels = 0;
+  uint  n_phases   = 0;     // number of filter phases (output rate / gcd)
+  uint  phase_step = 0;     // phase increment per output sample (input rate / gcd)
+  uint  window_size = 0;    // filter length
+  uint  n_taps     = 0;     // filter length, padded to a multiple of 4
+  uint  phase      = 0;
+  size_t in_pos    = 0;     // start of filter window for the next output sample
+  size_t in_avail  = 0;     // number of input frames per channel in input buffers
+
+  std::vector<float>              coeffs;   // n_phases * n_taps
+  std::vector<std::vector<float>> input;    // one buffer per channel, zero padded at the end
+
+  void compact();
+public:
+  FastResampler (int n_channels, int old_rate, int new_rate, int hlen);
+
+  static bool supports (int old_rate, int new_rate);
+
+  void   write_frames (const float *frames, size_t n_frames);
+  size_t can_read_frames() const;
+  void   read_frames (float *frames, size_t n_frames);
+};
+
+#endif /* AUDIOWMARK_FAST_RESAMPLER_HH */
@@ -20,11 +20,15 @@
 #include <fftw3.h>
 
 #include <map>
+#include <mutex>
 
 using std::vector;
 using std::complex;
 using std::map;
 
+/* fftw planning is not thread-safe, but executing plans is */
+static std::mutex plan_mutex;
+
 float *
 new_array_float (size_t N)
 {
@@ -44,6 +48,7 @@ fftar_float (size_t N, float *in, float *out)
 {
   static map<int, fftwf_plan> plan_for_size;
 
+  std::unique_lock<std::mutex> lock (plan_mutex);
   fftwf_plan& plan = plan_for_size[N];
   if (!plan)
     {
@@ -53,6 +58,8 @@ fftar_float (size_t N, float *in, float *out)
 
       // we add code for saving plans here, and use patient planning
     }
+  lock.unlock();
+
   fftwf_execute_dft_r2c (plan, in, (fftwf_complex *) out);
 }
 
@@ -61,6 +68,7 @@ fftsr_float (size_t N, float *in, float *out)
 {
   static map<int, fftwf_plan> plan_for_size;
 
+  std::unique_lock<std::mutex> lock (plan_mutex);
   fftwf_plan& plan = plan_for_size[N];
   if (!plan)
     {
@@ -70,6 +78,8 @@ fftsr_float (size_t N, float *in, float *out)
 
       // we add code for saving plans here, and use patient planning
     }
+  lock.unlock();
+
   fftwf_execute_dft_c2r (plan, (fftwf_complex *)in, out);
 }
 
@@ -0,0 +1,78 @@
+#!/bin/bash
+# check that hls-get-ab finds the pattern of a stream assembled from the hls-prepare-ab variants
+#
+# usage: hls-ab-test.sh [ <input_file> ]
+#
+# the first 160 seconds of the input file are split into hls segments of 10 seconds; without
+# input file, the first test file is used
+#
+#  - with --ab-bits 6, the pattern must be detected exactly
+#  - with more --ab-bits than segments, the bits without segment must be reported as '?'
+IN_FILE="$1"
+if [ "x$IN_FILE" == "x" ]; then
+  IN_FILE=$(ls test/T* | head -1)
+fi
+DIR=$(mktemp -d hls-ab-test.XXXXXX)
+trap "rm -rf $DIR" EXIT
+
+die()
+{
+  echo "hls-ab-test: $@" >&2
+  exit 1
+}
+
+# assemble the stream a viewer with pattern <pattern> would get and decode it to <out_wav>
+assemble()
+{
+  local AB_DIR="$1" PATTERN="$2" OUT_WAV="$3" CONCAT=""
+  while read tag bit start_pos size name
+  do
+    CONCAT="$CONCAT|$AB_DIR/${PATTERN:$bit:1}/$name"
+  done < <(grep '^segment' "$AB_DIR/ab.manifest")
+  ffmpeg -i "concat:${CONCAT#|}" "$OUT_WAV" -v quiet -nostdin || die "decoding assembled stream failed"
+}
+
+get_pattern()
+{
+  audiowmark hls-get-ab "$@" | awk '/^pattern/ { print $2 }'
+}
+
+ffmpeg -i "$IN_FILE" -t 160 -vn "$DIR/master.wav" -v quiet -nostdin || die "creating master failed"
+mkdir "$DIR/in"
+ffmpeg -i "$DIR/master.wav" -f hls -c:a aac -ab 192k -hls_playlist_type vod -hls_list_size 0 -hls_time 10 \
+  -hls_segment_filename "$DIR/in/%d.ts" "$DIR/in/out.m3u8" -v quiet -nostdin || die "creating hls segments failed"
+
+# pattern shorter than the stream: each bit is carried by more than one segment
+PATTERN=101100
+audiowmark hls-prepare-ab --ab-bits ${#PATTERN} "$DIR/in" "$DIR/ab" out.m3u8 "$DIR/master.wav" --quiet || die "hls-prepare-ab failed"
+N_SEGMENTS=$(grep -c '^segment' "$DIR/ab/ab.manifest")
+
+for pattern in $PATTERN 010011
+do
+  assemble "$DIR/ab" $pattern "$DIR/stream-$pattern.wav"
+  RESULT=$(get_pattern "$DIR/ab/ab.manifest" "$DIR/stream-$pattern.wav")
+  [ "x$RESULT" == "x$pattern" ] || die "pattern $pattern: got '$RESULT'"
+  echo "ab-bits ${#pattern}, $N_SEGMENTS segments: pattern $pattern ok"
+done
+
+# pattern longer than the stream: bits without any segment can't be detected
+AB_BITS=$((N_SEGMENTS + 4))
+PATTERN=$(for i in $(seq $AB_BITS); do echo -n $((RANDOM % 2)); done)
+audiowmark hls-prepare-ab --ab-bits $AB_BITS "$DIR/in" "$DIR/ab-long" out.m3u8 "$DIR/master.wav" --quiet || die "hls-prepare-ab failed"
+assemble "$DIR/ab-long" $PATTERN "$DIR/stream-long.wav"
+RESULT=$(get_pattern "$DIR/ab-long/ab.manifest" "$DIR/stream-long.wav")
+[ ${#RESULT} == $AB_BITS ] || die "pattern $PATTERN: got '$RESULT'"
+
+# segments at the end of the stream (after the last complete watermark block) may be '?' as well
+N_DETECTED=0
+for i in $(seq 0 $((AB_BITS - 1)))
+do
+  if [ $i -ge $N_SEGMENTS ]; then
+    [ "${RESULT:$i:1}" == "?" ] || die "pattern $PATTERN: got '$RESULT', bit $i should be '?'"
+  elif [ "${RESULT:$i:1}" != "?" ]; then
+    [ "${RESULT:$i:1}" == "${PATTERN:$i:1}" ] || die "pattern $PATTERN: got '$RESULT', bit $i is wrong"
+    N_DETECTED=$((N_DETECTED + 1))
+  fi
+done
+[ $((N_DETECTED * 2)) -ge $N_SEGMENTS ] || die "pattern $PATTERN: got '$RESULT', too few bits detected"
+echo "ab-bits $AB_BITS, $N_SEGMENTS segments: pattern $PATTERN ok ($RESULT)"
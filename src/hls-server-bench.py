@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+
+# load generator for audiowmark hls-server
+#
+# usage: hls-server-bench.py <socket_path> <segment>... [--clients N] [--requests N] [--cli]
+#
+# sends watermarking requests for the given (prepared) segments from N concurrent clients
+# and reports throughput and latency; with --cli, the same number of requests is run by
+# starting one "audiowmark hls-add" process per request (for comparison)
+#
+# segment names must be relative to the --segment-dir of the server; run the script from
+# that directory so that --cli finds the same files
+
+import argparse
+import os
+import random
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+def read_line (sock_file):
+  line = sock_file.readline()
+  if not line:
+    raise Exception ("server closed connection")
+  return line.decode().rstrip ("\n")
+
+def server_request (sock_file, segment, message):
+  sock_file.write (("add %s %s\n" % (segment, message)).encode())
+  sock_file.flush()
+
+  status = read_line (sock_file).split (" ", 1)
+  if status[0] != "ok":
+    raise Exception ("request failed: %s" % " ".join (status))
+  data = sock_file.read (int (status[1]))
+  if len (data) != int (status[1]):
+    raise Exception ("short read")
+  return data
+
+def cli_request (segment, message, out_dir):
+  out_ts = os.path.join (out_dir, "out-%d.ts" % threading.get_ident())
+  subprocess.run (["audiowmark", "hls-add", "-q", segment, out_ts, message], check=True)
+  with open (out_ts, "rb") as f:
+    return f.read()
+
+def random_message():
+  return "%032x" % random.getrandbits (128)
+
+def run_client (args, n_requests, latencies, out_dir):
+  sock_file = None
+  if not args.cli:
+    sock = socket.socket (socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect (args.socket_path)
+    sock_file = sock.makefile ("rwb")
+
+  for i in range (n_requests):
+    segment = random.choice (args.segments)
+    start_time = time.time()
+    if args.cli:
+      cli_request (segment, random_message(), out_dir)
+    else:
+      server_request (sock_file, segment, random_message())
+    latencies.append (time.time() - start_time)
+
+parser = argparse.ArgumentParser (description="load generator for audiowmark hls-server")
+parser.add_argument ("socket_path")
+parser.add_argument ("segments", nargs="+")
+parser.add_argument ("--clients", type=int, default=4, help="number of concurrent clients")
+parser.add_argument ("--requests", type=int, default=100, help="total number of requests")
+parser.add_argument ("--cli", action="store_true", help="run one audiowmark hls-add process per request instead")
+args = parser.parse_args()
+
+latencies = []
+threads = []
+with tempfile.TemporaryDirectory() as out_dir:
+  start_time = time.time()
+  for c in range (args.clients):
+    n = args.requests // args.clients + (1 if c < args.requests % args.clients else 0)
+    t = threading.Thread (target=run_client, args=(args, n, latencies, out_dir))
+    t.start()
+    threads.append (t)
+  for t in threads:
+    t.join()
+  total_time = time.time() - start_time
+
+if len (latencies) != args.requests:
+  print ("error: only %d of %d requests succeeded" % (len (latencies), args.requests))
+  sys.exit (1)
+
+latencies.sort()
+def percentile (p):
+  return latencies[min (len (latencies) - 1, int (len (latencies) * p / 100))] * 1000
+
+print ("mode        %s" % ("cli (hls-add per request)" if args.cli else "hls-server"))
+print ("clients     %d" % args.clients)
+print ("requests    %d" % args.requests)
+print ("total       %.2f s" % total_time)
+print ("throughput  %.2f requests/s" % (args.requests / total_time))
+print ("latency     p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms" % (percentile (50), percentile (90), percentile (99), latencies[-1] * 1000))
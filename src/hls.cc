@@ -17,6 +17,9 @@
 
 #include <string>
 #include <regex>
+#include <thread>
+#include <atomic>
+#include <functional>
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -25,10 +28,9 @@
 
 #include "utils.hh"
 #include "mpegts.hh"
-#include "sfinputstream.hh"
-#include "sfoutputstream.hh"
 #include "wmcommon.hh"
 #include "wavdata.hh"
+#include "hlscontext.hh"
 
 #include "config.h"
 
@@ -52,9 +54,24 @@ hls_add (const string& infile, const string& outfile, const string& bits)
   error ("audiowmark: hls support is not available in this build of audiowmark\n");
   return 1;
 }
+
+int
+hls_add (const string& infile, vector<unsigned char>& out_data, const string& bits)
+{
+  error ("audiowmark: hls support is not available in this build of audiowmark\n");
+  return 1;
+}
+
+int
+hls_prepare_ab (const string& in_dir, const string& out_dir, const string& filename, const string& audio_master)
+{
+  error ("audiowmark: hls support is not available in this build of audiowmark\n");
+  return 1;
+}
 #else
 
 #include "hlsoutputstream.hh"
+#include "hlsinputstream.hh"
 
 static bool
 file_exists (const string& filename)
@@ -185,49 +202,66 @@ run (const vector<string>& args, vector<string> *pipe_out = nullptr)
 Error
 ff_decode (const string& filename, WavData& out_wav_data)
 {
-  FILE *tmp_file = tmpfile();
-  ScopedFile tmp_file_s (tmp_file);
-  string tmp_file_name = string_printf ("/dev/fd/%d", fileno (tmp_file));
+  HLSInputStream in_stream;
 
-  if (!tmp_file)
-    return Error ("failed to create temp file");
-
-  Error err = run ({"ffmpeg", "-v", "error", "-y", "-f",  "mpegts", "-i", filename, "-f", "wav", tmp_file_name});
+  Error err = in_stream.open (filename);
   if (err)
     return err;
 
-  err = out_wav_data.load (tmp_file_name);
+  err = out_wav_data.load (&in_stream);
   return err;
 }
 
-int
-hls_add (const string& infile, const string& outfile, const string& bits)
+static HLSContextCache context_cache;
+
+/* samples before the segment which hls-add passes to the AAC encoder (the rest of the previous context is only needed for watermarking) */
+static size_t
+aac_prev_context (size_t prev_size)
 {
-  TSReader reader;
+  return min<size_t> (1024 * 3, prev_size);
+}
 
-  Error err = reader.load (infile);
-  if (err)
-    {
-      error ("hls: %s\n", err.message());
-      return 1;
-    }
+/* load and decode the context of a prepared segment (or reuse a cached version, if enabled) */
+static Error
+load_context (const string& infile, std::shared_ptr<const HLSContext>& context)
+{
+  HLSContextCache::FileKey key;
 
-  const TSReader::Entry *full_flac = reader.find ("full.flac");
-  if (!full_flac)
+  const bool use_cache = Params::hls_context_cache_mb > 0 && infile != "-" && HLSContextCache::file_key (infile, key);
+  if (use_cache)
     {
-      error ("hls: no embedded context found in %s\n", infile.c_str());
-      return 1;
+      context_cache.set_max_bytes (Params::hls_context_cache_mb * 1024 * 1024);
+
+      context = context_cache.lookup (key);
+      if (context)
+        return Error::Code::NONE;
     }
 
-  SFInputStream in_stream;
-  err = in_stream.open (&full_flac->data);
+  TSReader reader;
+
+  Error err = reader.load (infile);
   if (err)
-    {
-      error ("hls: %s\n", err.message());
-      return 1;
-    }
+    return err;
+
+  auto new_context = std::make_shared<HLSContext>();
+  err = hls_context_load (reader, *new_context);
+  if (err)
+    return Error (string_printf ("%s: %s", infile.c_str(), err.message()));
 
-  map<string, string> vars = reader.parse_vars ("vars");
+  context = new_context;
+  if (use_cache)
+    context_cache.insert (key, context);
+
+  return Error::Code::NONE;
+}
+
+/* watermark a prepared segment, writing the output segment to outfile or (if out_data is set) to memory */
+static int
+hls_add_segment (const std::shared_ptr<const HLSContext>& context, const string& outfile, vector<unsigned char> *out_data, const string& bits)
+{
+  HLSContextInputStream in_stream (context);
+
+  const map<string, string>& vars = context->vars;
   bool missing_vars = false;
 
   auto get_var = [&] (const std::string& var) {
@@ -246,7 +280,7 @@ hls_add (const string& infile, const string& outfile, const string& bits)
   size_t size      = atoi (get_var ("size"));
   double pts_start = atof (get_var ("pts_start"));
   int    bit_rate  = atoi (get_var ("bit_rate"));
-  size_t prev_ctx  = min<size_t> (1024 * 3, prev_size);
+  size_t prev_ctx  = aac_prev_context (prev_size);
 
   string channel_layout = get_var ("channel_layout");
 
@@ -269,14 +303,21 @@ hls_add (const string& infile, const string& outfile, const string& bits)
   const size_t delete_input_start = prev_size - prev_ctx;
   const size_t keep_aac_frames = size / 1024;
 
-  err = out_stream.open (outfile, cut_aac_frames, keep_aac_frames, pts_start, delete_input_start);
+  Error err;
+  if (out_data)
+    err = out_stream.open (out_data, cut_aac_frames, keep_aac_frames, pts_start, delete_input_start);
+  else
+    err = out_stream.open (outfile, cut_aac_frames, keep_aac_frames, pts_start, delete_input_start);
   if (err)
     {
       error ("audiowmark: error opening HLS output stream %s: %s\n", outfile.c_str(), err.message());
       return 1;
     }
 
-  int wm_rc = add_stream_watermark (&in_stream, &out_stream, bits, start_pos - prev_size);
+  /* only the watermark after delete_input_start is used, and HLSOutputStream stops the watermarking after the last aac frame we keep */
+  const WatermarkAnalysis *analysis = context->analysis.n_frames() ? &context->analysis : nullptr;
+
+  int wm_rc = add_stream_watermark (&in_stream, &out_stream, bits, start_pos - prev_size, delete_input_start, analysis);
   if (wm_rc != 0)
     return wm_rc;
 
@@ -284,27 +325,93 @@ hls_add (const string& infile, const string& outfile, const string& bits)
   return 0;
 }
 
+static int
+hls_add_segment (const string& infile, const string& outfile, vector<unsigned char> *out_data, const string& bits)
+{
+  std::shared_ptr<const HLSContext> context;
+
+  Error err = load_context (infile, context);
+  if (err)
+    {
+      error ("hls: %s\n", err.message());
+      return 1;
+    }
+  return hls_add_segment (context, outfile, out_data, bits);
+}
+
+int
+hls_add (const string& infile, const string& outfile, const string& bits)
+{
+  return hls_add_segment (infile, outfile, nullptr, bits);
+}
+
+int
+hls_add (const string& infile, vector<unsigned char>& out_data, const string& bits)
+{
+  return hls_add_segment (infile, "<memory>", &out_data, bits);
+}
+
+/* call fn (i) for i in [0, n), using up to n_threads threads */
+static void
+run_jobs (size_t n, int n_threads, const std::function<void (size_t)>& fn)
+{
+  std::atomic<size_t> next_index { 0 };
+
+  auto worker = [&] {
+    for (size_t i = next_index++; i < n; i = next_index++)
+      fn (i);
+  };
+
+  vector<std::thread> threads;
+  for (size_t t = 1; t < min<size_t> (n_threads, n); t++)
+    threads.emplace_back (worker);
+
+  worker();
+
+  for (auto& thread : threads)
+    thread.join();
+}
+
+/* compute the AAC bit rate from the ADTS frame headers of the input segments
+ *
+ * for long streams, looking at a few segments (evenly spread over the stream) is usually good enough
+ */
 Error
-bit_rate_from_m3u8 (const string& m3u8, const WavData& wav_data, int& bit_rate)
+bit_rate_from_segments (const string& in_dir, const vector<string>& segment_names, int& bit_rate)
 {
-  FILE *tmp_file = tmpfile();
-  ScopedFile tmp_file_s (tmp_file);
-  string tmp_file_name = string_printf ("/dev/fd/%d", fileno (tmp_file));
+  const size_t max_sample_segments = 10;
 
-  if (!tmp_file)
-    return Error ("failed to create temp file");
+  vector<string> names;
+  if (Params::hls_exact_bit_rate || segment_names.size() <= max_sample_segments)
+    {
+      names = segment_names;
+    }
+  else
+    {
+      for (size_t i = 0; i < max_sample_segments; i++)
+        names.push_back (segment_names[i * (segment_names.size() - 1) / (max_sample_segments - 1)]);
+    }
 
-  Error err = run ({"ffmpeg", "-v", "error", "-y", "-i", m3u8, "-c:a", "copy", "-f", "adts", tmp_file_name});
-  if (err)
-    return err;
+  vector<TSAudioInfo> infos (names.size());
+  vector<Error>       errors (names.size());
+  run_jobs (names.size(), Params::jobs, [&] (size_t index) {
+    errors[index] = ts_audio_info (in_dir + "/" + names[index], infos[index]);
+  });
 
-  struct stat stat_buf;
-  if (stat (tmp_file_name.c_str(), &stat_buf) != 0)
+  double adts_bytes = 0;
+  double seconds = 0;
+  for (size_t i = 0; i < names.size(); i++)
     {
-      return Error (string_printf ("failed to stat temporary aac file: %s", strerror (errno)));
+      if (errors[i])
+        return errors[i];
+
+      adts_bytes += infos[i].adts_bytes;
+      seconds    += infos[i].n_frames * 1024.0 / infos[i].sample_rate;
     }
-  double seconds = double (wav_data.n_frames()) / wav_data.sample_rate();
-  bit_rate = stat_buf.st_size / seconds * 8;
+  if (seconds <= 0)
+    return Error ("no audio found in input segments");
+
+  bit_rate = adts_bytes / seconds * 8;
   return Error::Code::NONE;
 }
 
@@ -331,7 +438,7 @@ load_audio_master (const string& filename, WavData& audio_master_data)
 }
 
 Error
-probe_input_segment (const string& filename, map<string, string>& params)
+probe_input_segment (const string& filename, HLSInputStream& in_stream, map<string, string>& params)
 {
   TSReader reader;
 
@@ -348,40 +455,38 @@ probe_input_segment (const string& filename, map<string, string>& params)
       return Error ("input for hls-prepare must not contain context");
     }
 
-  vector<string> format_out;
-  err = run ({"ffprobe", "-v", "error", "-print_format", "compact", "-show_streams", filename}, &format_out);
+  err = in_stream.open (filename);
   if (err)
     {
       error ("audiowmark: hls: failed to validate input file: %s\n", filename.c_str());
       return err;
     }
-  for (auto o : format_out)
+  /* same names as ffprobe -show_streams output */
+  params["nb_streams"]     = string_printf ("%d", in_stream.n_streams());
+  params["codec_name"]     = in_stream.codec_name();
+  params["channel_layout"] = in_stream.channel_layout();
+  if (in_stream.have_start_time())
+    params["start_time"] = string_printf ("%f", in_stream.start_time());
+
+  return Error::Code::NONE;
+}
+
+static Error
+decode_n_frames (HLSInputStream& in_stream, size_t& n_frames)
+{
+  vector<float> samples;
+
+  n_frames = 0;
+  do
     {
-      /* parse assignments stream|index=0|codec_name=aac|... */
-      string key, value;
-      bool in_key = true;
-      for (char c : '|' + o + '|')
-        {
-          if (c == '=')
-            {
-              in_key = false;
-            }
-          else if (c == '|')
-            {
-              params[key] = value;
-              in_key = true;
-              key = "";
-              value = "";
-            }
-          else
-            {
-              if (in_key)
-                key += c;
-              else
-                value += c;
-            }
-        }
+      Error err = in_stream.read_frames (samples, 65536);
+      if (err)
+        return err;
+
+      n_frames += samples.size() / in_stream.n_channels();
     }
+  while (samples.size());
+
   return Error::Code::NONE;
 }
 
@@ -432,7 +537,10 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
   {
     string              name;
     size_t              size;
+    size_t              start_pos = 0;
+    size_t              prev_size = 0;
     map<string, string> vars;
+    string              error_message;
   };
   vector<Segment> segments;
   char buffer[1024];
@@ -462,51 +570,70 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
         }
       line++;
     }
-  for (auto& segment : segments)
-    {
-      map<string, string> params;
-      string segname = in_dir + "/" + segment.name;
+  /* segments are independent, so we can probe/decode them in parallel */
+  run_jobs (segments.size(), Params::jobs, [&] (size_t index) {
+    Segment& segment = segments[index];
+    map<string, string> params;
+    string segname = in_dir + "/" + segment.name;
+
+    HLSInputStream in_stream;
+    Error err = probe_input_segment (segname, in_stream, params);
+    if (err)
+      {
+        segment.error_message = string_printf ("hls: %s", err.message());
+        return;
+      }
+    /* validate input segment */
+    if (atoi (params["nb_streams"].c_str()) != 1)
+      {
+        segment.error_message = string_printf ("hls segment '%s' contains more than one stream", segname.c_str());
+        return;
+      }
+    if (params["codec_name"] != "aac")
+      {
+        segment.error_message = string_printf ("hls segment '%s' is not encoded using AAC", segname.c_str());
+        return;
+      }
 
-      Error err = probe_input_segment (segname, params);
-      if (err)
-        {
-          error ("audiowmark: hls: %s\n", err.message());
-          return 1;
-        }
-      /* validate input segment */
-      if (atoi (params["index"].c_str()) != 0)
-        {
-          error ("audiowmark: hls segment '%s' contains more than one stream\n", segname.c_str());
-          return 1;
-        }
-      if (params["codec_name"] != "aac")
-        {
-          error ("audiowmark: hls segment '%s' is not encoded using AAC\n", segname.c_str());
-          return 1;
-        }
+    /* get segment parameters */
+    if (params["channel_layout"].empty())
+      {
+        segment.error_message = string_printf ("hls segment '%s' has no channel_layout entry", segname.c_str());
+        return;
+      }
+    segment.vars["channel_layout"] = params["channel_layout"];
 
-      /* get segment parameters */
-      if (params["channel_layout"].empty())
-        {
-          error ("audiowmark: hls segment '%s' has no channel_layout entry\n", segname.c_str());
-          return 1;
-        }
-      segment.vars["channel_layout"] = params["channel_layout"];
+    /* get start pts */
+    if (params["start_time"].empty())
+      {
+        segment.error_message = string_printf ("hls segment '%s' has no start_time entry", segname.c_str());
+        return;
+      }
+    segment.vars["pts_start"] = params["start_time"];
 
-      /* get start pts */
-      if (params["start_time"].empty())
+    /* decode segment (in process) to get the number of samples */
+    err = decode_n_frames (in_stream, segment.size);
+    if (err)
+      segment.error_message = string_printf ("hls: decoding segment '%s' failed: %s", segname.c_str(), err.message());
+  });
+  for (auto& segment : segments)
+    {
+      if (!segment.error_message.empty())
         {
-          error ("audiowmark: hls segment '%s' has no start_time entry\n", segname.c_str());
+          error ("audiowmark: %s\n", segment.error_message.c_str());
           return 1;
         }
-      segment.vars["pts_start"] = params["start_time"];
     }
 
   /* find bitrate for AAC encoder */
   int bit_rate = 0;
   if (!Params::hls_bit_rate)
     {
-      err = bit_rate_from_m3u8 (in_dir + "/" + filename, audio_master_data, bit_rate);
+      vector<string> segment_names;
+      for (const auto& segment : segments)
+        segment_names.push_back (segment.name);
+
+      err = bit_rate_from_segments (in_dir, segment_names, bit_rate);
       if (err)
         {
           error ("audiowmark: bit-rate detection failed: %s\n", err.message());
@@ -521,18 +648,13 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
     }
 
   info ("Segments:     %zd\n", segments.size());
+  if (Params::jobs > 1)
+    info ("Jobs:         %d\n", Params::jobs);
+
+  /* the only dependency between segments is the start position, so compute it first */
   size_t start_pos = 0;
   for (auto& segment : segments)
     {
-      WavData out;
-      Error err = ff_decode (in_dir + "/" + segment.name, out);
-      if (err)
-        {
-          error ("audiowmark: hls: ff_decode failed: %s\n", err.message());
-          return 1;
-        }
-      segment.size = out.n_values() / out.n_channels();
-
       if ((segment.size % 1024) != 0)
         {
           error ("audiowmark: hls input segments need 1024-sample alignment (due to AAC)\n");
@@ -540,71 +662,378 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
         }
 
       /* store 3 seconds of the context before this segment and after this segment (if available) */
-      const size_t ctx_3sec = 3 * out.sample_rate();
+      const size_t ctx_3sec = 3 * audio_master_data.sample_rate();
       const size_t prev_size = min<size_t> (start_pos, ctx_3sec);
-      const size_t next_size = min<size_t> (audio_master_data.n_frames() - (segment.size + start_pos), ctx_3sec);
+
+      segment.start_pos = start_pos;
+      segment.prev_size = prev_size;
 
       segment.vars["start_pos"] = string_printf ("%zd", start_pos);
       segment.vars["size"] = string_printf ("%zd", segment.size);
       segment.vars["prev_size"] = string_printf ("%zd", prev_size);
       segment.vars["bit_rate"] = string_printf ("%d", bit_rate);
+      segment.vars["channels"] = string_printf ("%d", audio_master_data.n_channels());
+      segment.vars["sample_rate"] = string_printf ("%d", audio_master_data.sample_rate());
+      segment.vars["bit_depth"] = string_printf ("%d", audio_master_data.bit_depth());
 
-      /* write audio segment with context */
-      const size_t start_point = start_pos - prev_size;
-      const size_t end_point = start_point + prev_size + segment.size + next_size;
+      string out_segment = out_dir + "/" + segment.name;
+      if (file_exists (out_segment))
+        {
+          error ("audiowmark: output file already exists: %s\n", out_segment.c_str());
+          return 1;
+        }
+
+      /* start position for the next segment */
+      start_pos += segment.size;
+    }
+  if (start_pos > audio_master_data.n_frames())
+    {
+      error ("audiowmark: hls segments are longer than the audio master\n");
+      return 1;
+    }
 
-      vector<float> out_signal (audio_master_data.samples().begin() + start_point * audio_master_data.n_channels(),
-                                audio_master_data.samples().begin() + end_point * audio_master_data.n_channels());
+  /* encode context and write output segments in parallel */
+  run_jobs (segments.size(), Params::jobs, [&] (size_t index) {
+    Segment& segment = segments[index];
 
-      vector<unsigned char> full_flac_mem;
-      SFOutputStream out_stream;
-      err = out_stream.open (&full_flac_mem,
-                             audio_master_data.n_channels(), audio_master_data.sample_rate(), audio_master_data.bit_depth(),
-                             SFOutputStream::OutFormat::FLAC);
-      if (err)
+    const size_t n_channels = audio_master_data.n_channels();
+    const size_t ctx_3sec   = 3 * audio_master_data.sample_rate();
+    const size_t next_size  = min<size_t> (audio_master_data.n_frames() - (segment.size + segment.start_pos), ctx_3sec);
+
+    /* write audio segment with context */
+    const size_t start_point = segment.start_pos - segment.prev_size;
+    const size_t end_point = start_point + segment.prev_size + segment.size + next_size;
+
+    vector<float> out_signal ((end_point - start_point) * n_channels);
+    audio_master_data.get_samples (start_point * n_channels, out_signal.size(), out_signal.data());
+
+    vector<unsigned char> context_mem;
+    Error err = hls_context_encode (out_signal,
+                                    audio_master_data.n_channels(), audio_master_data.sample_rate(), audio_master_data.bit_depth(),
+                                    Params::hls_context_format, context_mem);
+    if (err)
+      {
+        segment.error_message = string_printf ("hls: encoding context failed: %s", err.message());
+        return;
+      }
+
+    vector<unsigned char> analysis_mem;
+    if (Params::hls_analysis)
+      {
+        /* analyze the context exactly like hls-add will see it (after decoding, the context format may be lossy) */
+        auto context = std::make_shared<HLSContext>();
+        context->vars = segment.vars;
+
+        err = hls_context_decode (Params::hls_context_format, context_mem, *context);
+        if (err)
+          {
+            segment.error_message = string_printf ("hls: decoding context failed: %s", err.message());
+            return;
+          }
+        HLSContextInputStream in_stream (context);
+        WatermarkAnalysis     analysis;
+
+        const size_t zero_frames    = segment.start_pos - segment.prev_size;
+        const size_t discard_frames = segment.prev_size - aac_prev_context (segment.prev_size);
+        if (analyze_stream_watermark (&in_stream, zero_frames, discard_frames, analysis) != 0)
+          {
+            segment.error_message = string_printf ("hls: analyzing segment %s failed", segment.name.c_str());
+            return;
+          }
+        err = hls_analysis_encode (analysis, analysis_mem);
+        if (err)
+          {
+            segment.error_message = string_printf ("hls: encoding analysis failed: %s", err.message());
+            return;
+          }
+        segment.vars["analysis_first_frame"] = string_printf ("%zd", analysis.first_frame);
+      }
+
+    /* store everything we need in a mpegts file */
+    TSWriter writer;
+
+    writer.append_data (hls_context_entry_name (Params::hls_context_format), std::move (context_mem));
+    if (Params::hls_analysis)
+      writer.append_data (hls_analysis_entry_name(), std::move (analysis_mem));
+    writer.append_vars ("vars", segment.vars);
+
+    string out_segment = out_dir + "/" + segment.name;
+    err = writer.process (in_dir + "/" + segment.name, out_segment);
+    if (err)
+      segment.error_message = string_printf ("processing hls segment %s failed: %s", segment.name.c_str(), err.message());
+  });
+  for (auto& segment : segments)
+    {
+      if (!segment.error_message.empty())
         {
-          error ("audiowmark: hls: open context flac failed: %s\n", err.message());
+          error ("audiowmark: %s\n", segment.error_message.c_str());
           return 1;
         }
+    }
+  int orig_seconds = start_pos / audio_master_data.sample_rate();
+  info ("Time:         %d:%02d\n", orig_seconds / 60, orig_seconds % 60);
+  return 0;
+}
 
-      err = out_stream.write_frames (out_signal);
+/* make a directory, it is ok if it already exists */
+static Error
+make_dir (const string& dir)
+{
+  int mkret = mkdir (dir.c_str(), 0755);
+  if (mkret == -1 && errno != EEXIST)
+    return Error (string_printf ("unable to create directory %s: %s", dir.c_str(), strerror (errno)));
+
+  return Error::Code::NONE;
+}
+
+/* prepare segments and render two watermarked variants of each segment
+ *
+ * out_dir/prepared contains the output of hls-prepare, out_dir/0 and out_dir/1 contain complete
+ * renditions of the stream, watermarked with an all-zero and an all-one payload; segment i should
+ * be delivered from directory <bit (i % ab_bits) of the viewer pattern>, which the manifest
+ * out_dir/ab.manifest describes
+ */
+int
+hls_prepare_ab (const string& in_dir, const string& out_dir, const string& filename, const string& audio_master)
+{
+  const string prepared_dir = out_dir + "/prepared";
+  const string manifest_name = out_dir + "/ab.manifest";
+
+  if (file_exists (manifest_name))
+    {
+      error ("audiowmark: output file already exists: %s\n", manifest_name.c_str());
+      return 1;
+    }
+  Error err = make_dir (out_dir);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+  int rc = hls_prepare (in_dir, prepared_dir, filename, audio_master);
+  if (rc != 0)
+    return rc;
+
+  /* the prepared playlist is a copy of the input playlist, which we also use for the variants */
+  string playlist_name = prepared_dir + "/" + filename;
+  FILE *playlist_file = fopen (playlist_name.c_str(), "r");
+  ScopedFile playlist_file_s (playlist_file);
+
+  if (!playlist_file)
+    {
+      error ("audiowmark: error opening playlist %s\n", playlist_name.c_str());
+      return 1;
+    }
+  string         playlist;
+  vector<string> segment_names;
+  char buffer[1024];
+  const regex blank_re (R"(\s*(#.*)?)");
+  while (fgets (buffer, 1024, playlist_file))
+    {
+      /* kill newline chars at end */
+      int last = strlen (buffer) - 1;
+      while (last > 0 && (buffer[last] == '\n' || buffer[last] == '\r'))
+        buffer[last--] = 0;
+
+      string s = buffer;
+      if (!regex_match (s, blank_re))
+        segment_names.push_back (s);
+
+      playlist += s + "\n";
+    }
+  for (string variant : { "0", "1" })
+    {
+      string variant_dir = out_dir + "/" + variant;
+      err = make_dir (variant_dir);
       if (err)
         {
-          error ("audiowmark: hls: write context flac failed: %s\n", err.message());
+          error ("audiowmark: %s\n", err.message());
           return 1;
         }
+      string variant_playlist = variant_dir + "/" + filename;
+      FILE *out_file = fopen (variant_playlist.c_str(), "w");
+      ScopedFile out_file_s (out_file);
 
-      err = out_stream.close();
-      if (err)
+      if (!out_file || fwrite (playlist.data(), 1, playlist.size(), out_file) != playlist.size())
         {
-          error ("audiowmark: hls: close context flac failed: %s\n", err.message());
+          error ("audiowmark: error writing playlist %s\n", variant_playlist.c_str());
           return 1;
         }
+    }
 
-      /* store everything we need in a mpegts file */
-      TSWriter writer;
+  info ("AB Bits:      %d\n", Params::hls_ab_bits);
 
-      writer.append_data ("full.flac", full_flac_mem);
-      writer.append_vars ("vars", segment.vars);
+  /* from now on, messages from the individual hls-add steps would only be noise */
+  set_log_level (Log::WARNING);
 
-      string out_segment = out_dir + "/" + segment.name;
-      if (file_exists (out_segment))
+  const string zero_bits = bit_vec_to_str (vector<int> (Params::payload_size, 0));
+  const string one_bits  = bit_vec_to_str (vector<int> (Params::payload_size, 1));
+
+  /* segments are rendered in parallel, so each hls_add_segment call should use only one thread */
+  const int n_jobs = Params::jobs;
+  Params::jobs = 1;
+
+  vector<map<string, string>> segment_vars (segment_names.size());
+  vector<string>              error_messages (segment_names.size());
+  run_jobs (segment_names.size(), n_jobs, [&] (size_t index) {
+    /* decode context once, render both variants */
+    std::shared_ptr<const HLSContext> context;
+
+    Error err = load_context (prepared_dir + "/" + segment_names[index], context);
+    if (err)
+      {
+        error_messages[index] = string_printf ("hls: %s", err.message());
+        return;
+      }
+    segment_vars[index] = context->vars;
+
+    if (hls_add_segment (context, out_dir + "/0/" + segment_names[index], nullptr, zero_bits) != 0 ||
+        hls_add_segment (context, out_dir + "/1/" + segment_names[index], nullptr, one_bits) != 0)
+      error_messages[index] = string_printf ("rendering variants of hls segment %s failed", segment_names[index].c_str());
+  });
+  Params::jobs = n_jobs;
+  for (auto& error_message : error_messages)
+    {
+      if (!error_message.empty())
         {
-          error ("audiowmark: output file already exists: %s\n", out_segment.c_str());
+          error ("audiowmark: %s\n", error_message.c_str());
           return 1;
         }
-      err = writer.process (in_dir + "/" + segment.name, out_segment);
-      if (err)
+    }
+
+  /* manifest: which bit of the viewer pattern selects the variant of which segment (and the time range of the segment) */
+  FILE *manifest_file = fopen (manifest_name.c_str(), "w");
+  ScopedFile manifest_file_s (manifest_file);
+
+  if (!manifest_file)
+    {
+      error ("audiowmark: error opening manifest %s\n", manifest_name.c_str());
+      return 1;
+    }
+  fprintf (manifest_file, "# audiowmark hls-prepare-ab manifest\n");
+  fprintf (manifest_file, "# segment <bit> <start_pos> <size> <name>\n");
+  fprintf (manifest_file, "ab_bits %d\n", Params::hls_ab_bits);
+  fprintf (manifest_file, "sample_rate %s\n", segment_vars.empty() ? "0" : segment_vars[0]["sample_rate"].c_str());
+  for (size_t i = 0; i < segment_names.size(); i++)
+    {
+      fprintf (manifest_file, "segment %zd %s %s %s\n", i % Params::hls_ab_bits,
+               segment_vars[i]["start_pos"].c_str(), segment_vars[i]["size"].c_str(), segment_names[i].c_str());
+    }
+  return 0;
+}
+#endif
+
+/* detect which variant (as rendered by hls-prepare-ab) was used for each segment of a stream
+ *
+ * the input file needs to contain the audio of the stream, starting at the first segment of the playlist
+ */
+int
+hls_get_ab (const string& manifest_name, const string& infile)
+{
+  FILE *manifest_file = fopen (manifest_name.c_str(), "r");
+  ScopedFile manifest_file_s (manifest_file);
+
+  if (!manifest_file)
+    {
+      error ("audiowmark: error opening manifest %s\n", manifest_name.c_str());
+      return 1;
+    }
+
+  struct Segment
+  {
+    int    bit;
+    size_t start_pos;
+    size_t size;
+  };
+  vector<Segment> segments;
+  int ab_bits = 0;
+  int sample_rate = 0;
+  int line = 1;
+  char buffer[1024];
+  const regex blank_re (R"(\s*(#.*)?)");
+  const regex ab_bits_re (R"(ab_bits\s+([0-9]+)\s*)");
+  const regex sample_rate_re (R"(sample_rate\s+([0-9]+)\s*)");
+  const regex segment_re (R"(segment\s+([0-9]+)\s+([0-9]+)\s+([0-9]+)\s+.*)");
+  while (fgets (buffer, 1024, manifest_file))
+    {
+      /* kill newline chars at end */
+      int last = strlen (buffer) - 1;
+      while (last > 0 && (buffer[last] == '\n' || buffer[last] == '\r'))
+        buffer[last--] = 0;
+
+      string s = buffer;
+
+      std::smatch match;
+      if (regex_match (s, blank_re))
+        {
+          /* blank line or comment */
+        }
+      else if (regex_match (s, match, ab_bits_re))
         {
-          error ("audiowmark: processing hls segment %s failed: %s\n", segment.name.c_str(), err.message());
+          ab_bits = atoi (match[1].str().c_str());
+        }
+      else if (regex_match (s, match, sample_rate_re))
+        {
+          sample_rate = atoi (match[1].str().c_str());
+        }
+      else if (regex_match (s, match, segment_re))
+        {
+          Segment segment;
+          segment.bit       = atoi (match[1].str().c_str());
+          segment.start_pos = atoll (match[2].str().c_str());
+          segment.size      = atoll (match[3].str().c_str());
+          segments.push_back (segment);
+        }
+      else
+        {
+          error ("audiowmark: parse error in manifest %s, line %d\n", manifest_name.c_str(), line);
           return 1;
         }
+      line++;
+    }
+  if (ab_bits < 1 || sample_rate < 1 || segments.empty())
+    {
+      error ("audiowmark: manifest %s is incomplete\n", manifest_name.c_str());
+      return 1;
+    }
+  vector<double> boundaries;
+  for (size_t i = 0; i < segments.size(); i++)
+    {
+      if (segments[i].bit >= ab_bits || (i > 0 && segments[i].start_pos != segments[i - 1].start_pos + segments[i - 1].size))
+        {
+          error ("audiowmark: bad segment %zd in manifest %s\n", i, manifest_name.c_str());
+          return 1;
+        }
+      boundaries.push_back (double (segments[i].start_pos) / sample_rate);
+    }
+  boundaries.push_back (double (segments.back().start_pos + segments.back().size) / sample_rate);
 
-      /* start position for the next segment */
-      start_pos += segment.size;
+  vector<ABScore> scores;
+  int rc = get_ab_scores (infile, boundaries, scores);
+  if (rc != 0)
+    return rc;
+
+  vector<ABScore> bit_scores (ab_bits);
+  for (size_t i = 0; i < segments.size(); i++)
+    {
+      if (scores[i].count)
+        {
+          const double score = scores[i].sum / scores[i].count;
+          printf ("segment %zd %d %d %.3f\n", i, segments[i].bit, score > 0 ? 1 : 0, score);
+        }
+      bit_scores[segments[i].bit].sum   += scores[i].sum;
+      bit_scores[segments[i].bit].count += scores[i].count;
     }
-  int orig_seconds = start_pos / audio_master_data.sample_rate();
-  info ("Time:         %d:%02d\n", orig_seconds / 60, orig_seconds % 60);
+
+  /* combine all segments carrying the same bit; '?' => no segment of the input could be decoded for this bit */
+  string pattern;
+  for (auto bit_score : bit_scores)
+    {
+      if (bit_score.count)
+        pattern += bit_score.sum > 0 ? '1' : '0';
+      else
+        pattern += '?';
+    }
+  printf ("pattern %s\n", pattern.c_str());
   return 0;
 }
-#endif
@@ -19,9 +19,14 @@
 #define AUDIOWMARK_HLS_HH
 
 #include <string>
+#include <vector>
 
 int hls_add (const std::string& infile, const std::string& outfile, const std::string& bits);
+int hls_add (const std::string& infile, std::vector<unsigned char>& out_data, const std::string& bits);
+int hls_server (const std::string& socket_path, const std::string& segment_dir);
 int hls_prepare (const std::string& in_dir, const std::string& out_dir, const std::string& filename, const std::string& audio_master);
+int hls_prepare_ab (const std::string& in_dir, const std::string& out_dir, const std::string& filename, const std::string& audio_master);
+int hls_get_ab (const std::string& manifest_name, const std::string& infile);
 
 Error ff_decode (const std::string& filename, WavData& out_wav_data);
 
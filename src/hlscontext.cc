@@ -0,0 +1,629 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hlscontext.hh"
+#include "rawconverter.hh"
+#include "sfinputstream.hh"
+#include "sfoutputstream.hh"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::min;
+
+Error
+hls_context_format_from_string (const string& name, HLSContextFormat& format)
+{
+  if (name == "flac")
+    format = HLSContextFormat::FLAC;
+  else if (name == "float")
+    format = HLSContextFormat::FLOAT;
+  else if (name == "int16")
+    format = HLSContextFormat::INT16;
+  else if (name == "lz")
+    format = HLSContextFormat::LZ;
+  else
+    return Error (string_printf ("unsupported context format '%s' (supported: flac, float, int16, lz)", name.c_str()));
+
+  return Error::Code::NONE;
+}
+
+string
+hls_context_entry_name (HLSContextFormat format)
+{
+  switch (format)
+    {
+      case HLSContextFormat::FLAC:  return "full.flac";
+      case HLSContextFormat::FLOAT: return "full.f32";
+      case HLSContextFormat::INT16: return "full.s16";
+      case HLSContextFormat::LZ:    return "full.lz";
+    }
+  return "";
+}
+
+/* headerless formats use little endian raw data (float or signed 16 bit) */
+static RawFormat
+context_raw_format (HLSContextFormat format, int n_channels, int sample_rate)
+{
+  RawFormat raw_format (n_channels, sample_rate, 16);
+  if (format == HLSContextFormat::FLOAT)
+    {
+      raw_format.set_bit_depth (32);
+      raw_format.set_encoding (RawFormat::FLOAT);
+    }
+  raw_format.set_endian (RawFormat::LITTLE);
+  return raw_format;
+}
+
+/* prepare 16 bit pcm data for lz compression
+ *
+ * each sample is replaced by the difference to the previous sample of the same channel (audio is usually smooth, so
+ * this produces many small values), and low bytes and high bytes are stored in two separate blocks (the high bytes of
+ * small values are mostly 0x00 or 0xff, which compresses well)
+ */
+static void
+delta_encode_16 (vector<unsigned char>& bytes, int n_channels)
+{
+  const size_t n_values = bytes.size() / 2;
+
+  vector<unsigned char> out (n_values * 2);
+  for (size_t i = 0; i < n_values; i++)
+    {
+      uint16_t value = bytes[i * 2] | (bytes[i * 2 + 1] << 8);
+      uint16_t prev  = 0;
+      if (i >= size_t (n_channels))
+        prev = bytes[(i - n_channels) * 2] | (bytes[(i - n_channels) * 2 + 1] << 8);
+
+      uint16_t delta = value - prev;
+      out[i]            = delta;
+      out[n_values + i] = delta >> 8;
+    }
+  bytes.swap (out);
+}
+
+static void
+delta_decode_16 (vector<unsigned char>& bytes, int n_channels)
+{
+  const size_t n_values = bytes.size() / 2;
+
+  vector<unsigned char> out (n_values * 2);
+  for (size_t i = 0; i < n_values; i++)
+    {
+      uint16_t delta = bytes[i] | (bytes[n_values + i] << 8);
+      uint16_t prev  = 0;
+      if (i >= size_t (n_channels))
+        prev = out[(i - n_channels) * 2] | (out[(i - n_channels) * 2 + 1] << 8);
+
+      uint16_t value = prev + delta;
+      out[i * 2]     = value;
+      out[i * 2 + 1] = value >> 8;
+    }
+  bytes.swap (out);
+}
+
+/* simple byte oriented LZ77 compression (block format similar to LZ4)
+ *
+ * each sequence is: token (4 bits literal length, 4 bits match length - 4), optional extra literal length bytes,
+ * literals, 16 bit little endian match offset, optional extra match length bytes; the last sequence has no match
+ *
+ * the sequences are preceded by the size and a checksum of the uncompressed data (32 bit little endian each),
+ * so that truncated or corrupt data is reported as error instead of producing wrong samples
+ */
+namespace
+{
+
+constexpr size_t LZ_MIN_MATCH   = 4;
+constexpr size_t LZ_MAX_OFFSET  = 65535;
+constexpr int    LZ_HASH_BITS   = 16;
+constexpr size_t LZ_HEADER_SIZE = 8;
+
+uint32_t
+lz_read32 (const unsigned char *p)
+{
+  uint32_t v;
+  memcpy (&v, p, 4);
+  return v;
+}
+
+void
+lz_put32 (vector<unsigned char>& out, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    out.push_back (v >> (i * 8));
+}
+
+uint32_t
+lz_get32 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t (p[3]) << 24);
+}
+
+/* FNV-1a, on 32 bit words to keep it cheap compared to decompression */
+uint32_t
+lz_checksum (const vector<unsigned char>& data)
+{
+  uint32_t h = 2166136261U;
+  size_t   i = 0;
+  for (; i + 4 <= data.size(); i += 4)
+    h = (h ^ lz_get32 (&data[i])) * 16777619U;
+  for (; i < data.size(); i++)
+    h = (h ^ data[i]) * 16777619U;
+  return h;
+}
+
+void
+lz_put_length (vector<unsigned char>& out, size_t len)
+{
+  while (len >= 255)
+    {
+      out.push_back (255);
+      len -= 255;
+    }
+  out.push_back (len);
+}
+
+void
+lz_put_sequence (vector<unsigned char>& out, const unsigned char *literals, size_t lit_len, size_t offset, size_t match_len)
+{
+  const size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+  out.push_back ((min<size_t> (lit_len, 15) << 4) | min<size_t> (match_code, 15));
+  if (lit_len >= 15)
+    lz_put_length (out, lit_len - 15);
+  out.insert (out.end(), literals, literals + lit_len);
+
+  if (match_len)
+    {
+      out.push_back (offset);
+      out.push_back (offset >> 8);
+      if (match_code >= 15)
+        lz_put_length (out, match_code - 15);
+    }
+}
+
+void
+lz_compress (const vector<unsigned char>& in, vector<unsigned char>& out)
+{
+  const unsigned char *data = in.data();
+  const size_t         size = in.size();
+  const size_t         NONE = ~size_t (0);
+
+  vector<size_t> hash_table (1 << LZ_HASH_BITS, NONE);
+
+  out.clear();
+  out.reserve (LZ_HEADER_SIZE + size + size / 255 + 16);
+  lz_put32 (out, size);
+  lz_put32 (out, lz_checksum (in));
+
+  size_t pos = 0;
+  size_t lit_start = 0;
+  while (pos + LZ_MIN_MATCH <= size)
+    {
+      const uint32_t h = (lz_read32 (data + pos) * 2654435761U) >> (32 - LZ_HASH_BITS);
+      const size_t   candidate = hash_table[h];
+
+      hash_table[h] = pos;
+      if (candidate != NONE && pos - candidate <= LZ_MAX_OFFSET && lz_read32 (data + candidate) == lz_read32 (data + pos))
+        {
+          size_t match_len = LZ_MIN_MATCH;
+          while (pos + match_len < size && data[candidate + match_len] == data[pos + match_len])
+            match_len++;
+
+          lz_put_sequence (out, data + lit_start, pos - lit_start, pos - candidate, match_len);
+          pos += match_len;
+          lit_start = pos;
+        }
+      else
+        {
+          pos++;
+        }
+    }
+  lz_put_sequence (out, data + lit_start, size - lit_start, 0, 0);
+}
+
+Error
+lz_decompress (const vector<unsigned char>& in, vector<unsigned char>& out)
+{
+  const Error corrupt ("lz context data is corrupt");
+  if (in.size() < LZ_HEADER_SIZE)
+    return corrupt;
+
+  const size_t   size     = lz_get32 (&in[0]);
+  const uint32_t checksum = lz_get32 (&in[4]);
+  size_t         pos      = LZ_HEADER_SIZE;
+
+  auto get_length = [&] (size_t& len) {
+    unsigned char b;
+    do
+      {
+        if (pos >= in.size())
+          return false;
+        b = in[pos++];
+        len += b;
+      }
+    while (b == 255);
+    return true;
+  };
+
+  out.clear();
+  out.reserve (size);
+  while (pos < in.size())
+    {
+      const unsigned char token = in[pos++];
+
+      size_t lit_len = token >> 4;
+      if (lit_len == 15 && !get_length (lit_len))
+        return corrupt;
+      if (lit_len > in.size() - pos || lit_len > size - out.size())
+        return corrupt;
+
+      out.insert (out.end(), in.begin() + pos, in.begin() + pos + lit_len);
+      pos += lit_len;
+
+      if (pos == in.size()) /* last sequence, has no match */
+        {
+          if (token & 15)
+            return corrupt;
+          break;
+        }
+
+      if (pos + 2 > in.size())
+        return corrupt;
+      const size_t offset = in[pos] | (in[pos + 1] << 8);
+      pos += 2;
+
+      size_t match_len = token & 15;
+      if (match_len == 15 && !get_length (match_len))
+        return corrupt;
+      match_len += LZ_MIN_MATCH;
+
+      if (offset == 0 || offset > out.size() || match_len > size - out.size())
+        return corrupt;
+
+      /* byte by byte, since source and destination may overlap */
+      size_t src = out.size() - offset;
+      out.resize (out.size() + match_len);
+      for (size_t i = out.size() - match_len; i < out.size(); i++)
+        out[i] = out[src++];
+    }
+  if (out.size() != size || lz_checksum (out) != checksum)
+    return corrupt;
+
+  return Error::Code::NONE;
+}
+
+}
+
+Error
+hls_context_encode (const vector<float>& samples, int n_channels, int sample_rate, int bit_depth,
+                    HLSContextFormat format, vector<unsigned char>& data)
+{
+  if (format == HLSContextFormat::FLAC)
+    {
+      SFOutputStream out_stream;
+      Error err = out_stream.open (&data, n_channels, sample_rate, bit_depth, SFOutputStream::OutFormat::FLAC);
+      if (err)
+        return err;
+
+      err = out_stream.write_frames (samples);
+      if (err)
+        return err;
+
+      return out_stream.close();
+    }
+
+  Error err;
+  std::unique_ptr<RawConverter> converter (RawConverter::create (context_raw_format (format, n_channels, sample_rate), err));
+  if (err)
+    return err;
+
+  converter->to_raw (samples, data);
+  if (format == HLSContextFormat::LZ)
+    {
+      delta_encode_16 (data, n_channels);
+
+      vector<unsigned char> pcm_data;
+      pcm_data.swap (data);
+      lz_compress (pcm_data, data);
+    }
+  return Error::Code::NONE;
+}
+
+static Error
+get_int_var (const map<string, string>& vars, const string& name, int& value)
+{
+  auto it = vars.find (name);
+  if (it == vars.end())
+    return Error (string_printf ("hls segment is missing value for required variable '%s'", name.c_str()));
+
+  value = atoi (it->second.c_str());
+  return Error::Code::NONE;
+}
+
+Error
+hls_context_decode (HLSContextFormat format, const vector<unsigned char>& data, HLSContext& context)
+{
+  if (format == HLSContextFormat::FLAC)
+    {
+      SFInputStream in_stream;
+      Error err = in_stream.open (&data);
+      if (err)
+        return err;
+
+      context.n_channels  = in_stream.n_channels();
+      context.sample_rate = in_stream.sample_rate();
+      context.bit_depth   = in_stream.bit_depth();
+
+      return in_stream.read_frames (context.samples, in_stream.n_frames());
+    }
+
+  Error err = get_int_var (context.vars, "channels", context.n_channels);
+  if (!err)
+    err = get_int_var (context.vars, "sample_rate", context.sample_rate);
+  if (!err)
+    err = get_int_var (context.vars, "bit_depth", context.bit_depth);
+  if (err)
+    return err;
+  if (context.n_channels < 1 || context.sample_rate < 1)
+    return Error ("hls segment has bad context parameters");
+
+  const vector<unsigned char> *bytes = &data;
+
+  vector<unsigned char> pcm_data;
+  if (format == HLSContextFormat::LZ)
+    {
+      err = lz_decompress (data, pcm_data);
+      if (err)
+        return err;
+      if (pcm_data.size() % 2 != 0)
+        return Error ("lz context data is corrupt");
+
+      delta_decode_16 (pcm_data, context.n_channels);
+      bytes = &pcm_data;
+    }
+  const RawFormat raw_format = context_raw_format (format, context.n_channels, context.sample_rate);
+  const size_t    frame_size = raw_format.bit_depth() / 8 * context.n_channels;
+  if (bytes->size() % frame_size != 0)
+    return Error ("hls segment context size is not a multiple of the frame size");
+
+  std::unique_ptr<RawConverter> converter (RawConverter::create (raw_format, err));
+  if (err)
+    return err;
+
+  converter->from_raw (*bytes, context.samples);
+  return Error::Code::NONE;
+}
+
+static RawFormat
+analysis_raw_format()
+{
+  RawFormat raw_format (1, 44100, 32);
+
+  raw_format.set_encoding (RawFormat::FLOAT);
+  raw_format.set_endian (RawFormat::LITTLE);
+  return raw_format;
+}
+
+string
+hls_analysis_entry_name()
+{
+  return "analysis.f32";
+}
+
+Error
+hls_analysis_encode (const WatermarkAnalysis& analysis, vector<unsigned char>& data)
+{
+  Error err;
+  std::unique_ptr<RawConverter> converter (RawConverter::create (analysis_raw_format(), err));
+  if (err)
+    return err;
+
+  /* complex<float> is stored as two floats (real, imaginary) */
+  const float *values = reinterpret_cast<const float *> (analysis.bins.data());
+
+  converter->to_raw (vector<float> (values, values + analysis.bins.size() * 2), data);
+  return Error::Code::NONE;
+}
+
+Error
+hls_analysis_decode (const vector<unsigned char>& data, HLSContext& context)
+{
+  int first_frame;
+  Error err = get_int_var (context.vars, "analysis_first_frame", first_frame);
+  if (err)
+    return err;
+
+  const size_t frame_bytes = WatermarkAnalysis::n_bins * context.n_channels * 2 * sizeof (float);
+  if (first_frame < 0 || context.n_channels < 1 || data.size() % frame_bytes != 0)
+    return Error ("hls segment has bad analysis data");
+
+  std::unique_ptr<RawConverter> converter (RawConverter::create (analysis_raw_format(), err));
+  if (err)
+    return err;
+
+  vector<float> values;
+  converter->from_raw (data, values);
+
+  WatermarkAnalysis& analysis = context.analysis;
+  analysis.first_frame = first_frame;
+  analysis.n_channels  = context.n_channels;
+  analysis.bins.resize (values.size() / 2);
+  std::copy (values.begin(), values.end(), reinterpret_cast<float *> (analysis.bins.data()));
+
+  return Error::Code::NONE;
+}
+
+Error
+hls_context_load (TSReader& reader, HLSContext& context)
+{
+  context.vars = reader.parse_vars ("vars");
+
+  for (auto format : { HLSContextFormat::FLAC, HLSContextFormat::FLOAT, HLSContextFormat::INT16, HLSContextFormat::LZ })
+    {
+      const TSReader::Entry *entry = reader.find (hls_context_entry_name (format));
+      if (entry)
+        {
+          Error err = hls_context_decode (format, entry->data, context);
+          if (err)
+            return err;
+
+          const TSReader::Entry *analysis_entry = reader.find (hls_analysis_entry_name());
+          if (analysis_entry)
+            return hls_analysis_decode (analysis_entry->data, context);
+
+          return Error::Code::NONE;
+        }
+    }
+  return Error ("no embedded context found");
+}
+
+bool
+HLSContextCache::FileKey::operator== (const FileKey& other) const
+{
+  return filename == other.filename && dev == other.dev && ino == other.ino && size == other.size &&
+         mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+}
+
+bool
+HLSContextCache::file_key (const string& filename, FileKey& key)
+{
+  struct stat st;
+
+  if (stat (filename.c_str(), &st) != 0 || !S_ISREG (st.st_mode))
+    return false;
+
+  key.filename = filename;
+  key.dev      = st.st_dev;
+  key.ino      = st.st_ino;
+  key.size     = st.st_size;
+  key.mtime    = st.st_mtim;
+  return true;
+}
+
+void
+HLSContextCache::shrink()
+{
+  while (m_bytes > m_max_bytes)
+    {
+      m_bytes -= m_items.back().bytes;
+      m_items.pop_back();
+    }
+}
+
+void
+HLSContextCache::set_max_bytes (size_t max_bytes)
+{
+  std::lock_guard<std::mutex> lg (m_mutex);
+
+  m_max_bytes = max_bytes;
+  shrink();
+}
+
+std::shared_ptr<const HLSContext>
+HLSContextCache::lookup (const FileKey& key)
+{
+  std::lock_guard<std::mutex> lg (m_mutex);
+
+  for (auto it = m_items.begin(); it != m_items.end(); it++)
+    {
+      if (it->key.filename == key.filename)
+        {
+          if (it->key == key)
+            {
+              m_items.splice (m_items.begin(), m_items, it); // mark as most recently used
+              return it->context;
+            }
+          /* file was modified since it was cached */
+          m_bytes -= it->bytes;
+          m_items.erase (it);
+          return nullptr;
+        }
+    }
+  return nullptr;
+}
+
+void
+HLSContextCache::insert (const FileKey& key, std::shared_ptr<const HLSContext> context)
+{
+  std::lock_guard<std::mutex> lg (m_mutex);
+
+  for (auto it = m_items.begin(); it != m_items.end(); it++)
+    {
+      if (it->key.filename == key.filename)
+        {
+          m_bytes -= it->bytes;
+          m_items.erase (it);
+          break;
+        }
+    }
+  Item item;
+  item.key     = key;
+  item.bytes   = sizeof (HLSContext) + context->samples.size() * sizeof (float) + context->analysis.bins.size() * sizeof (std::complex<float>);
+  item.context = context;
+  if (item.bytes > m_max_bytes)
+    return;
+
+  m_bytes += item.bytes;
+  m_items.push_front (item);
+  shrink();
+}
+
+HLSContextInputStream::HLSContextInputStream (std::shared_ptr<const HLSContext> context) :
+  m_context (context)
+{
+}
+
+int
+HLSContextInputStream::bit_depth() const
+{
+  return m_context->bit_depth;
+}
+
+int
+HLSContextInputStream::sample_rate() const
+{
+  return m_context->sample_rate;
+}
+
+int
+HLSContextInputStream::n_channels() const
+{
+  return m_context->n_channels;
+}
+
+size_t
+HLSContextInputStream::n_frames() const
+{
+  return m_context->n_frames();
+}
+
+Error
+HLSContextInputStream::read_frames (vector<float>& samples, size_t count)
+{
+  const size_t n_channels = m_context->n_channels;
+
+  count = min (count, m_context->n_frames() - m_pos);
+  samples.assign (m_context->samples.begin() + m_pos * n_channels, m_context->samples.begin() + (m_pos + count) * n_channels);
+  m_pos += count;
+
+  return Error::Code::NONE;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_HLS_CONTEXT_HH
+#define AUDIOWMARK_HLS_CONTEXT_HH
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <mutex>
+#include <memory>
+
+#include <sys/types.h>
+
+#include "utils.hh"
+#include "audiostream.hh"
+#include "mpegts.hh"
+#include "wmcommon.hh"
+
+/* audio context (segment + surrounding audio) stored in a prepared hls segment */
+struct HLSContext
+{
+  std::vector<float>                 samples;
+  int                                n_channels  = 0;
+  int                                sample_rate = 0;
+  int                                bit_depth   = 0;
+  std::map<std::string, std::string> vars;
+  WatermarkAnalysis                  analysis;    // optional: precomputed by hls-prepare --analysis
+
+  size_t
+  n_frames() const
+  {
+    return n_channels ? samples.size() / n_channels : 0;
+  }
+};
+
+Error hls_context_format_from_string (const std::string& name, HLSContextFormat& format);
+std::string hls_context_entry_name (HLSContextFormat format);
+
+/* encode context samples; for FLAC the result is a complete .flac file, all other formats store headerless data
+ * (in this case the decoder gets the stream parameters from the "channels", "sample_rate" and "bit_depth" vars)
+ *
+ * INT16 and LZ always store 16 bit samples, bit_depth (and the "bit_depth" var) is the bit depth of the audio master;
+ * the data is embedded in ts packets, so even FLOAT / INT16 can't be used directly from a memory mapped segment
+ */
+Error hls_context_encode (const std::vector<float>& samples, int n_channels, int sample_rate, int bit_depth,
+                          HLSContextFormat format, std::vector<unsigned char>& data);
+
+/* decode context data (context.vars must already be set for the headerless formats) */
+Error hls_context_decode (HLSContextFormat format, const std::vector<unsigned char>& data, HLSContext& context);
+
+/* precomputed watermark analysis (float, little endian), stored in a separate entry; the first frame is stored in the vars */
+std::string hls_analysis_entry_name();
+Error hls_analysis_encode (const WatermarkAnalysis& analysis, std::vector<unsigned char>& data);
+Error hls_analysis_decode (const std::vector<unsigned char>& data, HLSContext& context);
+
+/* find the embedded context (in any supported format) and decode it, together with the vars and the analysis (if any) */
+Error hls_context_load (TSReader& reader, HLSContext& context);
+
+/* LRU cache for decoded contexts, to avoid decoding hot segments again and again in long-running processes */
+class HLSContextCache
+{
+public:
+  /* identifies one version of a file (entries become invalid if the file is modified) */
+  struct FileKey
+  {
+    std::string     filename;
+    dev_t           dev = 0;
+    ino_t           ino = 0;
+    off_t           size = 0;
+    struct timespec mtime = { 0, 0 };
+
+    bool operator== (const FileKey& other) const;
+  };
+  static bool file_key (const std::string& filename, FileKey& key);
+private:
+  struct Item
+  {
+    FileKey                            key;
+    size_t                             bytes = 0;
+    std::shared_ptr<const HLSContext>  context;
+  };
+  std::mutex      m_mutex;
+  std::list<Item> m_items; // most recently used item first
+  size_t          m_bytes = 0;
+  size_t          m_max_bytes = 0;
+
+  void shrink();
+public:
+  void set_max_bytes (size_t max_bytes);
+
+  std::shared_ptr<const HLSContext> lookup (const FileKey& key);
+  void insert (const FileKey& key, std::shared_ptr<const HLSContext> context);
+};
+
+/* read the samples of a decoded context (which may be shared with other threads via the cache) */
+class HLSContextInputStream : public AudioInputStream
+{
+  std::shared_ptr<const HLSContext> m_context;
+  size_t                            m_pos = 0;
+public:
+  HLSContextInputStream (std::shared_ptr<const HLSContext> context);
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  int     n_channels() const override;
+  size_t  n_frames() const override;
+
+  Error   read_frames (std::vector<float>& samples, size_t count) override;
+};
+
+#endif /* AUDIOWMARK_HLS_CONTEXT_HH */
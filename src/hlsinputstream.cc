@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hlsinputstream.hh"
+
+#include <assert.h>
+
+#undef av_err2str
+#define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
+
+using std::string;
+using std::vector;
+using std::min;
+
+HLSInputStream::~HLSInputStream()
+{
+  close();
+}
+
+Error
+HLSInputStream::open (const string& filename)
+{
+  assert (m_state == State::NEW);
+
+  av_log_set_level (AV_LOG_ERROR);
+
+  int ret = avformat_open_input (&m_fmt_ctx, filename.c_str(), av_find_input_format ("mpegts"), nullptr);
+  if (ret < 0)
+    return Error (string_printf ("failed to open input file: %s", av_err2str (ret)));
+
+  m_state = State::OPEN; // from now on, close() needs to free resources
+
+  ret = avformat_find_stream_info (m_fmt_ctx, nullptr);
+  if (ret < 0)
+    return Error (string_printf ("failed to find stream info: %s", av_err2str (ret)));
+
+  AVCodec *codec = nullptr;
+  ret = av_find_best_stream (m_fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+  if (ret < 0)
+    return Error (string_printf ("no audio stream found: %s", av_err2str (ret)));
+
+  m_stream_index = ret;
+
+  m_dec = avcodec_alloc_context3 (codec);
+  if (!m_dec)
+    return Error ("could not alloc a decoding context");
+
+  ret = avcodec_parameters_to_context (m_dec, m_fmt_ctx->streams[m_stream_index]->codecpar);
+  if (ret < 0)
+    return Error ("could not copy the stream parameters");
+
+  ret = avcodec_open2 (m_dec, codec, nullptr);
+  if (ret < 0)
+    return Error (string_printf ("could not open audio codec: %s", av_err2str (ret)));
+
+  m_pkt   = av_packet_alloc();
+  m_frame = av_frame_alloc();
+  if (!m_pkt || !m_frame)
+    return Error ("could not alloc packet/frame");
+
+  m_n_channels  = m_dec->channels;
+  m_sample_rate = m_dec->sample_rate;
+  m_bit_depth   = (m_dec->sample_fmt == AV_SAMPLE_FMT_S16 || m_dec->sample_fmt == AV_SAMPLE_FMT_S16P) ? 16 : 32;
+
+  if (m_n_channels < 1 || m_sample_rate < 1)
+    return Error ("bad audio stream parameters");
+
+  return Error::Code::NONE;
+}
+
+void
+HLSInputStream::close()
+{
+  if (m_state == State::OPEN)
+    {
+      av_frame_free (&m_frame);
+      av_packet_free (&m_pkt);
+      avcodec_free_context (&m_dec);
+      avformat_close_input (&m_fmt_ctx);
+
+      m_state = State::CLOSED;
+    }
+}
+
+/* convert decoded frame to interleaved float samples, append to m_buffer */
+Error
+HLSInputStream::append_frame()
+{
+  const AVSampleFormat fmt        = AVSampleFormat (m_frame->format);
+  const bool           planar     = av_sample_fmt_is_planar (fmt);
+  const size_t         n_values   = size_t (m_frame->nb_samples) * m_n_channels;
+  const size_t         start      = m_buffer.size();
+
+  m_buffer.resize (start + n_values);
+  float *out = &m_buffer[start];
+
+  for (int ch = 0; ch < m_n_channels; ch++)
+    {
+      /* for interleaved data, all channels are in data[0] */
+      const uint8_t *data   = m_frame->extended_data[planar ? ch : 0];
+      const int      offset = planar ? 0 : ch;
+      const int      stride = planar ? 1 : m_n_channels;
+
+      for (int i = 0; i < m_frame->nb_samples; i++)
+        {
+          const int index = offset + i * stride;
+          float     value;
+
+          switch (fmt)
+            {
+              case AV_SAMPLE_FMT_FLT:
+              case AV_SAMPLE_FMT_FLTP:
+                value = reinterpret_cast<const float *> (data)[index];
+                break;
+              case AV_SAMPLE_FMT_S16:
+              case AV_SAMPLE_FMT_S16P:
+                value = reinterpret_cast<const int16_t *> (data)[index] * (1 / 32768.0f);
+                break;
+              case AV_SAMPLE_FMT_S32:
+              case AV_SAMPLE_FMT_S32P:
+                value = reinterpret_cast<const int32_t *> (data)[index] * (1 / 2147483648.0);
+                break;
+              default:
+                return Error (string_printf ("unsupported sample format %s", av_get_sample_fmt_name (fmt)));
+            }
+          out[i * m_n_channels + ch] = value;
+        }
+    }
+  return Error::Code::NONE;
+}
+
+/* decode packets until at least one frame is available (or eof) */
+Error
+HLSInputStream::decode_frames()
+{
+  size_t old_size = m_buffer.size();
+  while (!m_eof && m_buffer.size() == old_size)
+    {
+      int ret = avcodec_receive_frame (m_dec, m_frame);
+      if (ret == 0)
+        {
+          Error err = append_frame();
+          av_frame_unref (m_frame);
+          if (err)
+            return err;
+        }
+      else if (ret == AVERROR_EOF)
+        {
+          m_eof = true;
+        }
+      else if (ret == AVERROR (EAGAIN))
+        {
+          /* decoder needs more input */
+          ret = av_read_frame (m_fmt_ctx, m_pkt);
+          if (ret == AVERROR_EOF)
+            {
+              avcodec_send_packet (m_dec, nullptr); // flush decoder
+            }
+          else if (ret < 0)
+            {
+              return Error (string_printf ("error reading input: %s", av_err2str (ret)));
+            }
+          else
+            {
+              if (m_pkt->stream_index == m_stream_index)
+                ret = avcodec_send_packet (m_dec, m_pkt);
+              av_packet_unref (m_pkt);
+
+              /* like ffmpeg, skip over broken packets */
+              if (ret < 0 && ret != AVERROR_INVALIDDATA)
+                return Error (string_printf ("error decoding audio: %s", av_err2str (ret)));
+            }
+        }
+      else
+        {
+          return Error (string_printf ("error decoding audio: %s", av_err2str (ret)));
+        }
+    }
+  return Error::Code::NONE;
+}
+
+Error
+HLSInputStream::read_frames (vector<float>& samples, size_t count)
+{
+  assert (m_state == State::OPEN);
+
+  while (m_buffer.size() - m_buffer_pos < count * m_n_channels && !m_eof)
+    {
+      /* drop samples which were already read before decoding more */
+      m_buffer.erase (m_buffer.begin(), m_buffer.begin() + m_buffer_pos);
+      m_buffer_pos = 0;
+
+      Error err = decode_frames();
+      if (err)
+        return err;
+    }
+  const size_t n_values = min (count * m_n_channels, m_buffer.size() - m_buffer_pos);
+
+  samples.assign (m_buffer.begin() + m_buffer_pos, m_buffer.begin() + m_buffer_pos + n_values);
+  m_buffer_pos += n_values;
+
+  return Error::Code::NONE;
+}
+
+int
+HLSInputStream::n_streams() const
+{
+  return m_fmt_ctx ? m_fmt_ctx->nb_streams : 0;
+}
+
+string
+HLSInputStream::codec_name() const
+{
+  return avcodec_get_name (m_fmt_ctx->streams[m_stream_index]->codecpar->codec_id);
+}
+
+string
+HLSInputStream::channel_layout() const
+{
+  const AVCodecParameters *par = m_fmt_ctx->streams[m_stream_index]->codecpar;
+  if (!par->channel_layout)
+    return "";
+
+  char buffer[1024];
+  av_get_channel_layout_string (buffer, sizeof (buffer), par->channels, par->channel_layout);
+  return buffer;
+}
+
+bool
+HLSInputStream::have_start_time() const
+{
+  return m_fmt_ctx->streams[m_stream_index]->start_time != AV_NOPTS_VALUE;
+}
+
+double
+HLSInputStream::start_time() const
+{
+  const AVStream *st = m_fmt_ctx->streams[m_stream_index];
+
+  return st->start_time * av_q2d (st->time_base);
+}
+
+int
+HLSInputStream::bit_depth() const
+{
+  return m_bit_depth;
+}
+
+int
+HLSInputStream::sample_rate() const
+{
+  return m_sample_rate;
+}
+
+int
+HLSInputStream::n_channels() const
+{
+  return m_n_channels;
+}
+
+size_t
+HLSInputStream::n_frames() const
+{
+  return N_FRAMES_UNKNOWN;
+}
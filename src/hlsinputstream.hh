@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_HLS_INPUT_STREAM_HH
+#define AUDIOWMARK_HLS_INPUT_STREAM_HH
+
+#include <string>
+
+#include "audiostream.hh"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+/* decodes the audio stream of a (mpegts) segment using libavformat/libavcodec, without running ffmpeg */
+class HLSInputStream : public AudioInputStream
+{
+  enum class State {
+    NEW,
+    OPEN,
+    CLOSED
+  };
+  State             m_state = State::NEW;
+
+  AVFormatContext  *m_fmt_ctx = nullptr;
+  AVCodecContext   *m_dec = nullptr;
+  AVPacket         *m_pkt = nullptr;
+  AVFrame          *m_frame = nullptr;
+  int               m_stream_index = -1;
+
+  int               m_n_channels = 0;
+  int               m_sample_rate = 0;
+  int               m_bit_depth = 0;
+
+  std::vector<float> m_buffer; // decoded samples which were not yet read
+  size_t             m_buffer_pos = 0;
+  bool               m_eof = false;
+
+  Error   decode_frames();
+  Error   append_frame();
+public:
+  ~HLSInputStream();
+
+  Error   open (const std::string& filename);
+  Error   read_frames (std::vector<float>& samples, size_t count) override;
+  void    close();
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  int     n_channels()  const override;
+  size_t  n_frames() const override;
+
+  /* stream information (replaces running ffprobe) */
+  int         n_streams() const;
+  std::string codec_name() const;
+  std::string channel_layout() const;
+  bool        have_start_time() const;
+  double      start_time() const;
+};
+
+#endif /* AUDIOWMARK_HLS_INPUT_STREAM_HH */
@@ -359,6 +359,27 @@ HLSOutputStream::close_stream()
 
 Error
 HLSOutputStream::open (const string& out_filename, size_t cut_aac_frames, size_t keep_aac_frames, double pts_start, size_t delete_input_start)
+{
+  return open_output (out_filename, cut_aac_frames, keep_aac_frames, pts_start, delete_input_start);
+}
+
+Error
+HLSOutputStream::open (vector<unsigned char> *out_data, size_t cut_aac_frames, size_t keep_aac_frames, double pts_start, size_t delete_input_start)
+{
+  m_out_data = out_data;
+
+  return open_output ("", cut_aac_frames, keep_aac_frames, pts_start, delete_input_start);
+}
+
+/* every segment gets a new muxer, AAC encoder, resampler and frames
+ *
+ * these objects are not reused across segments: ffmpeg's AAC encoder can not be reset after it has
+ * been flushed (it keeps bit reservoir and psychoacoustic state), and the mpegts muxer context can
+ * only write one header/trailer, so reusing them would change the output; the resampler and the
+ * frames are cheap compared to the encoder, and the resampler would need swr_init() anyway
+ */
+Error
+HLSOutputStream::open_output (const string& out_filename, size_t cut_aac_frames, size_t keep_aac_frames, double pts_start, size_t delete_input_start)
 {
   assert (m_state == State::NEW);
 
@@ -376,11 +397,18 @@ HLSOutputStream::open (const string& out_filename, size_t cut_aac_frames, size_t
   if (ret < 0)
     return Error (av_err2str (ret));
 
-  string filename = out_filename;
-  if (filename == "-")
-    filename = "pipe:1";
+  if (m_out_data)
+    {
+      ret = avio_open_dyn_buf (&m_fmt_ctx->pb);
+    }
+  else
+    {
+      string filename = out_filename;
+      if (filename == "-")
+        filename = "pipe:1";
 
-  ret = avio_open (&m_fmt_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE);
+      ret = avio_open (&m_fmt_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE);
+    }
   if (ret < 0)
     return Error (av_err2str (ret));
 
@@ -433,8 +461,19 @@ HLSOutputStream::close()
   close_stream();
 
   /* Close the output file. */
-  if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
-    avio_closep (&m_fmt_ctx->pb);
+  if (m_out_data)
+    {
+      uint8_t *buffer = nullptr;
+      int size = avio_close_dyn_buf (m_fmt_ctx->pb, &buffer);
+      m_fmt_ctx->pb = nullptr;
+
+      m_out_data->assign (buffer, buffer + size);
+      av_free (buffer);
+    }
+  else if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    {
+      avio_closep (&m_fmt_ctx->pb);
+    }
 
   /* free the stream */
   avformat_free_context (m_fmt_ctx);
@@ -442,6 +481,13 @@ HLSOutputStream::close()
   return Error::Code::NONE;
 }
 
+/* all aac frames we want to keep have been written, so the remaining input is irrelevant */
+bool
+HLSOutputStream::done() const
+{
+  return m_state == State::OPEN && m_keep_aac_frames == 0;
+}
+
 Error
 HLSOutputStream::write_frames (const std::vector<float>& frames)
 {
@@ -57,6 +57,8 @@ class HLSOutputStream : public AudioOutputStream {
   int               m_bit_rate = 0;
   std::string       m_channel_layout;
 
+  std::vector<unsigned char> *m_out_data = nullptr; // output to memory instead of a file
+
   enum class State {
     NEW,
     OPEN,
@@ -77,6 +79,7 @@ class HLSOutputStream : public AudioOutputStream {
   AVFrame *alloc_audio_frame (AVSampleFormat sample_fmt, uint64_t channel_layout, int sample_rate, int nb_samples, Error& err);
 
   int write_frame (const AVRational *time_base, AVStream *st, AVPacket *pkt);
+  Error open_output (const std::string& out_filename, size_t cut_aac_frames, size_t keep_aac_frames, double pts_start, size_t delete_input_start);
 public:
   HLSOutputStream (int n_channels, int sample_rate, int bit_depth);
   ~HLSOutputStream();
@@ -85,11 +88,13 @@ public:
   void set_channel_layout (const std::string& channel_layout);
 
   Error open (const std::string& output_filename, size_t cut_aac_frames, size_t keep_aac_frames, double pts_start, size_t delete_input_start);
+  Error open (std::vector<unsigned char> *out_data, size_t cut_aac_frames, size_t keep_aac_frames, double pts_start, size_t delete_input_start);
   int bit_depth() const override;
   int sample_rate() const override;
   int n_channels() const override;
   Error write_frames (const std::vector<float>& frames) override;
   Error close() override;
+  bool done() const override;
 };
 
 #endif /* AUDIOWMARK_HLS_OUTPUT_STREAM_HH */
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+
+#include "utils.hh"
+#include "wmcommon.hh"
+#include "hls.hh"
+
+#include "config.h"
+
+using std::string;
+using std::vector;
+
+#if !HAVE_FFMPEG
+int
+hls_server (const string& socket_path, const string& segment_dir)
+{
+  error ("audiowmark: hls support is not available in this build of audiowmark\n");
+  return 1;
+}
+#else
+
+/*
+ * hls-server keeps everything that is expensive to set up (key, fft plans, watermark tables, decoded contexts)
+ * in memory, and watermarks prepared segments on request. The protocol is line based, clients can send one or more
+ * requests per connection:
+ *
+ *   request:   add <segment_filename> <message_hex>\n
+ *   response:  ok <n_bytes>\n<n_bytes of watermarked .ts data>
+ *          or  error <message>\n
+ *
+ * Segment filenames are relative to the segment directory (--segment-dir), clients can't access files outside of it.
+ *
+ * Each connection is served by its own thread, but only a fixed number of requests (--jobs) is watermarked at the
+ * same time, so that many idle client connections don't cost cpu time, and busy connections can't starve others.
+ */
+class HLSServerWorkers
+{
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+  int                     m_free_workers = 0;
+public:
+  HLSServerWorkers (int n_workers) :
+    m_free_workers (n_workers)
+  {
+  }
+  void
+  acquire()
+  {
+    std::unique_lock<std::mutex> lock (m_mutex);
+    m_cond.wait (lock, [this] { return m_free_workers > 0; });
+    m_free_workers--;
+  }
+  void
+  release()
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_free_workers++;
+    m_cond.notify_one();
+  }
+};
+
+class HLSServerConnection
+{
+  int     m_fd = -1;
+  string  m_buffer;
+public:
+  HLSServerConnection (int fd) :
+    m_fd (fd)
+  {
+  }
+  ~HLSServerConnection()
+  {
+    close (m_fd);
+  }
+  bool
+  read_line (string& line)
+  {
+    while (true)
+      {
+        size_t nl = m_buffer.find ('\n');
+        if (nl != string::npos)
+          {
+            line = m_buffer.substr (0, nl);
+            m_buffer.erase (0, nl + 1);
+
+            if (!line.empty() && line.back() == '\r')
+              line.pop_back();
+            return true;
+          }
+        if (m_buffer.size() > 64 * 1024) // no valid request is that long
+          return false;
+
+        char buffer[4096];
+        ssize_t n = read (m_fd, buffer, sizeof (buffer));
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          return false;
+
+        m_buffer.append (buffer, n);
+      }
+  }
+  bool
+  write_all (const unsigned char *data, size_t size)
+  {
+    while (size)
+      {
+        ssize_t n = write (m_fd, data, size);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          return false;
+
+        data += n;
+        size -= n;
+      }
+    return true;
+  }
+  bool
+  write_string (const string& s)
+  {
+    return write_all (reinterpret_cast<const unsigned char *> (s.data()), s.size());
+  }
+};
+
+static vector<string>
+split_words (const string& line)
+{
+  vector<string> words;
+  string word;
+  for (char c : line)
+    {
+      if (c == ' ' || c == '\t')
+        {
+          if (!word.empty())
+            words.push_back (word);
+          word.clear();
+        }
+      else
+        {
+          word += c;
+        }
+    }
+  if (!word.empty())
+    words.push_back (word);
+  return words;
+}
+
+/* map a segment filename from a request to a file in the segment directory
+ *
+ * segment_root must be a canonical path (from realpath); returns false if the filename is not acceptable
+ */
+static bool
+resolve_segment (const string& segment_root, const string& filename, string& path)
+{
+  /* reject stdin, absolute paths and parent directory references */
+  if (filename.empty() || filename == "-" || filename[0] == '/')
+    return false;
+
+  size_t start = 0;
+  while (start <= filename.size())
+    {
+      size_t end = filename.find ('/', start);
+      if (end == string::npos)
+        end = filename.size();
+      if (filename.compare (start, end - start, "..") == 0)
+        return false;
+      start = end + 1;
+    }
+
+  /* symlinks could still point outside the segment directory, so check the canonical path, too */
+  char *real_path = realpath ((segment_root + "/" + filename).c_str(), nullptr);
+  if (!real_path)
+    return false;
+  path = real_path;
+  free (real_path);
+
+  struct stat st;
+  if (path.compare (0, segment_root.size() + 1, segment_root + "/") != 0 || stat (path.c_str(), &st) != 0 || !S_ISREG (st.st_mode))
+    return false;
+
+  return true;
+}
+
+static void
+handle_connection (int fd, std::shared_ptr<HLSServerWorkers> workers, std::shared_ptr<const string> segment_root)
+{
+  HLSServerConnection conn (fd);
+
+  string line;
+  while (conn.read_line (line))
+    {
+      vector<string> words = split_words (line);
+      if (words.size() != 3 || words[0] != "add")
+        {
+          if (!conn.write_string ("error bad request (expected: add <segment_filename> <message_hex>)\n"))
+            return;
+          continue;
+        }
+      string path;
+      if (!resolve_segment (*segment_root, words[1], path))
+        {
+          error ("audiowmark: hls-server: rejected segment filename '%s'\n", words[1].c_str());
+          if (!conn.write_string (string_printf ("error bad segment filename %s\n", words[1].c_str())))
+            return;
+          continue;
+        }
+      vector<unsigned char> out_data;
+
+      workers->acquire();
+      int rc = hls_add (path, out_data, words[2]);
+      workers->release();
+
+      if (rc != 0)
+        {
+          /* details are written to the server log by hls_add */
+          if (!conn.write_string (string_printf ("error watermarking %s failed\n", words[1].c_str())))
+            return;
+          continue;
+        }
+      if (!conn.write_string (string_printf ("ok %zd\n", out_data.size())) || !conn.write_all (out_data.data(), out_data.size()))
+        return;
+    }
+}
+
+int
+hls_server (const string& socket_path, const string& segment_dir)
+{
+  char *real_segment_dir = realpath (segment_dir.c_str(), nullptr);
+  if (!real_segment_dir)
+    {
+      error ("audiowmark: hls-server: bad segment directory '%s': %s\n", segment_dir.c_str(), strerror (errno));
+      return 1;
+    }
+  const string segment_root = real_segment_dir;
+  free (real_segment_dir);
+
+  struct stat st;
+  if (stat (segment_root.c_str(), &st) != 0 || !S_ISDIR (st.st_mode))
+    {
+      error ("audiowmark: hls-server: segment directory '%s' is not a directory\n", segment_dir.c_str());
+      return 1;
+    }
+
+  /* requests are handled concurrently, so each request should be watermarked using only one thread */
+  const int n_workers = Params::jobs;
+  Params::jobs = 1;
+
+  /* clients may disconnect at any time, this should not terminate the server */
+  signal (SIGPIPE, SIG_IGN);
+
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof (addr.sun_path))
+    {
+      error ("audiowmark: hls-server: socket path '%s' is too long\n", socket_path.c_str());
+      return 1;
+    }
+  strcpy (addr.sun_path, socket_path.c_str());
+
+  int listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    {
+      error ("audiowmark: hls-server: socket failed: %s\n", strerror (errno));
+      return 1;
+    }
+
+  /* remove socket left over from a previous run (but never remove anything else) */
+  if (stat (socket_path.c_str(), &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (socket_path.c_str());
+
+  /* only the owner and group of the server process may connect: create the socket with mode 0660 */
+  mode_t old_umask = umask (S_IRWXO | S_IXUSR | S_IXGRP);
+  int bind_result = bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr));
+  umask (old_umask);
+
+  if (bind_result < 0)
+    {
+      error ("audiowmark: hls-server: bind to '%s' failed: %s\n", socket_path.c_str(), strerror (errno));
+      close (listen_fd);
+      return 1;
+    }
+  if (listen (listen_fd, SOMAXCONN) < 0)
+    {
+      error ("audiowmark: hls-server: listen failed: %s\n", strerror (errno));
+      close (listen_fd);
+      return 1;
+    }
+  info ("Socket:       %s\n", socket_path.c_str());
+  info ("Segments:     %s\n", segment_root.c_str());
+  info ("Workers:      %d\n", n_workers);
+  if (Params::hls_context_cache_mb)
+    info ("Cache:        %zd MB\n", Params::hls_context_cache_mb);
+
+  /* the informational messages hls_add prints for each request would only clutter the server log */
+  set_log_level (Log::WARNING);
+
+  /* connection threads are detached, so they share ownership of everything they use with the server loop */
+  auto workers = std::make_shared<HLSServerWorkers> (n_workers);
+  auto shared_segment_root = std::make_shared<const string> (segment_root);
+  while (true)
+    {
+      int fd = accept (listen_fd, nullptr, nullptr);
+      if (fd < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+
+          error ("audiowmark: hls-server: accept failed: %s\n", strerror (errno));
+          close (listen_fd);
+          return 1;
+        }
+      std::thread (handle_connection, fd, workers, shared_segment_root).detach();
+    }
+}
+#endif
@@ -21,6 +21,10 @@
 #include <math.h>
 #include <stdio.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using std::vector;
 using std::max;
 
@@ -31,9 +35,9 @@ Limiter::Limiter (int n_channels, int sample_rate) :
 }
 
 void
-Limiter::set_block_size_ms (int ms)
+Limiter::set_block_size_ms (double ms)
 {
-  block_size = sample_rate * ms / 1000;
+  block_size = std::max<uint> (sample_rate * ms / 1000, 1);
 }
 
 void
@@ -48,20 +52,22 @@ Limiter::process (const vector<float>& samples)
   assert (block_size >= 1);
   assert (samples.size() % n_channels == 0);    // process should be called with whole frames
 
+  const size_t start_frame = buffer.size() / n_channels;
   buffer.insert (buffer.end(), samples.begin(), samples.end());
+  update_peaks (start_frame);
 
   /* need at least two complete blocks in buffer to produce output */
-  const uint buffered_blocks = buffer.size() / n_channels / block_size;
-  if (buffered_blocks < 2)
+  if (block_peaks.size() < 2)
     return {};
 
-  const uint blocks_todo = buffered_blocks - 1;
+  const size_t blocks_todo = block_peaks.size() - 1;
 
   vector<float> out (blocks_todo * block_size * n_channels);
-  for (uint b = 0; b < blocks_todo; b++)
-    process_block (&buffer[b * block_size * n_channels], &out[b * block_size * n_channels]);
+  for (size_t b = 0; b < blocks_todo; b++)
+    process_block (&buffer[b * block_size * n_channels], &out[b * block_size * n_channels], block_peaks[b], block_peaks[b + 1]);
 
   buffer.erase (buffer.begin(), buffer.begin() + blocks_todo * block_size * n_channels);
+  block_peaks.erase (block_peaks.begin(), block_peaks.begin() + blocks_todo);
 
   return out;
 }
@@ -78,38 +84,103 @@ Limiter::skip (size_t zeros)
   const size_t buffered_blocks = buffer_size / n_channels / block_size;
   if (buffered_blocks < 2)
     {
+      const size_t start_frame = buffer.size() / n_channels;
       buffer.resize (buffer_size);
+      update_peaks (start_frame);
       return 0;
     }
 
   const size_t blocks_todo = buffered_blocks - 1;
   buffer.resize (buffer_size - blocks_todo * block_size * n_channels);
+
+  block_peaks.clear();
+  partial_peak = 0;
+  partial_frames = 0;
+  update_peaks (0);
   return blocks_todo * block_size;
 }
 
+/* compute peaks for all frames in buffer starting at start_frame (which have not been seen before) */
+void
+Limiter::update_peaks (size_t start_frame)
+{
+  const size_t n_frames = buffer.size() / n_channels;
+
+  size_t frame = start_frame;
+  while (frame < n_frames)
+    {
+      const size_t todo = std::min<size_t> (block_size - partial_frames, n_frames - frame);
+
+      partial_peak = max (partial_peak, block_max (&buffer[frame * n_channels], todo * n_channels));
+      partial_frames += todo;
+      frame += todo;
+
+      if (partial_frames == block_size)
+        {
+          block_peaks.push_back (partial_peak);
+          partial_peak = 0;
+          partial_frames = 0;
+        }
+    }
+}
+
 float
-Limiter::block_max (const float *in)
+Limiter::block_max (const float *in, size_t n_values)
 {
-  float maximum = ceiling;
-  for (uint x = 0; x < block_size * n_channels; x++)
-    maximum = max (maximum, fabs (in[x]));
+  float maximum = 0;
+  size_t x = 0;
+#ifdef __SSE2__
+  const __m128 abs_mask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+
+  __m128 vmax0 = _mm_setzero_ps();
+  __m128 vmax1 = _mm_setzero_ps();
+  for (; x + 8 <= n_values; x += 8)
+    {
+      /* operand order: if the input is NaN, _mm_max_ps returns the old maximum (like std::max) */
+      vmax0 = _mm_max_ps (_mm_and_ps (_mm_loadu_ps (in + x), abs_mask), vmax0);
+      vmax1 = _mm_max_ps (_mm_and_ps (_mm_loadu_ps (in + x + 4), abs_mask), vmax1);
+    }
+  float vmax[4];
+  _mm_storeu_ps (vmax, _mm_max_ps (vmax0, vmax1));
+  maximum = max (max (vmax[0], vmax[1]), max (vmax[2], vmax[3]));
+#endif
+  for (; x < n_values; x++)
+    maximum = max (maximum, fabsf (in[x]));
   return maximum;
 }
 
 void
-Limiter::process_block (const float *in, float *out)
+Limiter::process_block (const float *in, float *out, float block_max_current, float block_max_next)
 {
-  if (block_max_last < ceiling)
-    block_max_last = ceiling;
-  if (block_max_current < ceiling)
-    block_max_current = block_max (in);
-  if (block_max_next < ceiling)
-    block_max_next = block_max (in + block_size * n_channels);
+  block_max_last    = max (block_max_last, ceiling);
+  block_max_current = max (block_max_current, ceiling);
+  block_max_next    = max (block_max_next, ceiling);
 
   const float scale_start = ceiling / max (block_max_last, block_max_current);
   const float scale_end = ceiling / max (block_max_current, block_max_next);
   const float scale_step = (scale_end - scale_start) / block_size;
-  for (size_t i = 0; i < block_size; i++)
+
+  size_t i = 0;
+#ifdef __SSE2__
+  /* the vector code computes the scale exactly like the scalar code, so the results are identical */
+  if (n_channels == 1 || n_channels == 2)
+    {
+      const uint   frames_per_vector = 4 / n_channels;
+      const __m128 vscale_start = _mm_set1_ps (scale_start);
+      const __m128 vscale_step = _mm_set1_ps (scale_step);
+      const __m128 vframes_inc = _mm_set1_ps (frames_per_vector);
+      __m128 vframes = n_channels == 1 ? _mm_setr_ps (0, 1, 2, 3) : _mm_setr_ps (0, 0, 1, 1);
+
+      for (; i + frames_per_vector <= block_size; i += frames_per_vector)
+        {
+          const __m128 vscale = _mm_add_ps (vscale_start, _mm_mul_ps (vframes, vscale_step));
+
+          _mm_storeu_ps (out + i * n_channels, _mm_mul_ps (_mm_loadu_ps (in + i * n_channels), vscale));
+          vframes = _mm_add_ps (vframes, vframes_inc);
+        }
+    }
+#endif
+  for (; i < block_size; i++)
     {
       const float scale = scale_start + i * scale_step;
 
@@ -119,8 +190,6 @@ Limiter::process_block (const float *in, float *out)
     }
 
   block_max_last = block_max_current;
-  block_max_current = block_max_next;
-  block_max_next = 0;
 }
 
 void
@@ -25,20 +25,25 @@ class Limiter
 {
   float ceiling           = 1;
   float block_max_last    = 0;
-  float block_max_current = 0;
-  float block_max_next    = 0;
   uint  block_size        = 0;
   uint  n_channels        = 0;
   uint  sample_rate       = 0;
 
   std::vector<float> buffer;
-  void process_block (const float *in, float *out);
-  float block_max (const float *in);
+
+  /* block peaks are computed once, while samples are appended to the buffer */
+  std::vector<float> block_peaks;       // peaks of complete blocks in buffer
+  float              partial_peak = 0;  // peak of incomplete block at end of buffer
+  size_t             partial_frames = 0;
+
+  void update_peaks (size_t start_frame);
+  void process_block (const float *in, float *out, float block_max_current, float block_max_next);
+  float block_max (const float *in, size_t n_values);
   void debug_scale (float scale);
 public:
   Limiter (int n_channels, int sample_rate);
 
-  void set_block_size_ms (int value_ms);
+  void set_block_size_ms (double value_ms);
   void set_ceiling (float ceiling);
 
   std::vector<float> process (const std::vector<float>& samples);
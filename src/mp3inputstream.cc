@@ -16,12 +16,17 @@
  */
 
 #include "mp3inputstream.hh"
+#include "wmcommon.hh"
+
+#include <thread>
 
 #include <mpg123.h>
 #include <assert.h>
+#include <stdio.h>
 
 using std::min;
 using std::string;
+using std::vector;
 
 static void
 mp3_init()
@@ -85,6 +90,7 @@ MP3InputStream::open (const string& filename)
     return Error (mpg123_strerror (m_handle));
 
   m_need_close = true;
+  m_filename = filename;
 
   /* scan headers to get best possible length estimate */
   err = mpg123_scan (m_handle);
@@ -111,9 +117,214 @@ MP3InputStream::open (const string& filename)
   return Error::Code::NONE;
 }
 
+/* decode the frames [first, end) of the file using a new mpg123 handle */
+static bool
+decode_range (const string& filename, long rate, int channels, const vector<off_t>& index, off_t index_step,
+              size_t first, size_t end, bool last_range, vector<float>& samples)
+{
+  int err = 0;
+
+  mpg123_handle *mh = mpg123_new (nullptr, &err);
+  if (err != MPG123_OK)
+    return false;
+
+  bool ok = mpg123_param (mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0) == MPG123_OK
+         && mpg123_param (mh, MPG123_RESYNC_LIMIT, -1, 0) == MPG123_OK
+         && mpg123_format_none (mh) == MPG123_OK
+         && mpg123_format (mh, rate, channels, MPG123_ENC_FLOAT_32) == MPG123_OK
+         && mpg123_open (mh, filename.c_str()) == MPG123_OK;
+
+  /* the last range scans the file like open() does, so libmpg123 trims the end of the stream like in serial decoding */
+  if (ok && last_range)
+    ok = mpg123_scan (mh) == MPG123_OK;
+
+  if (ok)
+    {
+      /* like in open(), we need to query the format before reading, otherwise the first read returns MPG123_NEW_FORMAT */
+      long fmt_rate;
+      int  fmt_channels;
+      int  fmt_encoding;
+
+      ok = mpg123_getformat (mh, &fmt_rate, &fmt_channels, &fmt_encoding) == MPG123_OK
+        && fmt_rate == rate && fmt_channels == channels && fmt_encoding == MPG123_ENC_FLOAT_32;
+
+      /* reuse the frame index of the first scan, so we don't need to scan the file again (libmpg123 copies it) */
+      if (!last_range)
+        ok = ok && mpg123_set_index (mh, const_cast<off_t *> (index.data()), index_step, index.size()) == MPG123_OK;
+
+      ok = ok && mpg123_seek (mh, first, SEEK_SET) == off_t (first);
+
+      vector<float> buffer (mpg123_outblock (mh) / sizeof (float));
+      const size_t  n_values = (end - first) * channels;
+
+      samples.clear();
+      samples.reserve (n_values);
+      while (ok && (last_range || samples.size() < n_values))
+        {
+          size_t done;
+          err = mpg123_read (mh, reinterpret_cast<unsigned char *> (&buffer[0]), buffer.size() * sizeof (float), &done);
+          if (err == MPG123_OK || err == MPG123_NEW_FORMAT) /* format is fixed, so NEW_FORMAT is harmless */
+            samples.insert (samples.end(), buffer.begin(), buffer.begin() + done / sizeof (float));
+          else if (last_range && (err == MPG123_DONE || err == MPG123_NEED_MORE))
+            break;
+          else
+            ok = false; /* errors are reported by serial decoding */
+        }
+      if (!last_range && samples.size() > n_values)
+        samples.resize (n_values);
+
+      mpg123_close (mh);
+    }
+  mpg123_delete (mh);
+  return ok;
+}
+
+/* decode long files using multiple threads: the file is split into ranges, which
+ * are decoded with one mpg123 handle per range
+ *
+ * to get the same decoder state (bit reservoir, filterbank overlap) as serial
+ * decoding, each range is started a few mpeg frames early, discarding the
+ * extra samples; the last mpeg frame before each range is compared with the
+ * end of the previous range to ensure that the result is sample-identical
+ *
+ * at the end of the file, libmpg123 applies gapless end trimming, which depends
+ * on the state of the handle after seeking; so the last range must decode to
+ * exactly the number of frames open() computed, otherwise we can't be sure that
+ * it ends like serial decoding and use the serial decoder instead
+ *
+ * all decoded ranges are kept in memory until they are read, so this is only
+ * enabled for get/cmp (Params::mp3_jobs), which load the whole file anyway
+ *
+ * if parallel decoding is not possible, m_range_samples stays empty and serial decoding is used
+ */
+void
+MP3InputStream::decode_parallel()
+{
+  const size_t n_frames    = m_frames_left;
+  const size_t range_min   = 30 * size_t (m_sample_rate); /* don't split files into very short ranges */
+  const size_t n_ranges    = bound<size_t> (1, n_frames / range_min, Params::jobs);
+  const int    spf         = mpg123_spf (m_handle);
+
+  if (n_ranges < 2 || spf <= 0)
+    return;
+
+  off_t  *offsets;
+  off_t   index_step;
+  size_t  index_fill;
+  if (mpg123_index (m_handle, &offsets, &index_step, &index_fill) != MPG123_OK || index_fill == 0)
+    return;
+
+  const vector<off_t> index (offsets, offsets + index_fill);
+  const size_t        verify_frames = spf;
+  const size_t        prime_frames  = 8 * spf;
+
+  struct Range
+  {
+    size_t        start = 0;
+    size_t        first = 0;
+    vector<float> samples;
+    bool          ok = false;
+    std::thread   thread;
+  };
+  vector<Range> ranges (n_ranges);
+  for (size_t r = 0; r < n_ranges; r++)
+    {
+      Range& range = ranges[r];
+
+      range.start = n_frames * r / n_ranges;
+      range.first = r ? range.start - verify_frames - prime_frames : 0;
+
+      const size_t end        = n_frames * (r + 1) / n_ranges;
+      const bool   last_range = r + 1 == n_ranges;
+      range.thread = std::thread ([&range, end, last_range, &index, index_step, this] {
+        range.ok = decode_range (m_filename, m_sample_rate, m_n_channels, index, index_step, range.first, end, last_range, range.samples);
+      });
+    }
+  for (auto& range : ranges)
+    range.thread.join();
+
+  for (size_t r = 0; r < n_ranges; r++)
+    {
+      Range& range = ranges[r];
+      if (!range.ok)
+        {
+          info ("MP3 decoding: decoding range %zd failed, using serial decoder\n", r);
+          return;
+        }
+
+      /* discard priming samples, check that the samples before the range start match the previous range */
+      const size_t skip_values = (range.start - range.first) * m_n_channels;
+      if (range.samples.size() < skip_values)
+        {
+          info ("MP3 decoding: range %zd too short, using serial decoder\n", r);
+          return;
+        }
+      if (r + 1 == n_ranges && range.samples.size() - skip_values != (n_frames - range.start) * m_n_channels)
+        {
+          info ("MP3 decoding: end of last range doesn't match, using serial decoder\n");
+          return;
+        }
+      if (r)
+        {
+          const vector<float>& prev          = ranges[r - 1].samples;
+          const size_t         verify_values = verify_frames * m_n_channels;
+          if (prev.size() < verify_values ||
+              !std::equal (prev.end() - verify_values, prev.end(), range.samples.begin() + skip_values - verify_values))
+            {
+              info ("MP3 decoding: ranges don't match, using serial decoder\n");
+              return;
+            }
+        }
+    }
+  for (auto& range : ranges)
+    {
+      range.samples.erase (range.samples.begin(), range.samples.begin() + (range.start - range.first) * m_n_channels);
+      m_range_samples.emplace_back (std::move (range.samples));
+    }
+}
+
+Error
+MP3InputStream::read_frames_parallel (std::vector<float>& samples, size_t count)
+{
+  /* never read past the promised number of frames */
+  if (count > m_frames_left)
+    count = m_frames_left;
+
+  samples.clear();
+  while (samples.size() < count * m_n_channels && m_range_index < m_range_samples.size())
+    {
+      vector<float>& range_samples = m_range_samples[m_range_index];
+
+      const size_t n = min (count * m_n_channels - samples.size(), range_samples.size() - m_range_pos);
+      samples.insert (samples.end(), range_samples.begin() + m_range_pos, range_samples.begin() + m_range_pos + n);
+      m_range_pos += n;
+
+      if (m_range_pos == range_samples.size())
+        {
+          /* free memory of ranges that were completely read */
+          vector<float>().swap (range_samples);
+          m_range_index++;
+          m_range_pos = 0;
+        }
+    }
+  /* pad zero samples at end if necessary to match the number of frames we promised to deliver */
+  samples.resize (count * m_n_channels);
+  m_frames_left -= count;
+  return Error::Code::NONE;
+}
+
 Error
 MP3InputStream::read_frames (std::vector<float>& samples, size_t count)
 {
+  if (!m_parallel_tried)
+    {
+      m_parallel_tried = true;
+      if (Params::jobs > 1 && Params::mp3_jobs)
+        decode_parallel();
+    }
+  if (m_range_samples.size())
+    return read_frames_parallel (samples, count);
+
   while (!m_eof && m_read_buffer.size() < count * m_n_channels)
     {
       size_t buffer_bytes = mpg123_outblock (m_handle);
@@ -199,6 +410,12 @@ MP3InputStream::n_frames() const
   return m_n_values / m_n_channels;
 }
 
+size_t
+MP3InputStream::parallel_ranges() const
+{
+  return m_range_samples.size();
+}
+
 /* there is no really simple way of detecting if something is an mp3
  *
  * so we try to decode a few frames; if that works without error the
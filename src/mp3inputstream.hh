@@ -40,6 +40,16 @@ class MP3InputStream : public AudioInputStream
 
   mpg123_handle     *m_handle = nullptr;
   std::vector<float> m_read_buffer;
+
+  /* parallel decoding: decoded samples for each range of the file */
+  std::string                     m_filename;
+  bool                            m_parallel_tried = false;
+  std::vector<std::vector<float>> m_range_samples;
+  size_t                          m_range_index = 0;
+  size_t                          m_range_pos = 0;
+
+  void    decode_parallel();
+  Error   read_frames_parallel (std::vector<float>& samples, size_t count);
 public:
   ~MP3InputStream();
 
@@ -52,6 +62,9 @@ public:
   int     n_channels()  const override;
   size_t  n_frames() const override;
 
+  /* number of ranges decoded in parallel (0 if the serial decoder is used) */
+  size_t  parallel_ranges() const;
+
   static bool detect (const std::string& filename);
 };
 
@@ -16,117 +16,142 @@
  */
 
 #include <array>
-#include <regex>
 
 #include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
 #include "utils.hh"
 #include "mpegts.hh"
 
 using std::string;
 using std::vector;
 using std::map;
-using std::regex;
+using std::min;
 
-class TSPacket
+/* mpegts packets which carry our own data (context, vars) start with 12 id bytes, the rest is payload */
+namespace
 {
-public:
-  enum class ID { awmk_file, awmk_data, unknown };
 
-private:
-  std::array<unsigned char, 188> m_data;
+constexpr size_t TS_PACKET_SIZE    = 188;
+constexpr size_t AWMK_ID_SIZE      = 12;
+constexpr size_t AWMK_PAYLOAD_SIZE = TS_PACKET_SIZE - AWMK_ID_SIZE;
+
+const unsigned char awmk_file_id[AWMK_ID_SIZE] = { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'f', 'i', 'l', 'e' };
+const unsigned char awmk_data_id[AWMK_ID_SIZE] = { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'd', 'a', 't', 'a' };
+
+enum class PacketID { awmk_file, awmk_data, unknown };
+
+PacketID
+packet_id (const unsigned char *packet)
+{
+  if (memcmp (packet, awmk_file_id, AWMK_ID_SIZE) == 0)
+    return PacketID::awmk_file;
+  if (memcmp (packet, awmk_data_id, AWMK_ID_SIZE) == 0)
+    return PacketID::awmk_data;
+  return PacketID::unknown;
+}
 
-  std::array<unsigned char, 12>
-  get_id_bytes (ID type)
+/* contents of a complete .ts file: memory mapped for regular files, read in large blocks otherwise (stdin) */
+class TSFileData
+{
+  void                 *m_map = nullptr;
+  size_t                m_map_size = 0;
+  std::vector<unsigned char> m_buffer;
+  const unsigned char  *m_data = nullptr;
+  size_t                m_size = 0;
+public:
+  ~TSFileData()
   {
-    if (type == ID::awmk_file)
-     return { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'f', 'i', 'l', 'e' };
-    if (type == ID::awmk_data)
-      return { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'd', 'a', 't', 'a' };
-    return {0,};
+    if (m_map)
+      munmap (m_map, m_map_size);
   }
-public:
-  bool
-  read (FILE *file, Error& err)
+  Error
+  load (FILE *file)
   {
-    size_t bytes_read = fread (m_data.data(), 1, m_data.size(), file);
-    if (bytes_read == 0) /* probably eof */
-      return false;
+    int fd = fileno (file);
 
-    if (bytes_read == m_data.size()) /* successful read */
+    struct stat st;
+    if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0 && ftell (file) == 0)
+      {
+        void *map = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+          {
+            madvise (map, st.st_size, MADV_SEQUENTIAL);
+
+            m_map      = map;
+            m_map_size = st.st_size;
+            m_data     = static_cast<const unsigned char *> (map);
+            m_size     = st.st_size;
+            return Error::Code::NONE;
+          }
+      }
+    /* fallback: read everything */
+    size_t bytes_read;
+    do
       {
-        if (m_data[0] == 'G')
-          return true;
+        const size_t block_size = 256 * 1024;
+        const size_t old_size = m_buffer.size();
 
-        err = Error ("bad packet sync while reading transport (.ts) packet");
-        return false;
+        m_buffer.resize (old_size + block_size);
+        bytes_read = fread (m_buffer.data() + old_size, 1, block_size, file);
+        m_buffer.resize (old_size + bytes_read);
       }
+    while (bytes_read > 0);
 
-    err = Error ("short read while reading transport stream (.ts) packet");
-    return false;
-  }
-  Error
-  write (FILE *file)
-  {
-    size_t bytes_written = fwrite (m_data.data(), 1, m_data.size(), file);
-    if (bytes_written != m_data.size())
-      return Error ("short write while writing transport stream (.ts) packet");
+    if (ferror (file))
+      return Error (string_printf ("error reading transport stream (.ts): %s", strerror (errno)));
 
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
     return Error::Code::NONE;
   }
-  void
-  clear (ID type)
+  const unsigned char *
+  data() const
   {
-    std::fill (m_data.begin(), m_data.end(), 0);
-    auto id = get_id_bytes (type);
-    std::copy (id.begin(), id.end(), m_data.begin());
-  }
-  unsigned char&
-  operator[] (size_t n)
-  {
-    return m_data[n];
-  }
-  bool
-  id_eq (size_t offset, unsigned char a, unsigned char b, unsigned char c, unsigned char d)
-  {
-    return m_data[offset] == a && m_data[offset + 1] == b && m_data[offset + 2] == c && m_data[offset + 3] == d;
-  }
-  ID
-  get_id()
-  {
-    if (id_eq (0, 'G', 0x1F, 0xFF, 0x10) && id_eq (4, 'A', 'W', 'M', 'K'))
-      {
-        if (id_eq (8, 'f', 'i', 'l', 'e'))
-          return ID::awmk_file;
-        if (id_eq (8, 'd', 'a', 't', 'a'))
-          return ID::awmk_data;
-      }
-    return ID::unknown;
+    return m_data;
   }
-  constexpr size_t
-  size()
+  size_t
+  size() const
   {
-    return m_data.size(); // is constant
+    return m_size;
   }
-  const std::array<unsigned char, 188>&
-  data()
+  /* check that the data consists of complete mpegts packets */
+  Error
+  check_packets() const
   {
-    return m_data;
+    for (size_t pos = 0; pos + TS_PACKET_SIZE <= m_size; pos += TS_PACKET_SIZE)
+      if (m_data[pos] != 'G')
+        return Error ("bad packet sync while reading transport (.ts) packet");
+
+    if (m_size % TS_PACKET_SIZE)
+      return Error ("short read while reading transport stream (.ts) packet");
+
+    return Error::Code::NONE;
   }
 };
 
+}
+
 Error
 TSWriter::append_file (const string& name, const string& filename)
 {
-  vector<unsigned char> data;
   FILE *datafile = fopen (filename.c_str(), "r");
   ScopedFile datafile_s (datafile);
   if (!datafile)
     return Error ("unable to open data file");
-  int c;
-  while ((c = fgetc (datafile)) >= 0)
-    data.push_back (c);
 
-  entries.push_back ({name, data});
+  TSFileData file_data;
+  Error err = file_data.load (datafile);
+  if (err)
+    return err;
+
+  entries.push_back ({name, vector<unsigned char> (file_data.data(), file_data.data() + file_data.size())});
   return Error::Code::NONE;
 }
 
@@ -144,7 +169,7 @@ TSWriter::append_vars (const string& name, const map<string, string>& vars)
       data.push_back (0);
     }
 
-  entries.push_back ({name, data});
+  entries.push_back ({name, std::move (data)});
 }
 
 void
@@ -153,13 +178,60 @@ TSWriter::append_data (const string& name, const vector<unsigned char>& data)
   entries.push_back ({name, data});
 }
 
+void
+TSWriter::append_data (const string& name, vector<unsigned char>&& data)
+{
+  entries.push_back ({name, std::move (data)});
+}
+
+/* encode all entries as awmk packets: the first packet of each entry contains the header "<size>:<name>\0" */
+void
+TSWriter::build_packets (vector<unsigned char>& packets)
+{
+  for (const auto& entry : entries)
+    {
+      const string header = string_printf ("%zd:%s", entry.data.size(), entry.name.c_str()) + '\0';
+      const size_t total_size = header.size() + entry.data.size();
+      const size_t n_packets = (total_size + AWMK_PAYLOAD_SIZE - 1) / AWMK_PAYLOAD_SIZE;
+
+      size_t pos = packets.size();
+      packets.resize (pos + n_packets * TS_PACKET_SIZE); // zero padding at the end of the last packet
+
+      size_t src_pos = 0; // position in header + data
+      for (size_t p = 0; p < n_packets; p++)
+        {
+          memcpy (&packets[pos], p == 0 ? awmk_file_id : awmk_data_id, AWMK_ID_SIZE);
+          pos += AWMK_ID_SIZE;
+
+          size_t n = min (AWMK_PAYLOAD_SIZE, total_size - src_pos);
+          size_t end_pos = pos + AWMK_PAYLOAD_SIZE;
+          while (n)
+            {
+              size_t len;
+              if (src_pos < header.size())
+                {
+                  len = min (n, header.size() - src_pos);
+                  memcpy (&packets[pos], header.data() + src_pos, len);
+                }
+              else
+                {
+                  len = n;
+                  memcpy (&packets[pos], entry.data.data() + src_pos - header.size(), len);
+                }
+              pos += len;
+              src_pos += len;
+              n -= len;
+            }
+          pos = end_pos;
+        }
+    }
+}
+
 Error
 TSWriter::process (const string& inname, const string& outname)
 {
   FILE *infile = fopen (inname.c_str(), "r");
-  FILE *outfile = fopen (outname.c_str(), "w");
   ScopedFile infile_s (infile);
-  ScopedFile outfile_s (outfile);
 
   if (!infile)
     {
@@ -167,90 +239,82 @@ TSWriter::process (const string& inname, const string& outname)
       return Error (strerror (errno));
     }
 
-  if (!outfile)
+  TSFileData in_data;
+  Error err = in_data.load (infile);
+  if (err)
+    return err;
+
+  err = in_data.check_packets();
+  if (err)
+    return err;
+
+  vector<unsigned char> packets;
+  build_packets (packets);
+
+  int outfd = open (outname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (outfd < 0)
     {
       error ("audiowmark: unable to open %s for writing\n", outname.c_str());
       return Error (strerror (errno));
     }
 
-  while (!feof (infile))
+  /* write original packets and appended packets in one go */
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<unsigned char *> (in_data.data());
+  iov[0].iov_len  = in_data.size();
+  iov[1].iov_base = packets.data();
+  iov[1].iov_len  = packets.size();
+
+  struct iovec *iov_ptr = iov;
+  int           iov_count = 2;
+  while (iov_count)
     {
-      TSPacket p;
-      Error err;
-      bool read_ok = p.read (infile, err);
-      if (!read_ok)
-        {
-          if (err)
-            return err;
-        }
-      else
+      ssize_t bytes_written = writev (outfd, iov_ptr, iov_count);
+      if (bytes_written < 0 && errno == EINTR)
+        continue;
+      if (bytes_written < 0)
         {
-          err = p.write (outfile);
-          if (err)
-            return err;
+          err = Error (string_printf ("error writing transport stream (.ts): %s", strerror (errno)));
+          break;
         }
-    }
-
-  for (auto entry : entries)
-    {
-      string header = string_printf ("%zd:%s", entry.data.size(), entry.name.c_str()) + '\0';
-      vector<unsigned char> data = entry.data;
-      for (size_t i = 0; i < header.size(); i++)
-        data.insert (data.begin() + i, header[i]);
-
-      TSPacket p_file;
-      p_file.clear (TSPacket::ID::awmk_file);
-      size_t data_pos = 0;
-      int pos = 12;
-      while (data_pos < data.size())
+      /* partial write: skip what was written */
+      size_t skip = bytes_written;
+      while (iov_count && skip >= iov_ptr->iov_len)
         {
-          p_file[pos++] = data[data_pos];
-          if (pos == 188)
-            {
-              Error err = p_file.write (outfile);
-              if (err)
-                return err;
-
-              p_file.clear (TSPacket::ID::awmk_data);
-              pos = 12;
-            }
-          data_pos++;
+          skip -= iov_ptr->iov_len;
+          iov_ptr++;
+          iov_count--;
         }
-
-      if (pos != 12)
+      if (iov_count)
         {
-          Error err = p_file.write (outfile);
-          if (err)
-            return err;
+          iov_ptr->iov_base = static_cast<unsigned char *> (iov_ptr->iov_base) + skip;
+          iov_ptr->iov_len -= skip;
         }
     }
+  if (close (outfd) != 0 && !err)
+    err = Error (string_printf ("error closing transport stream (.ts): %s", strerror (errno)));
 
-  return Error::Code::NONE;
+  return err;
 }
 
+/* parse entry header "<size>:<name>" */
 bool
-TSReader::parse_header (Header& header, vector<unsigned char>& data)
+TSReader::parse_header (Header& header, const string& s)
 {
-  for (size_t i = 0; i < data.size(); i++)
-    {
-      if (data[i] == 0) // header is terminated with one single 0 byte
-        {
-          string s = (const char *) (&data[0]);
-
-          static const regex header_re ("([0-9]*):(.*)");
-          std::smatch sm;
-          if (regex_match (s, sm, header_re))
-            {
-              header.data_size = atoi (sm[1].str().c_str());
-              header.filename = sm[2];
+  size_t colon = s.find (':');
+  if (colon == string::npos)
+    return false;
 
-              // erase header including null termination
-              data.erase (data.begin(), data.begin() + i + 1);
-              return true;
-            }
-        }
+  size_t data_size = 0;
+  for (size_t i = 0; i < colon; i++)
+    {
+      if (s[i] < '0' || s[i] > '9')
+        return false;
+      data_size = data_size * 10 + (s[i] - '0');
     }
-  return false;
+  header.data_size = data_size;
+  header.filename = s.substr (colon + 1);
+  return true;
 }
 
 Error
@@ -273,53 +337,74 @@ TSReader::load (const string& inname)
 Error
 TSReader::load (FILE *infile)
 {
-  vector<unsigned char> awmk_stream;
+  TSFileData in_data;
+  Error err = in_data.load (infile);
+  if (err)
+    return err;
+
+  enum class State { NONE, HEADER, DATA } state = State::NONE;
+
   Header header;
-  bool header_valid = false;
-  Error err;
-  while (!feof (infile))
+  string header_str;
+  Entry  entry;
+
+  const unsigned char *data = in_data.data();
+  for (size_t packet_pos = 0; packet_pos + TS_PACKET_SIZE <= in_data.size(); packet_pos += TS_PACKET_SIZE)
     {
-      TSPacket p;
-      bool read_ok = p.read (infile, err);
-      if (!read_ok)
+      const unsigned char *packet = data + packet_pos;
+      if (packet[0] != 'G')
+        return Error ("bad packet sync while reading transport (.ts) packet");
+
+      PacketID id = packet_id (packet);
+      if (id == PacketID::awmk_file)
         {
-          if (err)
-            return err;
+          /* new stream start, clear old contents */
+          state = State::HEADER;
+          header_str.clear();
         }
-      else
+      if (state == State::NONE || id == PacketID::unknown)
+        continue;
+
+      const unsigned char *payload = packet + AWMK_ID_SIZE;
+      size_t               payload_size = AWMK_PAYLOAD_SIZE;
+      if (state == State::HEADER)
         {
-          TSPacket::ID id = p.get_id();
-          if (id == TSPacket::ID::awmk_file)
+          auto end = static_cast<const unsigned char *> (memchr (payload, 0, payload_size));
+          if (!end) // header is terminated with one single 0 byte
             {
-              /* new stream start, clear old contents */
-              header_valid = false;
-              awmk_stream.clear();
+              header_str.append (payload, payload + payload_size);
+              if (header_str.size() > 64 * 1024) // not a valid header
+                state = State::NONE;
+              continue;
             }
-          if (id == TSPacket::ID::awmk_file || id == TSPacket::ID::awmk_data)
+          header_str.append (payload, end);
+          if (!parse_header (header, header_str))
             {
-              awmk_stream.insert (awmk_stream.end(), p.data().begin() + 12, p.data().end());
-
-              if (!header_valid)
-                {
-                  if (parse_header (header, awmk_stream))
-                    {
-                      awmk_stream.reserve (header.data_size + p.size());
-                      header_valid = true;
-                    }
-                }
-              // done? do we have enough bytes for the complete entry?
-              if (header_valid && awmk_stream.size() >= header.data_size)
-                {
-                  awmk_stream.resize (header.data_size);
+              state = State::NONE;
+              continue;
+            }
+          entry.filename = header.filename;
+          entry.data.clear();
+          entry.data.reserve (header.data_size);
 
-                  m_entries.push_back ({ header.filename, std::move (awmk_stream)});
+          payload_size -= end + 1 - payload;
+          payload = end + 1;
+          state = State::DATA;
+        }
+      const size_t n = min (payload_size, header.data_size - entry.data.size());
+      entry.data.insert (entry.data.end(), payload, payload + n);
 
-                  header_valid = false;
-                  awmk_stream.clear();
-                }
-            }
+      // done? do we have enough bytes for the complete entry?
+      if (entry.data.size() == header.data_size)
+        {
+          m_entries.push_back (std::move (entry));
+          entry = Entry();
+          state = State::NONE;
         }
     }
+  if (in_data.size() % TS_PACKET_SIZE)
+    return Error ("short read while reading transport stream (.ts) packet");
+
   return Error::Code::NONE;
 }
 
@@ -372,3 +457,162 @@ TSReader::parse_vars (const string& name)
     }
   return vars;
 }
+
+namespace
+{
+
+/* position of the payload of a mpegts packet (or 0 if the packet has no payload) */
+size_t
+ts_payload_offset (const unsigned char *packet)
+{
+  const int adaptation_field_control = (packet[3] >> 4) & 3;
+
+  size_t offset = 4;
+  if (adaptation_field_control & 2)
+    offset += 1 + packet[4];
+  if (!(adaptation_field_control & 1) || offset >= TS_PACKET_SIZE)
+    return 0;
+  return offset;
+}
+
+/* PSI section (PAT/PMT) contained in a packet which starts a section, returns section length (or 0 on error) */
+size_t
+ts_section (const unsigned char *packet, size_t offset, const unsigned char **section)
+{
+  offset += 1 + packet[offset]; // pointer field
+  if (offset + 3 > TS_PACKET_SIZE)
+    return 0;
+
+  const unsigned char *s = packet + offset;
+  const size_t section_size = 3 + (((s[1] & 0x0f) << 8) | s[2]);
+  if (offset + section_size > TS_PACKET_SIZE || section_size < 12) // we only support sections within one packet
+    return 0;
+
+  *section = s;
+  return section_size;
+}
+
+}
+
+Error
+ts_audio_info (const string& filename, TSAudioInfo& audio_info)
+{
+  FILE *infile = fopen (filename.c_str(), "r");
+  ScopedFile infile_s (infile);
+  if (!infile)
+    return Error (string_printf ("error opening input .ts '%s'", filename.c_str()));
+
+  TSFileData in_data;
+  Error err = in_data.load (infile);
+  if (err)
+    return err;
+  err = in_data.check_packets();
+  if (err)
+    return err;
+
+  /* find audio pid (PAT -> PMT -> ADTS stream) and collect the audio elementary stream */
+  int pmt_pid = -1;
+  int audio_pid = -1;
+  vector<unsigned char> audio_es;
+
+  for (size_t pos = 0; pos + TS_PACKET_SIZE <= in_data.size(); pos += TS_PACKET_SIZE)
+    {
+      const unsigned char *packet = in_data.data() + pos;
+      const bool           unit_start = packet[1] & 0x40;
+      const int            pid = ((packet[1] & 0x1f) << 8) | packet[2];
+      const size_t         offset = ts_payload_offset (packet);
+
+      if (!offset)
+        continue;
+
+      const unsigned char *section;
+      size_t section_size;
+      if (pid == 0 && unit_start && pmt_pid < 0 && (section_size = ts_section (packet, offset, &section)))
+        {
+          /* PAT: use the first program */
+          for (size_t i = 8; i + 4 + 4 <= section_size; i += 4)
+            {
+              const int program_number = (section[i] << 8) | section[i + 1];
+              if (program_number != 0)
+                {
+                  pmt_pid = ((section[i + 2] & 0x1f) << 8) | section[i + 3];
+                  break;
+                }
+            }
+        }
+      else if (pid == pmt_pid && unit_start && audio_pid < 0 && (section_size = ts_section (packet, offset, &section)))
+        {
+          /* PMT: find AAC stream */
+          const size_t program_info_length = ((section[10] & 0x0f) << 8) | section[11];
+          for (size_t i = 12 + program_info_length; i + 5 + 4 <= section_size; )
+            {
+              const int stream_type = section[i];
+              if (stream_type == 0x0f) // ISO/IEC 13818-7 audio with ADTS transport syntax
+                {
+                  audio_pid = ((section[i + 1] & 0x1f) << 8) | section[i + 2];
+                  break;
+                }
+              i += 5 + (((section[i + 3] & 0x0f) << 8) | section[i + 4]);
+            }
+          if (audio_pid < 0)
+            return Error (string_printf ("no AAC/ADTS audio stream found in '%s'", filename.c_str()));
+        }
+      else if (pid == audio_pid)
+        {
+          const unsigned char *payload = packet + offset;
+          size_t               payload_size = TS_PACKET_SIZE - offset;
+          if (unit_start)
+            {
+              /* skip PES header */
+              if (payload_size < 9 || payload[0] != 0 || payload[1] != 0 || payload[2] != 1)
+                return Error (string_printf ("bad PES header in '%s'", filename.c_str()));
+
+              const size_t header_size = 9 + payload[8];
+              if (header_size > payload_size)
+                return Error (string_printf ("bad PES header in '%s'", filename.c_str()));
+
+              payload += header_size;
+              payload_size -= header_size;
+            }
+          audio_es.insert (audio_es.end(), payload, payload + payload_size);
+        }
+    }
+  if (audio_pid < 0)
+    return Error (string_printf ("no AAC/ADTS audio stream found in '%s'", filename.c_str()));
+
+  /* parse ADTS frame headers */
+  static const int sample_rates[16] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350, 0, 0, 0 };
+
+  audio_info = TSAudioInfo();
+
+  const unsigned char *es = audio_es.data();
+  size_t pos = 0;
+  while (pos + 7 <= audio_es.size())
+    {
+      if (es[pos] != 0xff || (es[pos + 1] & 0xf0) != 0xf0) // resync
+        {
+          pos++;
+          continue;
+        }
+      const bool   protection_absent = es[pos + 1] & 1;
+      const int    sample_rate       = sample_rates[(es[pos + 2] >> 2) & 0xf];
+      const size_t frame_length      = ((es[pos + 3] & 3) << 11) | (es[pos + 4] << 3) | (es[pos + 5] >> 5);
+      const size_t header_length     = protection_absent ? 7 : 9;
+      const int    n_raw_blocks      = (es[pos + 6] & 3) + 1;
+
+      if (frame_length < header_length || pos + frame_length > audio_es.size()) // truncated frame
+        break;
+      if (!sample_rate || (audio_info.sample_rate && sample_rate != audio_info.sample_rate))
+        return Error (string_printf ("unsupported/inconsistent ADTS sample rate in '%s'", filename.c_str()));
+
+      audio_info.sample_rate = sample_rate;
+      audio_info.adts_bytes += frame_length - header_length + 7;
+      audio_info.n_frames   += n_raw_blocks;
+
+      pos += frame_length;
+    }
+  if (!audio_info.n_frames)
+    return Error (string_printf ("no AAC frames found in '%s'", filename.c_str()));
+
+  return Error::Code::NONE;
+}
@@ -35,7 +35,7 @@ private:
     size_t      data_size = 0;
   };
   std::vector<Entry> m_entries;
-  bool parse_header (Header& header, std::vector<unsigned char>& data);
+  bool parse_header (Header& header, const std::string& s);
   Error load (FILE *infile);
 public:
   Error load (const std::string& inname);
@@ -52,13 +52,26 @@ class TSWriter
     std::vector<unsigned char> data;
   };
   std::vector<Entry> entries;
+
+  void  build_packets (std::vector<unsigned char>& packets);
 public:
   Error append_file (const std::string& name, const std::string& filename);
   void  append_vars (const std::string& name, const std::map<std::string, std::string>& vars);
   void  append_data (const std::string& name, const std::vector<unsigned char>& data);
+  void  append_data (const std::string& name, std::vector<unsigned char>&& data);
   Error process (const std::string& in_name, const std::string& out_name);
 };
 
+/* size and length of the AAC (ADTS) audio stream of a .ts file, obtained from the headers (without decoding) */
+struct TSAudioInfo
+{
+  size_t adts_bytes  = 0;   // size of the audio stream as ADTS file (7 byte headers + raw AAC data)
+  size_t n_frames    = 0;   // number of AAC frames (1024 samples each)
+  int    sample_rate = 0;
+};
+
+Error ts_audio_info (const std::string& filename, TSAudioInfo& audio_info);
+
 int pcr (const std::string& filename, const std::string& outname, double time_offset_ms);
 
 #endif /* AUDIOWMARK_MPEGTS_HH */
@@ -19,6 +19,7 @@
 #include "utils.hh"
 
 #include <regex>
+#include <atomic>
 
 #include <assert.h>
 
@@ -53,6 +54,7 @@ gcrypt_init()
 
 
 static vector<unsigned char> aes_key (16); // 128 bits
+static std::atomic<uint64_t> aes_key_generation { 0 }; // incremented whenever aes_key changes
 static constexpr auto        GCRY_CIPHER = GCRY_CIPHER_AES128;
 
 static void
@@ -176,6 +178,7 @@ void
 Random::set_global_test_key (uint64_t key)
 {
   uint64_to_buffer (key, &aes_key[0]);
+  aes_key_generation++;
 }
 
 void
@@ -213,6 +216,7 @@ Random::load_global_key (const string& key_file)
               exit (1);
             }
           aes_key = key;
+          aes_key_generation++;
           keys++;
         }
       else
@@ -236,6 +240,13 @@ Random::load_global_key (const string& key_file)
     }
 }
 
+/* caches of data derived from the global key (like FrameModTable) use this to detect key changes */
+uint64_t
+Random::global_key_generation()
+{
+  return aes_key_generation;
+}
+
 string
 Random::gen_key()
 {
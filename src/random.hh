@@ -73,6 +73,7 @@ public:
   static void        set_global_test_key (uint64_t seed);
   static void        load_global_key (const std::string& key_file);
   static std::string gen_key();
+  static uint64_t    global_key_generation();
 };
 
 #endif /* AUDIOWMARK_RANDOM_HH */
@@ -17,7 +17,20 @@
 
 #include "rawconverter.hh"
 
+#include <array>
+
 #include <math.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined (__x86_64__) && defined (__GNUC__)
+#include <tmmintrin.h>
+#define RAW_CONVERTER_SSSE3 1 /* SSSE3 kernels, selected at runtime */
+#endif
 
 using std::vector;
 
@@ -30,7 +43,9 @@ class RawConverterImpl : public RawConverter
 {
 public:
   void to_raw (const std::vector<float>& samples, std::vector<unsigned char>& bytes);
+  void to_raw (const float *samples, size_t n_samples, unsigned char *bytes);
   void from_raw (const std::vector<unsigned char>& bytes, std::vector<float>& samples);
+  void from_raw (const unsigned char *bytes, size_t n_samples, float *samples);
 };
 
 template<int BIT_DEPTH, RawFormat::Endian ENDIAN>
@@ -41,6 +56,10 @@ create_with_bits_endian (const RawFormat& raw_format, Error& error)
     {
       case RawFormat::SIGNED:   return new RawConverterImpl<BIT_DEPTH, ENDIAN, RawFormat::SIGNED>();
       case RawFormat::UNSIGNED: return new RawConverterImpl<BIT_DEPTH, ENDIAN, RawFormat::UNSIGNED>();
+      case RawFormat::FLOAT:    if (BIT_DEPTH == 32)
+                                  return new RawConverterImpl<32, ENDIAN, RawFormat::FLOAT>();
+                                error = Error ("float encoding requires 32 bits");
+                                return nullptr;
     }
   error = Error ("unsupported encoding");
   return nullptr;
@@ -67,57 +86,242 @@ RawConverter::create (const RawFormat& raw_format, Error& error)
     {
       case 16: return create_with_bits<16> (raw_format, error);
       case 24: return create_with_bits<24> (raw_format, error);
+      case 32: return create_with_bits<32> (raw_format, error);
       default: error = Error ("unsupported bit depth");
                return nullptr;
     }
 }
 
+/* shift for each byte of the sample: bytes are stored in the top BIT_DEPTH bits of an int32 */
 template<int BIT_DEPTH, RawFormat::Endian ENDIAN>
-constexpr std::array<int, 3>
+constexpr std::array<int, 4>
 make_endian_shift ()
 {
   if (BIT_DEPTH == 16)
     {
       if (ENDIAN == RawFormat::Endian::LITTLE)
-        return { 16, 24, -1 };
+        return { 16, 24, -1, -1 };
       else
-        return { 24, 16, -1 };
+        return { 24, 16, -1, -1 };
     }
   if (BIT_DEPTH == 24)
     {
       if (ENDIAN == RawFormat::Endian::LITTLE)
-        return {  8, 16, 24 };
+        return {  8, 16, 24, -1 };
       else
-        return { 24, 16, 8 };
+        return { 24, 16,  8, -1 };
+    }
+  if (BIT_DEPTH == 32)
+    {
+      if (ENDIAN == RawFormat::Endian::LITTLE)
+        return {  0,  8, 16, 24 };
+      else
+        return { 24, 16,  8,  0 };
+    }
+}
+
+/* 32 bit float samples, byte swapped if necessary */
+template<RawFormat::Endian ENDIAN>
+static void
+copy_float (const unsigned char *in, size_t n_samples, unsigned char *out)
+{
+  if (ENDIAN == RawFormat::native_endian())
+    {
+      memcpy (out, in, n_samples * 4);
+      return;
+    }
+  for (size_t i = 0; i < n_samples; i++)
+    {
+      out[0] = in[3];
+      out[1] = in[2];
+      out[2] = in[1];
+      out[3] = in[0];
+      in += 4;
+      out += 4;
+    }
+}
+
+/* the conversion kernels below produce exactly the same output as the generic loop:
+ *
+ *  - float -> int uses the same scaling, clipping and rounding (round to nearest even)
+ *  - for 16/24 bit, clipping to (2^31 - 128) instead of (2^31 - 1) doesn't affect the output bits
+ *
+ * each kernel converts a multiple of its block size and returns the number of samples it converted
+ */
+#ifdef __SSE2__
+template<RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
+static size_t
+from_raw_16_sse2 (const unsigned char *ptr, size_t n_samples, float *samples)
+{
+  const __m128  norm      = _mm_set1_ps (1.0f / 0x8000);
+  const __m128i sign_flip = _mm_set1_epi16 (ENCODING == RawFormat::UNSIGNED ? -0x8000 : 0);
+
+  size_t i = 0;
+  for (; i + 8 <= n_samples; i += 8)
+    {
+      __m128i x = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 2 * i));
+      if (ENDIAN == RawFormat::BIG)
+        x = _mm_or_si128 (_mm_slli_epi16 (x, 8), _mm_srli_epi16 (x, 8));
+      x = _mm_xor_si128 (x, sign_flip);
+
+      /* sign extend to 32 bit */
+      const __m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (x, x), 16);
+      const __m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (x, x), 16);
+      _mm_storeu_ps (samples + i,     _mm_mul_ps (_mm_cvtepi32_ps (lo), norm));
+      _mm_storeu_ps (samples + i + 4, _mm_mul_ps (_mm_cvtepi32_ps (hi), norm));
+    }
+  return i;
+}
+
+static inline __m128i
+float_to_int32_sse2 (const float *samples)
+{
+  const __m128 norm      = _mm_set1_ps (0x80000000LL);
+  const __m128 min_value = _mm_set1_ps (-0x80000000LL);
+  const __m128 max_value = _mm_set1_ps (0x7FFFFF80); /* largest float below 2^31 */
+
+  __m128 x = _mm_mul_ps (_mm_loadu_ps (samples), norm);
+  x = _mm_min_ps (_mm_max_ps (x, min_value), max_value);
+  return _mm_cvtps_epi32 (x);
+}
+
+template<RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
+static size_t
+to_raw_16_sse2 (const float *samples, size_t n_samples, unsigned char *ptr)
+{
+  const __m128i sign_flip = _mm_set1_epi16 (ENCODING == RawFormat::UNSIGNED ? -0x8000 : 0);
+
+  size_t i = 0;
+  for (; i + 8 <= n_samples; i += 8)
+    {
+      const __m128i lo = _mm_srai_epi32 (float_to_int32_sse2 (samples + i), 16);
+      const __m128i hi = _mm_srai_epi32 (float_to_int32_sse2 (samples + i + 4), 16);
+
+      __m128i x = _mm_xor_si128 (_mm_packs_epi32 (lo, hi), sign_flip);
+      if (ENDIAN == RawFormat::BIG)
+        x = _mm_or_si128 (_mm_slli_epi16 (x, 8), _mm_srli_epi16 (x, 8));
+      _mm_storeu_si128 (reinterpret_cast<__m128i *> (ptr + 2 * i), x);
+    }
+  return i;
+}
+#endif
+
+#ifdef RAW_CONVERTER_SSSE3
+static bool
+have_ssse3()
+{
+  static bool ssse3 = __builtin_cpu_supports ("ssse3");
+  return ssse3;
+}
+
+/* shuffle 24 bit samples into the top 24 bits of each 32 bit value */
+template<RawFormat::Endian ENDIAN>
+__attribute__ ((target ("ssse3"))) static inline __m128i
+shuffle_24_to_32()
+{
+  if (ENDIAN == RawFormat::LITTLE)
+    return _mm_setr_epi8 (-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+  else
+    return _mm_setr_epi8 (-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+}
+
+template<RawFormat::Endian ENDIAN>
+__attribute__ ((target ("ssse3"))) static inline __m128i
+shuffle_32_to_24()
+{
+  if (ENDIAN == RawFormat::LITTLE)
+    return _mm_setr_epi8 (1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+  else
+    return _mm_setr_epi8 (3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+}
+
+template<RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
+__attribute__ ((target ("ssse3"))) static size_t
+from_raw_24_ssse3 (const unsigned char *ptr, size_t n_samples, float *samples)
+{
+  const __m128  norm      = _mm_set1_ps (1.0 / 0x80000000LL);
+  const __m128i sign_flip = _mm_set1_epi32 (ENCODING == RawFormat::UNSIGNED ? INT_MIN : 0);
+  const __m128i shuffle   = shuffle_24_to_32<ENDIAN>();
+
+  /* each iteration reads 16 bytes, but only uses 12 */
+  size_t i = 0;
+  for (; i + 6 <= n_samples; i += 4)
+    {
+      __m128i x = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 3 * i));
+      x = _mm_xor_si128 (_mm_shuffle_epi8 (x, shuffle), sign_flip);
+      _mm_storeu_ps (samples + i, _mm_mul_ps (_mm_cvtepi32_ps (x), norm));
     }
+  return i;
 }
 
+template<RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
+__attribute__ ((target ("ssse3"))) static size_t
+to_raw_24_ssse3 (const float *samples, size_t n_samples, unsigned char *ptr)
+{
+  const __m128i sign_flip = _mm_set1_epi32 (ENCODING == RawFormat::UNSIGNED ? INT_MIN : 0);
+  const __m128i shuffle   = shuffle_32_to_24<ENDIAN>();
+
+  /* each iteration writes 16 bytes, but only 12 bytes are valid (and overwritten by the next iteration) */
+  size_t i = 0;
+  for (; i + 6 <= n_samples; i += 4)
+    {
+      __m128i x = _mm_xor_si128 (float_to_int32_sse2 (samples + i), sign_flip);
+      _mm_storeu_si128 (reinterpret_cast<__m128i *> (ptr + 3 * i), _mm_shuffle_epi8 (x, shuffle));
+    }
+  return i;
+}
+#endif
+
 template<int BIT_DEPTH, RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
 void
 RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::to_raw (const vector<float>& samples, vector<unsigned char>& output_bytes)
 {
-  constexpr int  sample_width = BIT_DEPTH / 8;
-  constexpr auto eshift = make_endian_shift<BIT_DEPTH, ENDIAN>();
-  constexpr unsigned char sign_flip = ENCODING == RawFormat::SIGNED ? 0x00 : 0x80;
+  constexpr int sample_width = BIT_DEPTH / 8;
 
   output_bytes.resize (sample_width * samples.size());
+  to_raw (samples.data(), samples.size(), output_bytes.data());
+}
 
-  unsigned char *ptr = output_bytes.data();
+template<int BIT_DEPTH, RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
+void
+RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::to_raw (const float *samples, size_t n_samples, unsigned char *ptr)
+{
+  constexpr int  sample_width = BIT_DEPTH / 8;
+  constexpr auto eshift = make_endian_shift<BIT_DEPTH, ENDIAN>();
+  constexpr unsigned int sign_flip = ENCODING == RawFormat::UNSIGNED ? 0x80000000 : 0;
+
+  if (ENCODING == RawFormat::FLOAT)
+    {
+      copy_float<ENDIAN> (reinterpret_cast<const unsigned char *> (samples), n_samples, ptr);
+      return;
+    }
+  size_t i = 0;
+#ifdef __SSE2__
+  if (BIT_DEPTH == 16)
+    i = to_raw_16_sse2<ENDIAN, ENCODING> (samples, n_samples, ptr);
+#endif
+#ifdef RAW_CONVERTER_SSSE3
+  if (BIT_DEPTH == 24 && have_ssse3())
+    i = to_raw_24_ssse3<ENDIAN, ENCODING> (samples, n_samples, ptr);
+#endif
+  ptr += i * sample_width;
 
-  for (size_t i = 0; i < samples.size(); i++)
+  for (; i < n_samples; i++)
     {
       const double norm      =  0x80000000LL;
       const double min_value = -0x80000000LL;
       const double max_value =  0x7FFFFFFF;
 
-      const int    sample = lrint (bound<double> (min_value, samples[i] * norm, max_value));
+      const unsigned int sample = lrint (bound<double> (min_value, samples[i] * norm, max_value)) ^ sign_flip;
 
       if (eshift[0] >= 0)
-        ptr[0] = (sample >> eshift[0]) ^ sign_flip;
+        ptr[0] = sample >> eshift[0];
       if (eshift[1] >= 0)
         ptr[1] = sample >> eshift[1];
       if (eshift[2] >= 0)
         ptr[2] = sample >> eshift[2];
+      if (eshift[3] >= 0)
+        ptr[3] = sample >> eshift[3];
 
       ptr += sample_width;
     }
@@ -127,25 +331,51 @@ template<int BIT_DEPTH, RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
 void
 RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::from_raw (const vector<unsigned char>& input_bytes, vector<float>& samples)
 {
-  const unsigned char *ptr = input_bytes.data();
   constexpr int sample_width = BIT_DEPTH / 8;
-  constexpr auto eshift = make_endian_shift<BIT_DEPTH, ENDIAN>();
-  constexpr unsigned char sign_flip = ENCODING == RawFormat::SIGNED ? 0x00 : 0x80;
 
   samples.resize (input_bytes.size() / sample_width);
+  from_raw (input_bytes.data(), samples.size(), samples.data());
+}
+
+template<int BIT_DEPTH, RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
+void
+RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::from_raw (const unsigned char *ptr, size_t n_samples, float *samples)
+{
+  constexpr int  sample_width = BIT_DEPTH / 8;
+  constexpr auto eshift = make_endian_shift<BIT_DEPTH, ENDIAN>();
+  constexpr unsigned int sign_flip = ENCODING == RawFormat::UNSIGNED ? 0x80000000 : 0;
+
+  if (ENCODING == RawFormat::FLOAT)
+    {
+      copy_float<ENDIAN> (ptr, n_samples, reinterpret_cast<unsigned char *> (samples));
+      return;
+    }
+  size_t i = 0;
+#ifdef __SSE2__
+  if (BIT_DEPTH == 16)
+    i = from_raw_16_sse2<ENDIAN, ENCODING> (ptr, n_samples, samples);
+#endif
+#ifdef RAW_CONVERTER_SSSE3
+  if (BIT_DEPTH == 24 && have_ssse3())
+    i = from_raw_24_ssse3<ENDIAN, ENCODING> (ptr, n_samples, samples);
+#endif
+  ptr += i * sample_width;
+
   const double norm = 1.0 / 0x80000000LL;
-  for (size_t i = 0; i < samples.size(); i++)
+  for (; i < n_samples; i++)
     {
-      int s32 = 0;
+      unsigned int s32 = 0;
 
       if (eshift[0] >= 0)
-        s32 += (ptr[0] ^ sign_flip) << eshift[0];
+        s32 += uint32_t (ptr[0]) << eshift[0];
       if (eshift[1] >= 0)
-        s32 += ptr[1] << eshift[1];
+        s32 += uint32_t (ptr[1]) << eshift[1];
       if (eshift[2] >= 0)
-        s32 += ptr[2] << eshift[2];
+        s32 += uint32_t (ptr[2]) << eshift[2];
+      if (eshift[3] >= 0)
+        s32 += uint32_t (ptr[3]) << eshift[3];
 
-      samples[i] = s32 * norm;
+      samples[i] = int (s32 ^ sign_flip) * norm;
       ptr += sample_width;
     }
 }
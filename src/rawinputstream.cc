@@ -138,6 +138,17 @@ RawInputStream::read_frames (vector<float>& samples, size_t count)
   const int n_channels   = m_format.n_channels();
   const int sample_width = m_format.bit_depth() / 8;
 
+  if (m_format.is_native_float())
+    {
+      /* no conversion necessary: read samples directly */
+      samples.resize (count * n_channels);
+      size_t r_count = fread (samples.data(), n_channels * sample_width, count, m_input_file);
+      if (ferror (m_input_file))
+        return Error ("error reading sample data");
+
+      samples.resize (r_count * n_channels);
+      return Error::Code::NONE;
+    }
   vector<unsigned char> input_bytes (count * n_channels * sample_width);
   size_t r_count = fread (input_bytes.data(), n_channels * sample_width, count, m_input_file);
   if (ferror (m_input_file))
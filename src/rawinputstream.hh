@@ -34,7 +34,8 @@ public:
   };
   enum Encoding {
     SIGNED,
-    UNSIGNED
+    UNSIGNED,
+    FLOAT
   };
 private:
   int       m_n_channels  = 2;
@@ -57,6 +58,22 @@ public:
   void set_bit_depth (int bits);
   void set_endian (Endian endian);
   void set_encoding (Encoding encoding);
+
+  static constexpr Endian
+  native_endian()
+  {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return BIG;
+#else
+    return LITTLE;
+#endif
+  }
+  /* float samples in native byte order can be used without conversion */
+  bool
+  is_native_float() const
+  {
+    return m_bit_depth == 32 && m_encoding == FLOAT && m_endian == native_endian();
+  }
 };
 
 class RawConverter;
@@ -87,10 +87,18 @@ RawOutputStream::write_frames (const vector<float>& samples)
 {
   assert (m_state == State::OPEN);
 
-  vector<unsigned char> bytes;
-  m_raw_converter->to_raw (samples, bytes);
+  if (m_format.is_native_float())
+    {
+      /* no conversion necessary: write samples directly */
+      fwrite (samples.data(), sizeof (float), samples.size(), m_output_file);
+    }
+  else
+    {
+      vector<unsigned char> bytes;
+      m_raw_converter->to_raw (samples, bytes);
 
-  fwrite (&bytes[0], 1, bytes.size(), m_output_file);
+      fwrite (&bytes[0], 1, bytes.size(), m_output_file);
+    }
   if (ferror (m_output_file))
     return Error ("write sample data failed");
 
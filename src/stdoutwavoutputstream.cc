@@ -17,6 +17,7 @@
 
 #include "stdoutwavoutputstream.hh"
 #include "utils.hh"
+#include "wmcommon.hh"
 
 #include <assert.h>
 #include <math.h>
@@ -70,6 +71,13 @@ header_append_u16 (vector<unsigned char>& bytes, uint16_t u)
   bytes.push_back (u >> 8);
 }
 
+static void
+header_append_u64 (vector<unsigned char>& bytes, uint64_t u)
+{
+  header_append_u32 (bytes, u);
+  header_append_u32 (bytes, u >> 32);
+}
+
 Error
 StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, size_t n_frames)
 {
@@ -79,10 +87,6 @@ StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, siz
     {
       return Error ("StdoutWavOutputStream::open: unsupported bit depth");
     }
-  if (n_frames == AudioInputStream::N_FRAMES_UNKNOWN)
-    {
-      return Error ("unable to write wav format to standard out without input length information");
-    }
 
   RawFormat format;
   format.set_bit_depth (bit_depth);
@@ -92,16 +96,46 @@ StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, siz
   if (err)
     return err;
 
-  vector<unsigned char> header_bytes;
+  const int block_align = n_channels * bit_depth / 8;
+
+  /* if the length is unknown (for instance for raw input), we stream the data and use the
+   * largest possible size in the header (like other programs that write wav files to pipes);
+   * most programs that read wav files from pipes read until the end of the stream then
+   */
+  m_streaming = (n_frames == AudioInputStream::N_FRAMES_UNKNOWN);
 
-  size_t data_size = n_frames * n_channels * ((bit_depth + 7) / 8);
+  const bool     rf64 = Params::output_rf64;
+  const uint64_t max_data_size = rf64 ? UINT64_MAX : (0xFFFFFFFF - 36) / block_align * block_align;
+  uint64_t       data_size = m_streaming ? max_data_size : uint64_t (n_frames) * block_align;
 
-  m_close_padding = data_size & 1; // padding to ensure even data size
-  size_t aligned_data_size = data_size + m_close_padding;
+  if (!rf64 && data_size > max_data_size)
+    return Error ("unable to write wav format to standard out: file too large (use --output-rf64)");
 
-  header_append_str (header_bytes, "RIFF");
-  header_append_u32 (header_bytes, 36 + aligned_data_size);
-  header_append_str (header_bytes, "WAVE");
+  m_close_padding = m_streaming ? 0 : data_size & 1; // padding to ensure even data size
+  uint64_t aligned_data_size = data_size + m_close_padding;
+
+  vector<unsigned char> header_bytes;
+
+  if (rf64)
+    {
+      /* RF64: 32-bit sizes are stored in ds64 chunk */
+      header_append_str (header_bytes, "RF64");
+      header_append_u32 (header_bytes, 0xFFFFFFFF);
+      header_append_str (header_bytes, "WAVE");
+
+      header_append_str (header_bytes, "ds64");
+      header_append_u32 (header_bytes, 28); // chunk size
+      header_append_u64 (header_bytes, m_streaming ? UINT64_MAX : 72 + aligned_data_size); // riff size
+      header_append_u64 (header_bytes, data_size);
+      header_append_u64 (header_bytes, m_streaming ? UINT64_MAX : n_frames); // sample count
+      header_append_u32 (header_bytes, 0); // table length
+    }
+  else
+    {
+      header_append_str (header_bytes, "RIFF");
+      header_append_u32 (header_bytes, 36 + aligned_data_size);
+      header_append_str (header_bytes, "WAVE");
+    }
 
   // subchunk 1
   header_append_str (header_bytes, "fmt ");
@@ -109,15 +143,17 @@ StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, siz
   header_append_u16 (header_bytes, 1);  // uncompressed audio
   header_append_u16 (header_bytes, n_channels);
   header_append_u32 (header_bytes, sample_rate);
-  header_append_u32 (header_bytes, sample_rate * n_channels * bit_depth / 8); // byte rate
-  header_append_u16 (header_bytes, n_channels * bit_depth / 8); // block align
+  header_append_u32 (header_bytes, sample_rate * block_align); // byte rate
+  header_append_u16 (header_bytes, block_align); // block align
   header_append_u16 (header_bytes, bit_depth); // bits per sample
 
   // subchunk 2
   header_append_str (header_bytes, "data");
-  header_append_u32 (header_bytes, data_size);
+  header_append_u32 (header_bytes, rf64 ? 0xFFFFFFFF : data_size);
 
   fwrite (&header_bytes[0], 1, header_bytes.size(), stdout);
+  if (m_streaming)
+    fflush (stdout);
   if (ferror (stdout))
     return Error ("write wav header failed");
 
@@ -137,6 +173,10 @@ StdoutWavOutputStream::write_frames (const vector<float>& samples)
   m_raw_converter->to_raw (samples, output_bytes);
 
   fwrite (&output_bytes[0], 1, output_bytes.size(), stdout);
+
+  /* streaming: pass each chunk to the next program immediately */
+  if (m_streaming)
+    fflush (stdout);
   if (ferror (stdout))
     return Error ("write sample data failed");
 
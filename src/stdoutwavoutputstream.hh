@@ -29,6 +29,7 @@ class StdoutWavOutputStream : public AudioOutputStream
   int         m_sample_rate = 0;
   int         m_n_channels = 0;
   size_t      m_close_padding = 0;
+  bool        m_streaming = false;
 
   enum class State {
     NEW,
@@ -27,6 +27,7 @@
 #include "hls.hh"
 #include "sfinputstream.hh"
 #include "hlsoutputstream.hh"
+#include "hlscontext.hh"
 
 using std::string;
 using std::regex;
@@ -120,7 +121,7 @@ mark_zexpand (WavData& wav_data, size_t zero_frames, const string& bits)
 {
   WDInputStream in_stream (&wav_data);
 
-  WavData wav_data_out ({ /* no samples */ }, wav_data.n_channels(), wav_data.sample_rate(), wav_data.bit_depth());
+  WavData wav_data_out (vector<float>() /* no samples */, wav_data.n_channels(), wav_data.sample_rate(), wav_data.bit_depth());
   WDOutputStream out_stream (&wav_data_out);
 
   int rc = add_stream_watermark (&in_stream, &out_stream, bits, zero_frames);
@@ -188,6 +189,105 @@ seek_perf (int sample_rate, double seconds)
   return 0;
 }
 
+/* keeps the frames of one hls segment, like HLSOutputStream (without encoding) */
+class SegmentOutputStream : public AudioOutputStream
+{
+  int           m_n_channels = 0;
+  int           m_sample_rate = 0;
+  size_t        m_delete_frames = 0;
+  size_t        m_keep_frames = 0;
+public:
+  vector<float> samples;
+
+  SegmentOutputStream (int n_channels, int sample_rate, size_t delete_frames, size_t keep_frames) :
+    m_n_channels (n_channels),
+    m_sample_rate (sample_rate),
+    m_delete_frames (delete_frames),
+    m_keep_frames (keep_frames)
+  {
+  }
+  int bit_depth() const override    { return 16; }
+  int sample_rate() const override  { return m_sample_rate; }
+  int n_channels() const override   { return m_n_channels; }
+
+  Error
+  write_frames (const vector<float>& frames) override
+  {
+    size_t skip = min (m_delete_frames, frames.size() / m_n_channels);
+    m_delete_frames -= skip;
+
+    size_t keep = min (m_keep_frames, frames.size() / m_n_channels - skip);
+    m_keep_frames -= keep;
+
+    samples.insert (samples.end(), frames.begin() + skip * m_n_channels, frames.begin() + (skip + keep) * m_n_channels);
+    return Error::Code::NONE;
+  }
+  Error close() override  { return Error::Code::NONE; }
+  bool  done() const override { return m_keep_frames == 0; }
+};
+
+/* benchmark hls-add watermarking (without AAC encoding) of one 6 second segment with and without precomputed analysis */
+int
+analysis_perf (int sample_rate, int n)
+{
+  const int    n_channels = 2;
+  const size_t seg_size   = 6 * sample_rate / 1024 * 1024;
+  const size_t prev_size  = 3 * sample_rate;
+  const size_t next_size  = 3 * sample_rate;
+  const size_t start_pos  = 10 * seg_size;
+  const size_t prev_ctx   = 1024 * 3;
+  const size_t keep       = prev_ctx + seg_size + 1024; // aac encoder delay
+
+  auto context = std::make_shared<HLSContext>();
+  context->n_channels  = n_channels;
+  context->sample_rate = sample_rate;
+  context->bit_depth   = 16;
+
+  for (size_t i = 0; i < (prev_size + seg_size + next_size) * n_channels; i++)
+    context->samples.push_back (rand() / double (RAND_MAX) * 0.2 - 0.1);
+
+  set_log_level (Log::WARNING);
+
+  double start_time = get_time();
+  int rc;
+  {
+    HLSContextInputStream in_stream (context);
+    rc = analyze_stream_watermark (&in_stream, start_pos - prev_size, prev_size - prev_ctx, context->analysis);
+  }
+  if (rc != 0)
+    return rc;
+  double analyze_time = get_time() - start_time;
+
+  vector<float> out_samples[2];
+  double        times[2] = { 0, 0 };
+  for (int i = 0; i < n; i++)
+    {
+      for (int a = 0; a < 2; a++)
+        {
+          HLSContextInputStream in_stream (context);
+          SegmentOutputStream   out_stream (n_channels, sample_rate, prev_size - prev_ctx, keep);
+
+          start_time = get_time();
+          rc = add_stream_watermark (&in_stream, &out_stream, "0123456789abcdef0011223344556677", start_pos - prev_size, prev_size - prev_ctx,
+                                     a ? &context->analysis : nullptr);
+          if (rc != 0)
+            return rc;
+          times[a] += get_time() - start_time;
+          out_samples[a] = out_stream.samples;
+        }
+    }
+  const size_t context_bytes  = context->samples.size() * 2; // 16 bit
+  const size_t analysis_bytes = context->analysis.bins.size() * sizeof (context->analysis.bins[0]);
+
+  printf ("analyze (hls-prepare):        %7.3f ms\n", analyze_time * 1000);
+  printf ("add without analysis:         %7.3f ms\n", times[0] / n * 1000);
+  printf ("add with analysis:            %7.3f ms\n", times[1] / n * 1000);
+  printf ("context size (16 bit):        %7zd KB\n", context_bytes / 1024);
+  printf ("analysis size:                %7zd KB (%zd frames)\n", analysis_bytes / 1024, context->analysis.n_frames());
+  printf ("output identical:             %s\n", out_samples[0] == out_samples[1] ? "yes" : "NO");
+  return out_samples[0] == out_samples[1] ? 0 : 1;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -199,6 +299,10 @@ main (int argc, char **argv)
     {
       return seek_perf (atoi (argv[2]), atof (argv[3]));
     }
+  else if (argc == 4 && strcmp (argv[1], "analysis-perf") == 0)
+    {
+      return analysis_perf (atoi (argv[2]), atoi (argv[3]));
+    }
   else if (argc == 4 && strcmp (argv[1], "ff-decode") == 0)
     {
       WavData wd;
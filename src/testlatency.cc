@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <thread>
+
+#include "utils.hh"
+#include "wmcommon.hh"
+#include "random.hh"
+#include "rawconverter.hh"
+#include "sfinputstream.hh"
+#include "sfoutputstream.hh"
+
+using std::string;
+using std::vector;
+using std::max;
+
+/* input stream wrapper: counts the number of frames read from the pipe */
+class CountInputStream : public AudioInputStream
+{
+  AudioInputStream *m_in = nullptr;
+public:
+  size_t frames_read = 0;
+
+  CountInputStream (AudioInputStream *in) :
+    m_in (in)
+  {
+  }
+  int bit_depth() const override    { return m_in->bit_depth(); }
+  int sample_rate() const override  { return m_in->sample_rate(); }
+  int n_channels() const override   { return m_in->n_channels(); }
+  size_t n_frames() const override  { return m_in->n_frames(); }
+
+  Error
+  read_frames (vector<float>& samples, size_t count) override
+  {
+    Error err = m_in->read_frames (samples, count);
+    frames_read += samples.size() / n_channels();
+    return err;
+  }
+};
+
+/* output stream that measures latency instead of writing the samples */
+class LatencyOutputStream : public AudioOutputStream
+{
+  CountInputStream *m_in = nullptr;
+  double            m_start_time = 0;
+  double            m_last_time = 0;
+public:
+  size_t  frames_written = 0;
+  double  first_output_time = -1;
+  size_t  first_output_input_frames = 0;
+  size_t  chunks = 0;
+  double  chunk_time_sum = 0;
+  double  chunk_time_max = 0;
+  double  delay_frames_sum = 0;
+  size_t  delay_frames_max = 0;
+
+  LatencyOutputStream (CountInputStream *in, double start_time) :
+    m_in (in),
+    m_start_time (start_time),
+    m_last_time (start_time)
+  {
+  }
+  int bit_depth() const override    { return m_in->bit_depth(); }
+  int sample_rate() const override  { return m_in->sample_rate(); }
+  int n_channels() const override   { return m_in->n_channels(); }
+
+  Error
+  write_frames (const vector<float>& samples) override
+  {
+    if (samples.empty())
+      return Error::Code::NONE;
+
+    const double now = get_time();
+    if (first_output_time < 0)
+      {
+        first_output_time = now - m_start_time;
+        first_output_input_frames = m_in->frames_read;
+      }
+    else
+      {
+        /* steady state: time between two output chunks and frames buffered inside the watermarker */
+        const size_t delay_frames = m_in->frames_read - frames_written;
+
+        chunks++;
+        chunk_time_sum += now - m_last_time;
+        chunk_time_max = max (chunk_time_max, now - m_last_time);
+        delay_frames_sum += delay_frames;
+        delay_frames_max = max (delay_frames_max, delay_frames);
+      }
+    frames_written += samples.size() / n_channels();
+    m_last_time = now;
+    return Error::Code::NONE;
+  }
+  Error
+  close() override
+  {
+    return Error::Code::NONE;
+  }
+};
+
+static vector<float>
+gen_noise (int n_channels, int sample_rate, double seconds)
+{
+  Random rng (0, Random::Stream::data_up_down); /* there is no stream for this test */
+
+  vector<float> samples (lrint (seconds * sample_rate) * n_channels);
+  for (auto& s : samples)
+    s = (double (rng()) / UINT64_MAX * 2 - 1) * 0.5;
+  return samples;
+}
+
+struct LatencyResult
+{
+  double first_output_ms = 0;       // wall clock
+  double first_output_audio_ms = 0; // audio read before first output
+  size_t chunks = 0;
+  double chunk_avg_ms = 0;
+  double chunk_max_ms = 0;
+  double delay_avg_ms = 0;
+  double delay_max_ms = 0;
+  double realtime_factor = 0;
+};
+
+static int
+measure_latency (const string& format, int sample_rate, double seconds, LatencyResult& result)
+{
+  const int n_channels = 2;
+
+  /* prepare input bytes for the pipe */
+  vector<float>         samples = gen_noise (n_channels, sample_rate, seconds);
+  vector<unsigned char> bytes;
+  Error err;
+
+  if (format == "wav")
+    {
+      SFOutputStream sf_out;
+      err = sf_out.open (&bytes, n_channels, sample_rate, 16);
+      if (!err)
+        err = sf_out.write_frames (samples);
+      if (!err)
+        err = sf_out.close();
+    }
+  else if (format == "raw")
+    {
+      RawFormat raw_format (n_channels, sample_rate, 16);
+
+      std::unique_ptr<RawConverter> raw_converter (RawConverter::create (raw_format, err));
+      if (!err)
+        raw_converter->to_raw (samples, bytes);
+    }
+  else
+    {
+      error ("testlatency: unsupported format '%s'\n", format.c_str());
+      return 1;
+    }
+  if (err)
+    {
+      error ("testlatency: generating %s input failed: %s\n", format.c_str(), err.message());
+      return 1;
+    }
+
+  int pipe_fds[2];
+  if (pipe (pipe_fds) == -1)
+    {
+      error ("testlatency: pipe() failed\n");
+      return 1;
+    }
+  /* feed pipe from a separate thread (as fast as the watermarker reads) */
+  std::thread writer ([&] {
+    size_t pos = 0;
+    while (pos < bytes.size())
+      {
+        ssize_t w = write (pipe_fds[1], &bytes[pos], std::min<size_t> (bytes.size() - pos, 4096));
+        if (w <= 0)
+          break;
+        pos += w;
+      }
+    close (pipe_fds[1]);
+  });
+
+  const string  pipe_name  = string_printf ("/dev/fd/%d", pipe_fds[0]);
+  const double  start_time = get_time();
+
+  std::unique_ptr<AudioInputStream> in_stream;
+  if (format == "wav")
+    {
+      SFInputStream *sf_in = new SFInputStream();
+      in_stream.reset (sf_in);
+      err = sf_in->open (pipe_name);
+    }
+  else
+    {
+      RawInputStream *raw_in = new RawInputStream();
+      in_stream.reset (raw_in);
+      err = raw_in->open (pipe_name, RawFormat (n_channels, sample_rate, 16));
+    }
+  if (err)
+    {
+      error ("testlatency: open input pipe failed: %s\n", err.message());
+      close (pipe_fds[0]);
+      writer.join();
+      return 1;
+    }
+
+  CountInputStream    count_in (in_stream.get());
+  LatencyOutputStream latency_out (&count_in, start_time);
+
+  set_log_level (Log::WARNING);
+  int rc = add_stream_watermark (&count_in, &latency_out, "0123456789abcdef0011223344556677", 0);
+  const double end_time = get_time();
+
+  in_stream.reset();
+  close (pipe_fds[0]);
+  writer.join();
+  if (rc != 0)
+    return rc;
+
+  const double ms_per_frame = 1000.0 / sample_rate;
+  result.first_output_ms       = latency_out.first_output_time * 1000;
+  result.first_output_audio_ms = latency_out.first_output_input_frames * ms_per_frame;
+  result.chunks                = latency_out.chunks;
+  if (latency_out.chunks)
+    {
+      result.chunk_avg_ms = latency_out.chunk_time_sum / latency_out.chunks * 1000;
+      result.chunk_max_ms = latency_out.chunk_time_max * 1000;
+      result.delay_avg_ms = latency_out.delay_frames_sum / latency_out.chunks * ms_per_frame;
+      result.delay_max_ms = latency_out.delay_frames_max * ms_per_frame;
+    }
+  result.realtime_factor = seconds / (end_time - start_time);
+  return 0;
+}
+
+static int
+run_latency (const string& format, int sample_rate, double seconds)
+{
+  LatencyResult result;
+  int rc = measure_latency (format, sample_rate, seconds, result);
+  if (rc != 0)
+    return rc;
+
+  printf ("format:                 %s, %d Hz, limiter block size %.1f ms\n", format.c_str(), sample_rate, Params::limiter_block_size_ms);
+  printf ("first output:           %.3f ms (wall clock)\n", result.first_output_ms);
+  printf ("first output:           %.3f ms (audio read before first output)\n", result.first_output_audio_ms);
+  if (result.chunks)
+    {
+      printf ("chunk interval:         %.3f ms avg, %.3f ms max\n", result.chunk_avg_ms, result.chunk_max_ms);
+      printf ("steady state delay:     %.3f ms avg, %.3f ms max\n", result.delay_avg_ms, result.delay_max_ms);
+    }
+  printf ("realtime factor:        %.2f\n", result.realtime_factor);
+
+  /* --low-latency only reduces the limiter delay; if the input needs to be resampled to the watermark
+   * sample rate (and back), the resamplers add some more delay, which we get by comparing with a run
+   * at the watermark sample rate
+   */
+  if (sample_rate != Params::mark_sample_rate)
+    {
+      LatencyResult native_result;
+      rc = measure_latency (format, Params::mark_sample_rate, seconds, native_result);
+      if (rc != 0)
+        return rc;
+
+      printf ("resampler delay:        %.3f ms (first output), %.3f ms avg (steady state)\n",
+              result.first_output_audio_ms - native_result.first_output_audio_ms,
+              result.delay_avg_ms - native_result.delay_avg_ms);
+    }
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc >= 3 && strcmp (argv[1], "--low-latency") == 0)
+    {
+      Params::limiter_block_size_ms = Params::limiter_block_size_ms_low_latency;
+      argc--;
+      argv++;
+    }
+  if (argc == 4)
+    {
+      return run_latency (argv[1], atoi (argv[2]), atof (argv[3]));
+    }
+  else
+    {
+      error ("usage: testlatency [--low-latency] wav|raw <sample_rate> <seconds>\n");
+      return 1;
+    }
+}
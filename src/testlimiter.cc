@@ -32,6 +32,149 @@ using std::vector;
 using std::max;
 using std::min;
 
+/* previous (scalar) limiter implementation, used as reference for benchmarking */
+class RefLimiter
+{
+  float ceiling           = 1;
+  float block_max_last    = 0;
+  float block_max_current = 0;
+  float block_max_next    = 0;
+  uint  block_size        = 0;
+  uint  n_channels        = 0;
+  uint  sample_rate       = 0;
+
+  vector<float> buffer;
+
+  float
+  block_max (const float *in)
+  {
+    float maximum = ceiling;
+    for (uint x = 0; x < block_size * n_channels; x++)
+      maximum = max (maximum, fabs (in[x]));
+    return maximum;
+  }
+  void
+  process_block (const float *in, float *out)
+  {
+    if (block_max_last < ceiling)
+      block_max_last = ceiling;
+    if (block_max_current < ceiling)
+      block_max_current = block_max (in);
+    if (block_max_next < ceiling)
+      block_max_next = block_max (in + block_size * n_channels);
+
+    const float scale_start = ceiling / max (block_max_last, block_max_current);
+    const float scale_end = ceiling / max (block_max_current, block_max_next);
+    const float scale_step = (scale_end - scale_start) / block_size;
+    for (size_t i = 0; i < block_size; i++)
+      {
+        const float scale = scale_start + i * scale_step;
+
+        for (uint c = 0; c < n_channels; c++)
+          out[i * n_channels + c] = in[i * n_channels + c] * scale;
+      }
+
+    block_max_last = block_max_current;
+    block_max_current = block_max_next;
+    block_max_next = 0;
+  }
+public:
+  RefLimiter (int n_channels, int sample_rate) :
+    n_channels (n_channels),
+    sample_rate (sample_rate)
+  {
+  }
+  void
+  set_block_size_ms (double ms)
+  {
+    block_size = max<uint> (sample_rate * ms / 1000, 1);
+  }
+  void
+  set_ceiling (float new_ceiling)
+  {
+    ceiling = new_ceiling;
+  }
+  vector<float>
+  process (const vector<float>& samples)
+  {
+    buffer.insert (buffer.end(), samples.begin(), samples.end());
+
+    const uint buffered_blocks = buffer.size() / n_channels / block_size;
+    if (buffered_blocks < 2)
+      return {};
+
+    const uint blocks_todo = buffered_blocks - 1;
+
+    vector<float> out (blocks_todo * block_size * n_channels);
+    for (uint b = 0; b < blocks_todo; b++)
+      process_block (&buffer[b * block_size * n_channels], &out[b * block_size * n_channels]);
+
+    buffer.erase (buffer.begin(), buffer.begin() + blocks_todo * block_size * n_channels);
+
+    return out;
+  }
+};
+
+template<class L> double
+bench_limiter (int n_channels, double block_size_ms, const vector<float>& samples, vector<float> *out_all)
+{
+  L limiter (n_channels, 44100);
+  limiter.set_block_size_ms (block_size_ms);
+  limiter.set_ceiling (0.9);
+
+  const size_t chunk_size = 1024 * n_channels;
+  vector<float> chunk;
+
+  double start = get_time();
+  for (size_t pos = 0; pos < samples.size(); pos += chunk_size)
+    {
+      chunk.assign (samples.begin() + pos, samples.begin() + min (pos + chunk_size, samples.size()));
+
+      vector<float> out_samples = limiter.process (chunk);
+      if (out_all)
+        out_all->insert (out_all->end(), out_samples.begin(), out_samples.end());
+    }
+  double end = get_time();
+  return (end - start) * 1000 * 1000 * 1000 / (samples.size() / n_channels);
+}
+
+int
+bench()
+{
+  const size_t n_frames = 44100 * 60;
+
+  for (int n_channels : { 1, 2, 6 })
+    {
+      /* deterministic test signal, with peaks above the ceiling */
+      vector<float> samples (n_frames * n_channels);
+      uint32_t state = 1;
+      for (auto& s : samples)
+        {
+          state = state * 1664525 + 1013904223;
+          s = (int32_t (state) / 2147483648.0) * 1.2;
+        }
+      for (double block_size_ms : { 1000., 20. })
+        {
+          vector<float> ref_out, out;
+
+          bench_limiter<RefLimiter> (n_channels, block_size_ms, samples, &ref_out);
+          bench_limiter<Limiter> (n_channels, block_size_ms, samples, &out);
+
+          double ref_ns = 1e300, ns = 1e300;
+          for (int rep = 0; rep < 5; rep++)
+            {
+              ref_ns = min (ref_ns, bench_limiter<RefLimiter> (n_channels, block_size_ms, samples, nullptr));
+              ns = min (ns, bench_limiter<Limiter> (n_channels, block_size_ms, samples, nullptr));
+            }
+          printf ("channels=%d block=%4.0fms: reference %6.3f ns/frame, limiter %6.3f ns/frame, speedup %.2f, output %s\n",
+                  n_channels, block_size_ms, ref_ns, ns, ref_ns / ns, ref_out == out ? "identical" : "DIFFERENT");
+          if (ref_out != out)
+            return 1;
+        }
+    }
+  return 0;
+}
+
 int
 perf()
 {
@@ -94,6 +237,8 @@ main (int argc, char **argv)
     return perf();
   if (argc == 2 && strcmp (argv[1], "impulses") == 0)
     return impulses();
+  if (argc == 2 && strcmp (argv[1], "bench") == 0)
+    return bench();
 
   SFInputStream in;
   SFOutputStream out;
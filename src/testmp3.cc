@@ -17,12 +17,74 @@
 
 #include "mp3inputstream.hh"
 #include "wavdata.hh"
+#include "wmcommon.hh"
+
+#include <string.h>
 
 using std::string;
+using std::vector;
+
+static int
+decode (const string& filename, int jobs, vector<float>& samples, size_t& ranges)
+{
+  Params::jobs     = jobs;
+  Params::mp3_jobs = true;
+
+  MP3InputStream m3i;
+  Error err = m3i.open (filename);
+  if (err)
+    {
+      printf ("mp3 open %s failed: %s\n", filename.c_str(), err.message());
+      return 1;
+    }
+  vector<float> block;
+  do
+    {
+      err = m3i.read_frames (block, 65536);
+      if (err)
+        {
+          printf ("mp3 read %s failed: %s\n", filename.c_str(), err.message());
+          return 1;
+        }
+      samples.insert (samples.end(), block.begin(), block.end());
+    }
+  while (block.size());
+
+  ranges = m3i.parallel_ranges();
+  return 0;
+}
+
+/* check that parallel decoding is really used for long files, and that it produces the same samples as serial decoding */
+static int
+test_parallel (const string& filename)
+{
+  vector<float> serial_samples, parallel_samples;
+  size_t        serial_ranges, parallel_ranges;
+
+  if (decode (filename, 1, serial_samples, serial_ranges) != 0 || decode (filename, 4, parallel_samples, parallel_ranges) != 0)
+    return 1;
+
+  if (parallel_ranges < 2)
+    {
+      printf ("parallel decoding was not used for %s (file must be longer than one minute)\n", filename.c_str());
+      return 1;
+    }
+  if (serial_samples != parallel_samples)
+    {
+      printf ("parallel decoding of %s doesn't match serial decoding\n", filename.c_str());
+      return 1;
+    }
+  printf ("parallel decoding of %s: %zd ranges, %zd samples, identical to serial decoding\n",
+          filename.c_str(), parallel_ranges, parallel_samples.size());
+  return 0;
+}
 
 int
 main (int argc, char **argv)
 {
+  if (argc == 3 && strcmp (argv[1], "parallel") == 0)
+    return test_parallel (argv[2]);
+
   WavData wd;
   if (argc >= 2)
     {
@@ -20,15 +20,198 @@
 
 #include <array>
 #include <regex>
+#include <memory>
+
+#include <math.h>
 
 #include "utils.hh"
 #include "mpegts.hh"
+#include "random.hh"
+#include "hlscontext.hh"
 
 using std::string;
 using std::vector;
 using std::map;
 using std::regex;
 
+/* sines with some noise, similar to real audio */
+static vector<float>
+gen_context_samples (int n_channels, int sample_rate, size_t n_frames)
+{
+  vector<float> samples;
+  Random rng (0, Random::Stream::data_up_down);
+  for (size_t i = 0; i < n_frames; i++)
+    {
+      for (int ch = 0; ch < n_channels; ch++)
+        {
+          double noise = (rng() % 2001) / 1000.0 - 1;
+          samples.push_back (0.3 * sin (i * 2 * M_PI * (440 + ch * 110) / sample_rate) + 0.01 * noise);
+        }
+    }
+  return samples;
+}
+
+static Error
+decode_context (HLSContextFormat format, const vector<unsigned char>& data, int n_channels, int sample_rate, HLSContext& context)
+{
+  context = HLSContext();
+  context.vars = { { "channels", std::to_string (n_channels) }, { "sample_rate", std::to_string (sample_rate) }, { "bit_depth", "16" } };
+  return hls_context_decode (format, data, context);
+}
+
+/* encode/decode speed and size of the context formats used for prepared hls segments */
+static int
+context_perf (const string& format_name)
+{
+  HLSContextFormat format;
+  Error err = hls_context_format_from_string (format_name, format);
+  if (err)
+    {
+      error ("testmpegts: %s\n", err.message());
+      return 1;
+    }
+
+  /* 16 seconds of stereo audio (3s context + 10s segment + 3s context) */
+  const int n_channels = 2;
+  const int sample_rate = 44100;
+  vector<float> samples = gen_context_samples (n_channels, sample_rate, 16 * sample_rate);
+  vector<unsigned char> data;
+
+  double start_time = get_time();
+  err = hls_context_encode (samples, n_channels, sample_rate, 16, format, data);
+  if (err)
+    {
+      error ("testmpegts: encode: %s\n", err.message());
+      return 1;
+    }
+  double encode_time = get_time() - start_time;
+
+  const int runs = 20;
+  HLSContext context;
+  start_time = get_time();
+  for (int i = 0; i < runs; i++)
+    {
+      err = decode_context (format, data, n_channels, sample_rate, context);
+      if (err)
+        {
+          error ("testmpegts: decode: %s\n", err.message());
+          return 1;
+        }
+    }
+  double decode_time = (get_time() - start_time) / runs;
+
+  if (context.samples.size() != samples.size())
+    {
+      error ("testmpegts: decode: got %zd samples, expected %zd\n", context.samples.size(), samples.size());
+      return 1;
+    }
+
+  double max_err = 0;
+  for (size_t i = 0; i < samples.size(); i++)
+    max_err = std::max<double> (max_err, fabs (samples[i] - context.samples[i]));
+
+  printf ("%-6s size %8zd (%5.1f%%)  encode %6.2f ms  decode %6.2f ms  max_err %.2g\n",
+          format_name.c_str(), data.size(), 100.0 * data.size() / (samples.size() * sizeof (float)),
+          encode_time * 1000, decode_time * 1000, max_err);
+  return 0;
+}
+
+/* check that the headerless context formats decode exactly what we expect, and that corrupt lz data is detected */
+static int
+context_test()
+{
+  const int sample_rate = 44100;
+
+  auto encode_decode = [&] (HLSContextFormat format, const vector<float>& samples, int n_channels, vector<float>& out) {
+    vector<unsigned char> data;
+    HLSContext            context;
+
+    Error err = hls_context_encode (samples, n_channels, sample_rate, 16, format, data);
+    if (!err)
+      err = decode_context (format, data, n_channels, sample_rate, context);
+    if (err)
+      {
+        error ("testmpegts: context-test: %s (%d channels, %zd samples)\n", err.message(), n_channels, samples.size());
+        return false;
+      }
+    out = context.samples;
+    return true;
+  };
+  for (int n_channels : { 1, 2, 3 })
+    {
+      for (size_t n_frames : { 0, 1, 1000, 2 * sample_rate })
+        {
+          vector<float> samples = gen_context_samples (n_channels, sample_rate, n_frames);
+          vector<float> float_out, int16_out, lz_out;
+
+          if (!encode_decode (HLSContextFormat::FLOAT, samples, n_channels, float_out) ||
+              !encode_decode (HLSContextFormat::INT16, samples, n_channels, int16_out) ||
+              !encode_decode (HLSContextFormat::LZ, samples, n_channels, lz_out))
+            return 1;
+
+          if (float_out.size() != samples.size() || int16_out.size() != samples.size() || lz_out.size() != samples.size())
+            {
+              error ("testmpegts: context-test: bad size: float %zd, int16 %zd, lz %zd, expected %zd (%d channels)\n",
+                     float_out.size(), int16_out.size(), lz_out.size(), samples.size(), n_channels);
+              return 1;
+            }
+          if (float_out != samples)
+            {
+              error ("testmpegts: context-test: float samples don't round-trip (%d channels, %zd frames)\n", n_channels, n_frames);
+              return 1;
+            }
+          if (lz_out != int16_out)
+            {
+              error ("testmpegts: context-test: lz samples differ from int16 samples (%d channels, %zd frames)\n", n_channels, n_frames);
+              return 1;
+            }
+        }
+    }
+
+  /* every truncated version of lz data must be reported as error; a single byte corruption must either be reported
+   * as error or (if it happens to produce another valid encoding of the same data) decode to the same samples
+   */
+  const int             n_channels = 2;
+  vector<unsigned char> data;
+  HLSContext            context;
+
+  Error err = hls_context_encode (gen_context_samples (n_channels, sample_rate, 1000), n_channels, sample_rate, 16, HLSContextFormat::LZ, data);
+  if (err)
+    {
+      error ("testmpegts: context-test: %s\n", err.message());
+      return 1;
+    }
+  err = decode_context (HLSContextFormat::LZ, data, n_channels, sample_rate, context);
+  if (err)
+    {
+      error ("testmpegts: context-test: %s\n", err.message());
+      return 1;
+    }
+  const vector<float> lz_samples = context.samples;
+
+  for (size_t size = 0; size < data.size(); size++)
+    {
+      vector<unsigned char> truncated (data.begin(), data.begin() + size);
+      if (!decode_context (HLSContextFormat::LZ, truncated, n_channels, sample_rate, context))
+        {
+          error ("testmpegts: context-test: lz data truncated to %zd bytes was not detected\n", size);
+          return 1;
+        }
+    }
+  for (size_t pos = 0; pos < data.size(); pos++)
+    {
+      vector<unsigned char> corrupt = data;
+      corrupt[pos] ^= 0x55;
+      if (!decode_context (HLSContextFormat::LZ, corrupt, n_channels, sample_rate, context) && context.samples != lz_samples)
+        {
+          error ("testmpegts: context-test: lz data corrupted at byte %zd was not detected\n", pos);
+          return 1;
+        }
+    }
+  printf ("context-test: ok (lz test data: %zd bytes)\n", data.size());
+  return 0;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -83,6 +266,30 @@ main (int argc, char **argv)
               printf ("%s %zd\n", entry.filename.c_str(), entry.data.size());
         }
     }
+  else if (argc == 3 && strcmp (argv[1], "audio-info") == 0)
+    {
+      TSAudioInfo audio_info;
+
+      Error err = ts_audio_info (argv[2], audio_info);
+      if (err)
+        {
+          error ("testmpegts: %s\n", err.message());
+          return 1;
+        }
+      double seconds = audio_info.n_frames * 1024.0 / audio_info.sample_rate;
+      printf ("adts_bytes %zd\n", audio_info.adts_bytes);
+      printf ("n_frames %zd\n", audio_info.n_frames);
+      printf ("sample_rate %d\n", audio_info.sample_rate);
+      printf ("bit_rate %.0f\n", audio_info.adts_bytes * 8 / seconds);
+    }
+  else if (argc == 3 && strcmp (argv[1], "context-perf") == 0)
+    {
+      return context_perf (argv[2]);
+    }
+  else if (argc == 2 && strcmp (argv[1], "context-test") == 0)
+    {
+      return context_test();
+    }
   else
     {
       error ("testmpegts: error parsing command line arguments\n");
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "utils.hh"
+#include "random.hh"
+#include "rawconverter.hh"
+
+using std::string;
+using std::vector;
+
+/* straightforward (scalar) conversion, used as reference */
+static void
+ref_to_raw (const RawFormat& format, const vector<float>& samples, vector<unsigned char>& bytes)
+{
+  const int width = format.bit_depth() / 8;
+  bytes.resize (samples.size() * width);
+  for (size_t i = 0; i < samples.size(); i++)
+    {
+      unsigned char msb_first[4];
+      if (format.encoding() == RawFormat::FLOAT)
+        {
+          uint32_t u;
+          memcpy (&u, &samples[i], 4);
+          for (int b = 0; b < 4; b++)
+            msb_first[b] = u >> (24 - 8 * b);
+        }
+      else
+        {
+          uint32_t u = lrint (bound<double> (-2147483648.0, samples[i] * 2147483648.0, 2147483647.0));
+          if (format.encoding() == RawFormat::UNSIGNED)
+            u ^= 0x80000000;
+          for (int b = 0; b < width; b++)
+            msb_first[b] = u >> (24 - 8 * b);
+        }
+      for (int b = 0; b < width; b++)
+        bytes[i * width + b] = format.endian() == RawFormat::BIG ? msb_first[b] : msb_first[width - 1 - b];
+    }
+}
+
+static void
+ref_from_raw (const RawFormat& format, const vector<unsigned char>& bytes, vector<float>& samples)
+{
+  const int width = format.bit_depth() / 8;
+  samples.resize (bytes.size() / width);
+  for (size_t i = 0; i < samples.size(); i++)
+    {
+      uint32_t u = 0;
+      for (int b = 0; b < width; b++)
+        {
+          const unsigned char byte = format.endian() == RawFormat::BIG ? bytes[i * width + b] : bytes[i * width + width - 1 - b];
+          u |= uint32_t (byte) << (24 - 8 * b);
+        }
+      if (format.encoding() == RawFormat::FLOAT)
+        {
+          memcpy (&samples[i], &u, 4);
+        }
+      else
+        {
+          if (format.encoding() == RawFormat::UNSIGNED)
+            u ^= 0x80000000;
+          samples[i] = int32_t (u) / 2147483648.0;
+        }
+    }
+}
+
+static vector<RawFormat>
+all_formats()
+{
+  vector<RawFormat> formats;
+  for (auto bits : { 16, 24, 32 })
+    for (auto endian : { RawFormat::LITTLE, RawFormat::BIG })
+      for (auto encoding : { RawFormat::SIGNED, RawFormat::UNSIGNED, RawFormat::FLOAT })
+        {
+          if (encoding == RawFormat::FLOAT && bits != 32)
+            continue;
+
+          RawFormat format (2, 44100, bits);
+          format.set_endian (endian);
+          format.set_encoding (encoding);
+          formats.push_back (format);
+        }
+  return formats;
+}
+
+static string
+format_name (const RawFormat& format)
+{
+  const char *encoding = format.encoding() == RawFormat::SIGNED ? "signed" : (format.encoding() == RawFormat::UNSIGNED ? "unsigned" : "float");
+  return string_printf ("%d bit %s %s-endian", format.bit_depth(), encoding, format.endian() == RawFormat::LITTLE ? "little" : "big");
+}
+
+static vector<float>
+gen_samples (size_t n)
+{
+  Random rng (0, Random::Stream::data_up_down); /* there is no stream for this test */
+
+  /* include clipping and edge cases */
+  vector<float> samples { 0, 1, -1, 0.5, -0.5, 1.5, -1.5, 1e-9, -1e-9, 0.99999, -0.99999, 1.0 / 65536, -1.0 / 65536, 3.0 / 65536 };
+  while (samples.size() < n)
+    samples.push_back ((double (rng()) / UINT64_MAX * 2 - 1) * 1.1);
+  samples.resize (n);
+  return samples;
+}
+
+static int
+cmp()
+{
+  int errors = 0;
+  for (auto format : all_formats())
+    {
+      Error err;
+      std::unique_ptr<RawConverter> converter (RawConverter::create (format, err));
+      if (err)
+        {
+          error ("testrawconverter: %s: %s\n", format_name (format).c_str(), err.message());
+          return 1;
+        }
+      /* test different sizes to cover remaining samples after vectorized loops */
+      for (size_t n = 0; n < 40; n++)
+        {
+          const vector<float> samples = gen_samples (n + 1000);
+
+          vector<unsigned char> bytes, ref_bytes;
+          converter->to_raw (samples, bytes);
+          ref_to_raw (format, samples, ref_bytes);
+
+          vector<float> out_samples, ref_samples;
+          converter->from_raw (ref_bytes, out_samples);
+          ref_from_raw (format, ref_bytes, ref_samples);
+
+          const bool ok = bytes == ref_bytes && memcmp (out_samples.data(), ref_samples.data(), ref_samples.size() * sizeof (float)) == 0;
+          if (!ok)
+            {
+              error ("testrawconverter: %s: mismatch for %zd samples\n", format_name (format).c_str(), samples.size());
+              errors++;
+              break;
+            }
+        }
+      printf ("%-28s ok\n", format_name (format).c_str());
+    }
+  return errors ? 1 : 0;
+}
+
+static int
+perf()
+{
+  const size_t n_samples = 1000 * 1000;
+  const int    runs = 50;
+
+  const vector<float> samples = gen_samples (n_samples);
+  for (auto format : all_formats())
+    {
+      Error err;
+      std::unique_ptr<RawConverter> converter (RawConverter::create (format, err));
+      vector<unsigned char> bytes (samples.size() * format.bit_depth() / 8);
+      vector<float> out_samples (samples.size());
+
+      double t0 = get_time();
+      for (int r = 0; r < runs; r++)
+        converter->to_raw (samples.data(), samples.size(), bytes.data());
+      double t1 = get_time();
+      for (int r = 0; r < runs; r++)
+        converter->from_raw (bytes.data(), bytes.size() * 8 / format.bit_depth(), out_samples.data());
+      double t2 = get_time();
+
+      printf ("%-28s to_raw %8.2f Msamples/s   from_raw %8.2f Msamples/s\n", format_name (format).c_str(),
+              n_samples * runs / (t1 - t0) / 1e6, n_samples * runs / (t2 - t1) / 1e6);
+    }
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc == 2 && strcmp (argv[1], "cmp") == 0)
+    return cmp();
+  if (argc == 2 && strcmp (argv[1], "perf") == 0)
+    return perf();
+
+  error ("usage: testrawconverter cmp|perf\n");
+  return 1;
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <zita-resampler/resampler.h>
+
+#include "utils.hh"
+#include "wmcommon.hh"
+#include "fastresampler.hh"
+
+using std::string;
+using std::vector;
+using std::min;
+
+static constexpr int    hlen = 16;          /* filter length used by both resamplers */
+static constexpr double min_diff_db = 120;  /* fast resampler output must match zita at least this well */
+
+static vector<float>
+gen_signal (int n_channels, int sample_rate, double seconds, double max_freq)
+{
+  /* sine sweep, different phase on each channel */
+  vector<float> samples (lrint (seconds * sample_rate) * n_channels);
+  double phase = 0;
+  for (size_t i = 0; i < samples.size() / n_channels; i++)
+    {
+      const double freq = 50 + (max_freq - 50) * i / (seconds * sample_rate);
+      for (int c = 0; c < n_channels; c++)
+        samples[i * n_channels + c] = 0.5 * sin (phase + c);
+      phase += freq / sample_rate * 2 * M_PI;
+    }
+  return samples;
+}
+
+static vector<float>
+zita_resample (const vector<float>& in, int n_channels, int old_rate, int new_rate)
+{
+  Resampler resampler;
+  if (resampler.setup (old_rate, new_rate, n_channels, hlen) != 0)
+    {
+      error ("testresampler: zita resampler setup failed\n");
+      exit (1);
+    }
+  /* avoid timeshift: zita needs k/2 - 1 samples before the actual input */
+  resampler.inp_count = resampler.inpsize () / 2 - 1;
+  resampler.inp_data  = nullptr;
+  resampler.out_count = 1000000;
+  resampler.out_data  = nullptr;
+  resampler.process();
+
+  vector<float> out ((in.size() / n_channels * new_rate / old_rate) * n_channels);
+  resampler.inp_count = in.size() / n_channels;
+  resampler.inp_data  = const_cast<float *> (&in[0]);
+  resampler.out_count = out.size() / n_channels;
+  resampler.out_data  = &out[0];
+  resampler.process();
+
+  out.resize (out.size() - resampler.out_count * n_channels);
+  return out;
+}
+
+static vector<float>
+fast_resample (const vector<float>& in, int n_channels, int old_rate, int new_rate)
+{
+  FastResampler resampler (n_channels, old_rate, new_rate, hlen);
+
+  vector<float> out;
+  for (size_t pos = 0; pos < in.size(); pos += Params::frame_size * n_channels)
+    {
+      const size_t n_frames = min (in.size() - pos, Params::frame_size * n_channels) / n_channels;
+      resampler.write_frames (&in[pos], n_frames);
+
+      const size_t out_pos = out.size();
+      out.resize (out_pos + resampler.can_read_frames() * n_channels);
+      resampler.read_frames (&out[out_pos], resampler.can_read_frames());
+    }
+  return out;
+}
+
+static int
+cmp (int old_rate, int new_rate)
+{
+  const int n_channels = 2;
+
+  /* sweep up to near nyquist, so that a different cutoff or transition band is detected */
+  const double  max_freq = 0.95 * min (old_rate, new_rate) / 2;
+  vector<float> in = gen_signal (n_channels, old_rate, 10, max_freq);
+  vector<float> zita_out = zita_resample (in, n_channels, old_rate, new_rate);
+  vector<float> fast_out = fast_resample (in, n_channels, old_rate, new_rate);
+
+  const size_t n = min (zita_out.size(), fast_out.size());
+  double signal_power = 0, error_power = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+      signal_power += zita_out[i] * zita_out[i];
+      error_power  += (zita_out[i] - fast_out[i]) * (zita_out[i] - fast_out[i]);
+    }
+  const size_t zita_frames = zita_out.size() / n_channels;
+  const size_t fast_frames = fast_out.size() / n_channels;
+  const double diff_db     = 10 * log10 (signal_power / error_power);
+
+  printf ("%d -> %d: zita %zd frames, fast %zd frames, difference %.2f dB below signal\n", old_rate, new_rate,
+          zita_frames, fast_frames, diff_db);
+
+  if (std::abs (long (zita_frames) - long (fast_frames)) > hlen)
+    {
+      error ("testresampler: frame count of fast resampler differs by more than %d frames\n", hlen);
+      return 1;
+    }
+  if (!(diff_db >= min_diff_db)) /* also fails for NaN */
+    {
+      error ("testresampler: difference between fast and zita resampler is less than %.0f dB below signal\n", min_diff_db);
+      return 1;
+    }
+  return 0;
+}
+
+static int
+perf (int old_rate, int new_rate)
+{
+  const int    n_channels = 2;
+  const double seconds = 60;
+
+  vector<float> in = gen_signal (n_channels, old_rate, seconds, 15000);
+
+  double start = get_time();
+  zita_resample (in, n_channels, old_rate, new_rate);
+  double zita_time = get_time() - start;
+
+  start = get_time();
+  fast_resample (in, n_channels, old_rate, new_rate);
+  double fast_time = get_time() - start;
+
+  const size_t n_frames = in.size() / n_channels;
+  printf ("%d -> %d: zita %.3f ns/frame, fast %.3f ns/frame\n", old_rate, new_rate,
+          zita_time * 1e9 / n_frames, fast_time * 1e9 / n_frames);
+  return 0;
+}
+
+class MemInputStream : public AudioInputStream
+{
+  const vector<float>& m_samples;
+  int                  m_sample_rate;
+  size_t               m_pos = 0;
+public:
+  MemInputStream (const vector<float>& samples, int sample_rate) :
+    m_samples (samples),
+    m_sample_rate (sample_rate)
+  {
+  }
+  int bit_depth() const override    { return 32; }
+  int sample_rate() const override  { return m_sample_rate; }
+  int n_channels() const override   { return 2; }
+  size_t n_frames() const override  { return m_samples.size() / 2; }
+
+  Error
+  read_frames (vector<float>& samples, size_t count) override
+  {
+    const size_t todo = min (count * 2, m_samples.size() - m_pos);
+    samples.assign (m_samples.begin() + m_pos, m_samples.begin() + m_pos + todo);
+    m_pos += todo;
+    return Error::Code::NONE;
+  }
+};
+
+class NullOutputStream : public AudioOutputStream
+{
+  int m_sample_rate;
+public:
+  NullOutputStream (int sample_rate) :
+    m_sample_rate (sample_rate)
+  {
+  }
+  int bit_depth() const override    { return 32; }
+  int sample_rate() const override  { return m_sample_rate; }
+  int n_channels() const override   { return 2; }
+
+  Error
+  write_frames (const vector<float>& samples) override
+  {
+    return Error::Code::NONE;
+  }
+  Error
+  close() override
+  {
+    return Error::Code::NONE;
+  }
+};
+
+static double
+add_perf (int sample_rate, double seconds)
+{
+  vector<float> samples = gen_signal (2, sample_rate, seconds, 15000);
+
+  MemInputStream   in_stream (samples, sample_rate);
+  NullOutputStream out_stream (sample_rate);
+
+  double start = get_time();
+  if (add_stream_watermark (&in_stream, &out_stream, "0123456789abcdef0011223344556677", 0) != 0)
+    exit (1);
+  return seconds / (get_time() - start);
+}
+
+static int
+add_perf()
+{
+  const double seconds = 120;
+
+  set_log_level (Log::WARNING);
+
+  printf ("44100 Hz:                    %6.2f x realtime\n", add_perf (44100, seconds));
+  printf ("48000 Hz (fast resampler):   %6.2f x realtime\n", add_perf (48000, seconds));
+  Params::test_no_fast_resampler = true;
+  printf ("48000 Hz (zita resampler):   %6.2f x realtime\n", add_perf (48000, seconds));
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc == 2 && strcmp (argv[1], "cmp") == 0)
+    return cmp (48000, 44100) || cmp (44100, 48000);
+  if (argc == 2 && strcmp (argv[1], "perf") == 0)
+    return perf (48000, 44100) || perf (44100, 48000);
+  if (argc == 2 && strcmp (argv[1], "add-perf") == 0)
+    return add_perf();
+
+  error ("usage: testresampler cmp|perf|add-perf\n");
+  return 1;
+}
@@ -21,13 +21,27 @@
 #include "sfinputstream.hh"
 #include "sfoutputstream.hh"
 #include "mp3inputstream.hh"
+#include "rawconverter.hh"
+#include "wmcommon.hh"
 
 #include <memory>
+#include <algorithm>
+
+#include <assert.h>
 #include <math.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using std::string;
 using std::vector;
 
+WavDataSource::~WavDataSource()
+{
+}
+
 WavData::WavData()
 {
 }
@@ -40,11 +54,152 @@ WavData::WavData (const vector<float>& samples, int n_channels, int sample_rate,
   m_bit_depth   = bit_depth;
 }
 
+WavData::WavData (std::shared_ptr<WavDataSource> source, int n_channels, int sample_rate, int bit_depth)
+{
+  m_source      = source;
+  m_n_channels  = n_channels;
+  m_sample_rate = sample_rate;
+  m_bit_depth   = bit_depth;
+}
+
+static uint32_t
+read_le32 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t (p[3]) << 24);
+}
+
+static uint16_t
+read_le16 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+/* find the sample data of a PCM/float wav file, returns false for anything we can't map directly */
+static bool
+parse_wav_header (const unsigned char *data, size_t size, RawFormat& format, size_t& data_offset, size_t& data_size)
+{
+  if (size < 12 || memcmp (data, "RIFF", 4) != 0 || memcmp (data + 8, "WAVE", 4) != 0)
+    return false;
+
+  bool   have_fmt = false;
+  size_t pos = 12;
+  while (pos + 8 <= size)
+    {
+      const unsigned char *chunk = data + pos;
+      const size_t chunk_size = read_le32 (chunk + 4);
+
+      if (memcmp (chunk, "fmt ", 4) == 0)
+        {
+          if (chunk_size < 16 || pos + 8 + chunk_size > size)
+            return false;
+
+          int format_tag        = read_le16 (chunk + 8);
+          const int n_channels  = read_le16 (chunk + 10);
+          const int sample_rate = read_le32 (chunk + 12);
+          const int block_align = read_le16 (chunk + 20);
+          const int bit_depth   = read_le16 (chunk + 22);
+
+          if (format_tag == 0xFFFE && chunk_size >= 40) /* WAVE_FORMAT_EXTENSIBLE: use sub format */
+            format_tag = read_le16 (chunk + 32);
+
+          const bool pcm        = format_tag == 1 && (bit_depth == 16 || bit_depth == 24 || bit_depth == 32);
+          const bool ieee_float = format_tag == 3 && bit_depth == 32; /* WAVE_FORMAT_IEEE_FLOAT */
+          if (!pcm && !ieee_float)
+            return false;
+          if (n_channels < 1 || sample_rate < 1 || block_align != n_channels * bit_depth / 8)
+            return false;
+
+          format = RawFormat (n_channels, sample_rate, bit_depth);
+          if (ieee_float)
+            format.set_encoding (RawFormat::FLOAT);
+          have_fmt = true;
+        }
+      else if (memcmp (chunk, "data", 4) == 0)
+        {
+          if (!have_fmt)
+            return false;
+
+          data_offset = pos + 8;
+          data_size   = std::min (chunk_size, size - data_offset); /* streamed wav files may have wrong data size */
+          return true;
+        }
+      pos += 8 + chunk_size + (chunk_size & 1);
+    }
+  return false;
+}
+
+bool
+WavData::load_mapped (const string& filename)
+{
+  int fd = open (filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) || st.st_size == 0)
+    {
+      close (fd);
+      return false;
+    }
+  const size_t map_size = st.st_size;
+  void *map = mmap (nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (map == MAP_FAILED)
+    return false;
+
+  auto map_data = static_cast<const unsigned char *> (map);
+
+  RawFormat format;
+  size_t    data_offset = 0;
+  size_t    data_size   = 0;
+  bool      format_ok   = false;
+  if (Params::input_format == Format::RAW)
+    {
+      format      = Params::raw_input_format;
+      data_size   = map_size;
+      format_ok   = true;
+    }
+  else
+    {
+      format_ok = parse_wav_header (map_data, map_size, format, data_offset, data_size);
+    }
+  Error err;
+  std::shared_ptr<RawConverter> raw_converter;
+  if (format_ok)
+    raw_converter.reset (RawConverter::create (format, err));
+
+  if (!format_ok || err || format.n_channels() < 1)
+    {
+      munmap (map, map_size);
+      return false;
+    }
+  madvise (map, map_size, MADV_SEQUENTIAL);
+
+  const int frame_width = format.n_channels() * format.bit_depth() / 8;
+
+  m_samples.clear();
+  m_source.reset();
+  m_raw_data.reset (map_data + data_offset, [map, map_size] (const unsigned char *) { munmap (map, map_size); });
+  m_raw_n_values     = data_size / frame_width * format.n_channels();
+  m_raw_sample_width = format.bit_depth() / 8;
+  m_raw_converter    = raw_converter;
+
+  m_sample_rate = format.sample_rate();
+  m_n_channels  = format.n_channels();
+  m_bit_depth   = format.bit_depth();
+  return true;
+}
+
 Error
 WavData::load (const string& filename)
 {
   Error err;
 
+  /* uncompressed input: use sample data without copying */
+  if (filename != "-" && load_mapped (filename))
+    return Error::Code::NONE;
+
   std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (filename, err);
   if (err)
     return err;
@@ -56,11 +211,35 @@ Error
 WavData::load (AudioInputStream *in_stream)
 {
   m_samples.clear(); // get rid of old contents
+  m_raw_data.reset();
+  m_raw_converter.reset();
+  m_source.reset();
+
+  const int    n_channels = in_stream->n_channels();
+  const size_t n_values   = in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN ? in_stream->n_frames() * n_channels : 0;
+
+  /* 16/24 bit input is stored in its native format (which needs half or less memory than float)
+   *
+   * this is only done as long as converting back to float gives exactly the samples we read,
+   * so for input that is not really integer (like mp3) we switch back to storing floats
+   */
+  Error err;
+  std::shared_ptr<RawConverter> raw_converter;
+  if (in_stream->bit_depth() == 16 || in_stream->bit_depth() == 24)
+    raw_converter.reset (RawConverter::create (RawFormat (n_channels, in_stream->sample_rate(), in_stream->bit_depth()), err));
+
+  auto raw_bytes = std::make_shared<vector<unsigned char>>();
+  if (raw_converter)
+    raw_bytes->reserve (n_values * in_stream->bit_depth() / 8);
+  else
+    m_samples.reserve (n_values);
 
   vector<float> m_buffer;
+  vector<float> check_buffer;
+  vector<unsigned char> bytes;
   while (true)
     {
-      Error err = in_stream->read_frames (m_buffer, 1024);
+      err = in_stream->read_frames (m_buffer, 65536);
       if (err)
         return err;
 
@@ -69,12 +248,36 @@ WavData::load (AudioInputStream *in_stream)
           /* reached eof */
           break;
         }
+      if (raw_converter)
+        {
+          raw_converter->to_raw (m_buffer, bytes);
+          raw_converter->from_raw (bytes, check_buffer);
+          if (check_buffer == m_buffer)
+            {
+              raw_bytes->insert (raw_bytes->end(), bytes.begin(), bytes.end());
+              continue;
+            }
+          /* not lossless: convert what we have so far to float */
+          raw_converter->from_raw (*raw_bytes, m_samples);
+          m_samples.reserve (n_values);
+          raw_converter.reset();
+          raw_bytes.reset();
+        }
       m_samples.insert (m_samples.end(), m_buffer.begin(), m_buffer.end());
     }
   m_sample_rate = in_stream->sample_rate();
-  m_n_channels  = in_stream->n_channels();
+  m_n_channels  = n_channels;
   m_bit_depth   = in_stream->bit_depth();
 
+  if (raw_converter)
+    {
+      raw_bytes->shrink_to_fit();
+
+      m_raw_data         = std::shared_ptr<const unsigned char> (raw_bytes, raw_bytes->data());
+      m_raw_sample_width = m_bit_depth / 8;
+      m_raw_n_values     = raw_bytes->size() / m_raw_sample_width;
+      m_raw_converter    = raw_converter;
+    }
   return Error::Code::NONE;
 }
 
@@ -84,11 +287,11 @@ WavData::save (const string& filename) const
   std::unique_ptr<AudioOutputStream> out_stream;
   Error err;
 
-  out_stream = AudioOutputStream::create (filename, m_n_channels, m_sample_rate, m_bit_depth, m_samples.size() / m_n_channels, err);
+  out_stream = AudioOutputStream::create (filename, m_n_channels, m_sample_rate, m_bit_depth, n_frames(), err);
   if (err)
     return err;
 
-  err = out_stream->write_frames (m_samples);
+  err = out_stream->write_frames (samples());
   if (err)
     return err;
 
@@ -108,8 +311,35 @@ WavData::bit_depth() const
   return m_bit_depth;
 }
 
+const vector<float>&
+WavData::samples() const
+{
+  if ((m_raw_data || m_source) && m_samples.size() != n_values())
+    {
+      m_samples.resize (n_values());
+      get_samples (0, m_samples.size(), m_samples.data());
+    }
+  return m_samples;
+}
+
+void
+WavData::get_samples (size_t first_value, size_t n_values, float *out) const
+{
+  assert (first_value + n_values <= this->n_values());
+
+  if (m_source)
+    m_source->get_samples (first_value, n_values, out);
+  else if (m_raw_data)
+    m_raw_converter->from_raw (m_raw_data.get() + first_value * m_raw_sample_width, n_values, out);
+  else
+    std::copy (m_samples.begin() + first_value, m_samples.begin() + first_value + n_values, out);
+}
+
 void
 WavData::set_samples (const vector<float>& samples)
 {
   m_samples = samples;
+  m_raw_data.reset();
+  m_raw_converter.reset();
+  m_source.reset();
 }
@@ -20,20 +20,43 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 
 #include "utils.hh"
 #include "audiostream.hh"
 
+class RawConverter;
+
+/* sample data which is computed on demand (for instance resampled audio) */
+class WavDataSource
+{
+public:
+  virtual ~WavDataSource();
+
+  virtual size_t n_values() const = 0;
+  virtual void   get_samples (size_t first_value, size_t n_values, float *out) = 0;
+};
+
 class WavData
 {
-  std::vector<float> m_samples;
+  mutable std::vector<float> m_samples;
   int                m_sample_rate = 0;
   int                m_n_channels  = 0;
   int                m_bit_depth   = 0;
 
+  /* compact sample data (memory mapped file or 16/24 bit integer buffer), converted to float on demand */
+  std::shared_ptr<const unsigned char> m_raw_data;
+  size_t                               m_raw_n_values = 0;
+  int                                  m_raw_sample_width = 0;
+  std::shared_ptr<RawConverter>        m_raw_converter;
+
+  std::shared_ptr<WavDataSource>       m_source;
+
+  bool load_mapped (const std::string& filename);
 public:
   WavData();
   WavData (const std::vector<float>& samples, int n_channels, int sample_rate, int bit_depth);
+  WavData (std::shared_ptr<WavDataSource> source, int n_channels, int sample_rate, int bit_depth);
 
   Error load (AudioInputStream *in_stream);
   Error load (const std::string& filename);
@@ -50,18 +73,20 @@ public:
   size_t
   n_values() const
   {
-    return m_samples.size();
+    if (m_source)
+      return m_source->n_values();
+    return m_raw_data ? m_raw_n_values : m_samples.size();
   }
   size_t
   n_frames() const
   {
-    return m_samples.size() / m_n_channels;
-  }
-  const std::vector<float>&
-  samples() const
-  {
-    return m_samples;
+    return n_values() / m_n_channels;
   }
+  /* all samples as float; for compact/computed sample data, this converts (and keeps) the whole file */
+  const std::vector<float>& samples() const;
+
+  /* convert a range of samples to float: [first_value, first_value + n_values) */
+  void get_samples (size_t first_value, size_t n_values, float *out) const;
 
   void set_samples (const std::vector<float>& samples);
 };
@@ -17,6 +17,13 @@
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include <zita-resampler/resampler.h>
 #include <zita-resampler/vresampler.h>
 
@@ -24,6 +31,8 @@
 #include "fft.hh"
 #include "convcode.hh"
 #include "limiter.hh"
+#include "fastresampler.hh"
+#include "asyncstream.hh"
 #include "sfinputstream.hh"
 #include "sfoutputstream.hh"
 #include "mp3inputstream.hh"
@@ -45,6 +54,43 @@ enum class FrameMod : uint8_t {
   DOWN
 };
 
+/* compact representation of the bins that need to be modified for each frame of an A or B block
+ *
+ * only about 60 of the max_band + 1 bins of each frame are modified, so instead of storing
+ * one FrameMod value per bin, we store a flat list of (bin, sign) entries for all frames
+ */
+class FrameModTable
+{
+public:
+  struct Entry
+  {
+    uint8_t bin;
+    int8_t  sign;  // +1 => UP, -1 => DOWN
+  };
+  struct Frame
+  {
+    const Entry *m_begin;
+    const Entry *m_end;
+
+    const Entry *begin() const { return m_begin; }
+    const Entry *end() const   { return m_end; }
+  };
+private:
+  vector<Entry>   m_entries;
+  vector<size_t>  m_frame_start; // entries of frame f: [m_frame_start[f], m_frame_start[f + 1])
+public:
+  FrameModTable (int ab, const vector<int>& bitvec);
+
+  static std::shared_ptr<const FrameModTable> get (int ab, const vector<int>& bitvec);
+
+  Frame
+  frame (size_t f) const
+  {
+    assert (f + 1 < m_frame_start.size());
+    return Frame { m_entries.data() + m_frame_start[f], m_entries.data() + m_frame_start[f + 1] };
+  }
+};
+
 static void
 prepare_frame_mod (UpDownGen& up_down_gen, int f, vector<FrameMod>& frame_mod, int data_bit)
 {
@@ -57,31 +103,6 @@ prepare_frame_mod (UpDownGen& up_down_gen, int f, vector<FrameMod>& frame_mod, i
     frame_mod[d] = data_bit ? FrameMod::DOWN : FrameMod::UP;
 }
 
-static void
-apply_frame_mod (const vector<FrameMod>& frame_mod, const vector<complex<float>>& fft_out, vector<complex<float>>& fft_delta_spect)
-{
-  const float   min_mag = 1e-7;   // avoid computing pow (0.0, -water_delta) which would be inf
-  for (size_t i = 0; i < frame_mod.size(); i++)
-    {
-      if (frame_mod[i] == FrameMod::KEEP)
-        continue;
-
-      int data_bit_sign = (frame_mod[i] == FrameMod::UP) ? 1 : -1;
-      /*
-       * for up bands, we want do use [for a 1 bit]  (pow (mag, 1 - water_delta))
-       *
-       * this actually increases the amount of energy because mag is less than 1.0
-       */
-      const float mag = abs (fft_out[i]);
-      if (mag > min_mag)
-        {
-          const float mag_factor = powf (mag, -Params::water_delta * data_bit_sign);
-
-          fft_delta_spect[i] = fft_out[i] * (mag_factor - 1);
-        }
-    }
-}
-
 static void
 mark_data (vector<vector<FrameMod>>& frame_mod, const vector<int>& bitvec)
 {
@@ -158,6 +179,89 @@ init_frame_mod_vec (vector<vector<FrameMod>>& frame_mod_vec, int ab, const vecto
   mark_data (frame_mod_vec, bitvec_fec);
 }
 
+FrameModTable::FrameModTable (int ab, const vector<int>& bitvec)
+{
+  static_assert (Params::max_band < 256, "FrameModTable::Entry stores bins as uint8_t");
+
+  vector<vector<FrameMod>> frame_mod_vec;
+  init_frame_mod_vec (frame_mod_vec, ab, bitvec);
+
+  m_frame_start.reserve (frame_mod_vec.size() + 1);
+  for (const auto& frame_mod : frame_mod_vec)
+    {
+      m_frame_start.push_back (m_entries.size());
+      for (size_t bin = 0; bin < frame_mod.size(); bin++)
+        {
+          if (frame_mod[bin] != FrameMod::KEEP)
+            m_entries.push_back ({ uint8_t (bin), int8_t (frame_mod[bin] == FrameMod::UP ? 1 : -1) });
+        }
+    }
+  m_frame_start.push_back (m_entries.size());
+  m_entries.shrink_to_fit();
+}
+
+/* building a FrameModTable is expensive, so we cache the tables for the most recently used payloads
+ *
+ * the tables are immutable, so they can be shared between WatermarkGen instances (and threads)
+ */
+std::shared_ptr<const FrameModTable>
+FrameModTable::get (int ab, const vector<int>& bitvec)
+{
+  struct CacheEntry
+  {
+    int                                   ab;
+    uint64_t                              key_generation;
+    bool                                  mix;
+    int                                   frames_per_bit;
+    vector<int>                           bitvec;
+    std::shared_ptr<const FrameModTable>  table;
+  };
+  static std::mutex         cache_mutex;
+  static vector<CacheEntry> cache;
+  const size_t              max_cache_entries = 16;
+
+  const uint64_t key_generation = Random::global_key_generation();
+
+  std::lock_guard<std::mutex> lg (cache_mutex);
+  for (auto it = cache.begin(); it != cache.end(); it++)
+    {
+      if (it->ab == ab && it->key_generation == key_generation && it->mix == Params::mix && it->frames_per_bit == Params::frames_per_bit && it->bitvec == bitvec)
+        {
+          /* move to front: most recently used */
+          std::rotate (cache.begin(), it, it + 1);
+          return cache.front().table;
+        }
+    }
+  auto table = std::make_shared<const FrameModTable> (ab, bitvec);
+
+  cache.insert (cache.begin(), { ab, key_generation, Params::mix, Params::frames_per_bit, bitvec, table });
+  if (cache.size() > max_cache_entries)
+    cache.resize (max_cache_entries);
+
+  return table;
+}
+
+static void
+apply_frame_mod (const FrameModTable::Frame& frame_mod, const vector<complex<float>>& fft_out, vector<complex<float>>& fft_delta_spect)
+{
+  const float   min_mag = 1e-7;   // avoid computing pow (0.0, -water_delta) which would be inf
+  for (const auto& entry : frame_mod)
+    {
+      /*
+       * for up bands, we want do use [for a 1 bit]  (pow (mag, 1 - water_delta))
+       *
+       * this actually increases the amount of energy because mag is less than 1.0
+       */
+      const float mag = abs (fft_out[entry.bin]);
+      if (mag > min_mag)
+        {
+          const float mag_factor = powf (mag, -Params::water_delta * entry.sign);
+
+          fft_delta_spect[entry.bin] = fft_out[entry.bin] * (mag_factor - 1);
+        }
+    }
+}
+
 /* synthesizes a watermark stream (overlap add with synthesis window)
  *
  * input:  per-channel fft delta values (always one frame)
@@ -268,14 +372,18 @@ class WatermarkGen
   const int                 n_channels = 0;
   const size_t              frames_per_block = 0;
   size_t                    frame_number = 0;
-  int                       m_data_blocks = 0;
+  size_t                    first_frame_number = 0;
+
+  const WatermarkAnalysis  *analysis_in = nullptr;
+  WatermarkAnalysis        *analysis_out = nullptr;
 
   FFTAnalyzer               fft_analyzer;
   WatermarkSynth            wm_synth;
 
   vector<int>               bitvec;
-  vector<vector<FrameMod>>  frame_mod_vec_a;
-  vector<vector<FrameMod>>  frame_mod_vec_b;
+
+  std::shared_ptr<const FrameModTable> frame_mod_table_a;
+  std::shared_ptr<const FrameModTable> frame_mod_table_b;
 public:
   WatermarkGen (int n_channels, const vector<int>& bitvec) :
     n_channels (n_channels),
@@ -288,25 +396,62 @@ public:
     /* start writing a partial B-block as padding */
     assert (frames_per_block > Params::frames_pad_start);
     frame_number = 2 * frames_per_block - Params::frames_pad_start;
+    first_frame_number = frame_number;
+  }
+  void
+  set_analysis (const WatermarkAnalysis *in, WatermarkAnalysis *out)
+  {
+    analysis_in  = in;
+    analysis_out = out;
+  }
+  vector<vector<complex<float>>>
+  analyze (const vector<float>& samples)
+  {
+    const size_t frame_index = frame_number - first_frame_number;
+    const int    n_bins = WatermarkAnalysis::n_bins;
+
+    if (analysis_in && frame_index >= analysis_in->first_frame && frame_index < analysis_in->first_frame + analysis_in->n_frames())
+      {
+        /* precomputed: we only need the bins which can be modified by apply_frame_mod() */
+        vector<vector<complex<float>>> fft_out (n_channels, vector<complex<float>> (Params::frame_size / 2 + 1));
+
+        const complex<float> *bins = &analysis_in->bins[(frame_index - analysis_in->first_frame) * n_channels * n_bins];
+        for (int ch = 0; ch < n_channels; ch++)
+          std::copy (bins + ch * n_bins, bins + (ch + 1) * n_bins, &fft_out[ch][Params::min_band]);
+
+        return fft_out;
+      }
+    vector<vector<complex<float>>> fft_out = fft_analyzer.run_fft (samples, 0);
+    if (analysis_out)
+      {
+        if (analysis_out->bins.empty())
+          {
+            analysis_out->first_frame = frame_index;
+            analysis_out->n_channels  = n_channels;
+          }
+        assert (frame_index == analysis_out->first_frame + analysis_out->n_frames());
+
+        for (int ch = 0; ch < n_channels; ch++)
+          analysis_out->bins.insert (analysis_out->bins.end(), &fft_out[ch][Params::min_band], &fft_out[ch][Params::max_band + 1]);
+      }
+    return fft_out;
   }
   vector<float>
   run (const vector<float>& samples)
   {
     assert (samples.size() == Params::frame_size * n_channels);
 
-    vector<vector<complex<float>>> fft_out = fft_analyzer.run_fft (samples, 0);
+    vector<vector<complex<float>>> fft_out = analyze (samples);
 
     vector<vector<complex<float>>> fft_delta_spect;
     for (int ch = 0; ch < n_channels; ch++)
       fft_delta_spect.push_back (vector<complex<float>> (fft_out.back().size()));
 
-    const vector<FrameMod>& frame_mod = get_frame_mod();
+    const FrameModTable::Frame frame_mod = get_frame_mod();
     for (int ch = 0; ch < n_channels; ch++)
       apply_frame_mod (frame_mod, fft_out[ch], fft_delta_spect[ch]);
 
     frame_number++;
-    if (frame_number % frames_per_block == 0)
-      m_data_blocks++;
 
     return wm_synth.run (fft_delta_spect);
   }
@@ -318,69 +463,57 @@ public:
     frame_number += zeros / Params::frame_size;
     return wm_synth.skip (zeros);
   }
-  const vector<FrameMod>&
+  FrameModTable::Frame
   get_frame_mod()
   {
     const size_t f = frame_number % (frames_per_block * 2);
     if (f >= frames_per_block) /* B block */
       {
-        if (frame_mod_vec_b.empty())
-          init_frame_mod_vec (frame_mod_vec_b, 1, bitvec);
+        if (!frame_mod_table_b)
+          frame_mod_table_b = FrameModTable::get (1, bitvec);
 
-        return frame_mod_vec_b[f - frames_per_block];
+        return frame_mod_table_b->frame (f - frames_per_block);
       }
     else /* A block */
       {
-        if (frame_mod_vec_a.empty())
-          init_frame_mod_vec (frame_mod_vec_a, 0, bitvec);
+        if (!frame_mod_table_a)
+          frame_mod_table_a = FrameModTable::get (0, bitvec);
 
-        return frame_mod_vec_a[f];
+        return frame_mod_table_a->frame (f);
       }
   }
   int
   data_blocks() const
   {
-    // first block is padding - a partial B block
-    return max (m_data_blocks - 1, 0);
+    /* complete blocks since the start of the stream (skipped frames included)
+     *  - frame_number starts in the first block, which is padding (a partial B block)
+     */
+    return max<int> (frame_number / frames_per_block - 2, 0);
   }
 };
 
 class ResamplerImpl
 {
-public:
-  virtual
-  ~ResamplerImpl()
-  {
-  }
-
-  virtual size_t        skip (size_t zeros) = 0;
-  virtual void          write_frames (const vector<float>& frames) = 0;
-  virtual vector<float> read_frames (size_t frames) = 0;
-  virtual size_t        can_read_frames() const = 0;
-};
-
-template<class Resampler>
-class BufferedResamplerImpl : public ResamplerImpl
-{
+protected:
   const int     n_channels = 0;
   const int     old_rate = 0;
   const int     new_rate = 0;
-  bool          first_write = true;
-  Resampler     m_resampler;
-
-  vector<float> buffer;
 public:
-  BufferedResamplerImpl (int n_channels, int old_rate, int new_rate) :
+  ResamplerImpl (int n_channels, int old_rate, int new_rate) :
     n_channels (n_channels),
     old_rate (old_rate),
     new_rate (new_rate)
   {
   }
-  Resampler&
-  resampler()
+  virtual
+  ~ResamplerImpl()
   {
-    return m_resampler;
   }
+
+  virtual void          write_frames (const vector<float>& frames) = 0;
+  virtual void          read_frames (size_t frames, vector<float>& out) = 0; /* out is resized to frames * n_channels */
+  virtual size_t        can_read_frames() const = 0;
+
   size_t
   skip (size_t zeros)
   {
@@ -396,9 +529,30 @@ public:
 
     size_t out = can_read_frames() + extra;
     out -= out % Params::frame_size; /* always skip whole frames */
-    read_frames (out - extra);
+
+    vector<float> discard;
+    read_frames (out - extra, discard);
     return out;
   }
+};
+
+template<class Resampler>
+class BufferedResamplerImpl : public ResamplerImpl
+{
+  bool          first_write = true;
+  Resampler     m_resampler;
+
+  vector<float> buffer;
+public:
+  BufferedResamplerImpl (int n_channels, int old_rate, int new_rate) :
+    ResamplerImpl (n_channels, old_rate, new_rate)
+  {
+  }
+  Resampler&
+  resampler()
+  {
+    return m_resampler;
+  }
   void
   write_frames (const vector<float>& frames)
   {
@@ -435,15 +589,14 @@ public:
       }
     while (start != frames.size() / n_channels);
   }
-  vector<float>
-  read_frames (size_t frames)
+  void
+  read_frames (size_t frames, vector<float>& out)
   {
     assert (frames * n_channels <= buffer.size());
     const auto begin = buffer.begin();
     const auto end   = begin + frames * n_channels;
-    vector<float> result (begin, end);
+    out.assign (begin, end);
     buffer.erase (begin, end);
-    return result;
   }
   size_t
   can_read_frames() const
@@ -452,6 +605,34 @@ public:
   }
 };
 
+/* dedicated resampler for 48000 Hz <-> 44100 Hz, which is the most common non-native case */
+class FastResamplerImpl : public ResamplerImpl
+{
+  FastResampler m_resampler;
+public:
+  FastResamplerImpl (int n_channels, int old_rate, int new_rate, int hlen) :
+    ResamplerImpl (n_channels, old_rate, new_rate),
+    m_resampler (n_channels, old_rate, new_rate, hlen)
+  {
+  }
+  void
+  write_frames (const vector<float>& frames)
+  {
+    m_resampler.write_frames (frames.data(), frames.size() / n_channels);
+  }
+  void
+  read_frames (size_t frames, vector<float>& out)
+  {
+    out.resize (frames * n_channels);
+    m_resampler.read_frames (out.data(), frames);
+  }
+  size_t
+  can_read_frames() const
+  {
+    return m_resampler.can_read_frames();
+  }
+};
+
 static ResamplerImpl *
 create_resampler (int n_channels, int old_rate, int new_rate)
 {
@@ -474,6 +655,9 @@ create_resampler (int n_channels, int old_rate, int new_rate)
        */
       const int hlen = 16;
 
+      if (FastResampler::supports (old_rate, new_rate) && !Params::test_no_fast_resampler)
+        return new FastResamplerImpl (n_channels, old_rate, new_rate, hlen);
+
       auto resampler = new BufferedResamplerImpl<Resampler> (n_channels, old_rate, new_rate);
       if (resampler->resampler().setup (old_rate, new_rate, n_channels, hlen) == 0)
         {
@@ -508,6 +692,7 @@ class WatermarkResampler
   std::unique_ptr<ResamplerImpl> out_resampler;
   WatermarkGen                   wm_gen;
   const bool                     need_resampler = false;
+  vector<float>                  r_samples; /* reused for every frame */
 public:
   WatermarkResampler (int n_channels, int input_rate, const vector<int>& bitvec) :
     wm_gen (n_channels, bitvec),
@@ -519,6 +704,11 @@ public:
         out_resampler.reset (create_resampler (n_channels, Params::mark_sample_rate, input_rate));
       }
   }
+  void
+  set_analysis (const WatermarkAnalysis *in, WatermarkAnalysis *out)
+  {
+    wm_gen.set_analysis (in, out);
+  }
   bool
   init_ok()
   {
@@ -540,7 +730,7 @@ public:
     in_resampler->write_frames (samples);
     while (in_resampler->can_read_frames() >= Params::frame_size)
       {
-        vector<float> r_samples = in_resampler->read_frames (Params::frame_size);
+        in_resampler->read_frames (Params::frame_size, r_samples);
 
         /* generate watermark at normalized sample rate */
         vector<float> wm_samples = wm_gen.run (r_samples);
@@ -549,8 +739,9 @@ public:
         out_resampler->write_frames (wm_samples);
       }
 
-    size_t to_read = out_resampler->can_read_frames();
-    return out_resampler->read_frames (to_read);
+    vector<float> out_samples;
+    out_resampler->read_frames (out_resampler->can_read_frames(), out_samples);
+    return out_samples;
   }
   size_t
   skip (size_t zeros)
@@ -577,71 +768,54 @@ public:
   }
 };
 
+static const char *
+encoding_name (RawFormat::Encoding encoding)
+{
+  switch (encoding)
+    {
+      case RawFormat::Encoding::SIGNED:   return "signed";
+      case RawFormat::Encoding::UNSIGNED: return "unsigned";
+      case RawFormat::Encoding::FLOAT:    return "float";
+    }
+  return "unknown";
+}
+
 void
 info_format (const string& label, const RawFormat& format)
 {
   info ("%-13s %d Hz, %d Channels, %d Bit (%s %s-endian)\n", (label + ":").c_str(),
       format.sample_rate(), format.n_channels(), format.bit_depth(),
-      format.encoding() == RawFormat::Encoding::SIGNED ? "signed" : "unsigned",
+      encoding_name (format.encoding()),
       format.endian() == RawFormat::Endian::LITTLE ? "little" : "big");
 }
 
-int
-add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream, const string& bits, size_t zero_frames)
+/* watermark signal statistics, for --snr (optionally restricted to a range of frames) and "Data Blocks" */
+struct AddStats
 {
-  auto bitvec = bit_str_to_vec (bits);
-  if (bitvec.empty())
-    {
-      error ("audiowmark: cannot parse bits %s\n", bits.c_str());
-      return 1;
-    }
-  if (Params::payload_short && bitvec.size() != Params::payload_size)
-    {
-      error ("audiowmark: number of message bits must match payload size (%zd bits)\n", Params::payload_size);
-      return 1;
-    }
-  if (bitvec.size() > Params::payload_size)
-    {
-      error ("audiowmark: number of bits in message '%s' larger than payload size\n", bits.c_str());
-      return 1;
-    }
-  if (bitvec.size() < Params::payload_size)
-    {
-      /* expand message automatically; good for testing, maybe not so good for the final product */
-      vector<int> expanded_bitvec;
-      for (size_t i = 0; i < Params::payload_size; i++)
-        expanded_bitvec.push_back (bitvec[i % bitvec.size()]);
-      bitvec = expanded_bitvec;
-    }
-
-  /* sanity checks */
-  if (in_stream->sample_rate() != out_stream->sample_rate())
-    {
-      error ("audiowmark: input sample rate (%d) and output sample rate (%d) don't match\n", in_stream->sample_rate(), out_stream->sample_rate());
-      return 1;
-    }
-  if (in_stream->n_channels() != out_stream->n_channels())
-    {
-      error ("audiowmark: input channels (%d) and output channels (%d) don't match\n", in_stream->n_channels(), out_stream->n_channels());
-      return 1;
-    }
+  size_t snr_start = 0;
+  size_t snr_end   = SIZE_MAX;
+  double snr_delta_power = 0;
+  double snr_signal_power = 0;
+  int    data_blocks = 0;
+};
 
-  /* write some informational messages */
-  info ("Message:      %s\n", bit_vec_to_str (bitvec).c_str());
-  info ("Strength:     %.6g\n\n", Params::water_delta * 1000);
+/* number of frames before a position that we need to watermark to get the same output at this position as a run that started earlier
+ *
+ * the limiter gain of one block depends on the previous and next block; some more frames are needed for overlapping frames and the resampler
+ */
+static size_t
+watermark_context_frames (int sample_rate)
+{
+  const size_t limiter_block = ceil (Params::limiter_block_size_ms * sample_rate / 1000);
 
-  if (in_stream->n_frames() == AudioInputStream::N_FRAMES_UNKNOWN)
-    {
-      info ("Time:         unknown\n");
-    }
-  else
-    {
-      int orig_seconds = in_stream->n_frames() / in_stream->sample_rate();
-      info ("Time:         %d:%02d\n", orig_seconds / 60, orig_seconds % 60);
-    }
-  info ("Sample Rate:  %d\n", in_stream->sample_rate());
-  info ("Channels:     %d\n", in_stream->n_channels());
+  return 2 * limiter_block + 16 * Params::frame_size;
+}
 
+/* analysis: precomputed analysis (or null); analysis_out: store analysis of all frames (or null) */
+static int
+add_stream_watermark_core (AudioInputStream *in_stream, AudioOutputStream *out_stream, const vector<int>& bitvec, size_t zero_frames, size_t discard_frames,
+                           const WatermarkAnalysis *analysis, WatermarkAnalysis *analysis_out, AddStats& stats)
+{
   vector<float> samples;
 
   const int n_channels = in_stream->n_channels();
@@ -650,34 +824,69 @@ add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream
   if (!wm_resampler.init_ok())
     return 1;
 
+  wm_resampler.set_analysis (analysis, analysis_out);
+
   Limiter limiter (n_channels, in_stream->sample_rate());
   limiter.set_block_size_ms (Params::limiter_block_size_ms);
   limiter.set_ceiling (Params::limiter_ceiling);
 
-  /* for signal to noise ratio */
-  double snr_delta_power = 0;
-  double snr_signal_power = 0;
-
   size_t total_input_frames = 0;
   size_t total_output_frames = 0;
+  size_t mark_frames = 0;          // position of samples mixed with the watermark (including zero frames)
   size_t zero_frames_in  = zero_frames;
   size_t zero_frames_out = zero_frames;
   Error err;
+
+  /* the output for the first discard_frames input frames is not used, so we write silence instead,
+   * and only watermark the context needed to get the right output after the discarded frames
+   */
+  const size_t context = watermark_context_frames (in_stream->sample_rate());
+  if (discard_frames > context)
+    {
+      size_t fast_forward = discard_frames - context;
+
+      err = out_stream->write_frames (vector<float> (fast_forward * n_channels));
+      if (err)
+        {
+          error ("audiowmark output write failed: %s\n", err.message());
+          return 1;
+        }
+      /* treat input frames we don't need like zero frames at the start of the stream */
+      zero_frames_in  += fast_forward;
+      zero_frames_out += fast_forward;
+      while (fast_forward)
+        {
+          err = in_stream->read_frames (samples, min<size_t> (fast_forward, 65536));
+          if (err)
+            {
+              error ("audiowmark: input stream read failed: %s\n", err.message());
+              return 1;
+            }
+          if (samples.empty())
+            {
+              error ("audiowmark: input stream ended before the end of the discarded frames\n");
+              return 1;
+            }
+          fast_forward -= samples.size() / n_channels;
+        }
+    }
   if (zero_frames_in >= Params::frame_size)
     {
       const size_t skip_frames = zero_frames_in - zero_frames_in % Params::frame_size;
 
       total_input_frames += skip_frames;
-      size_t out = wm_resampler.skip (skip_frames);
+      const size_t wm_out = wm_resampler.skip (skip_frames);
 
-      audio_buffer.write_frames (std::vector<float> ((skip_frames - out) * n_channels));
+      audio_buffer.write_frames (std::vector<float> ((skip_frames - wm_out) * n_channels));
 
-      out = limiter.skip (out);
+      /* the limiter delays its output, so fewer frames than wm_out leave the limiter */
+      const size_t out = limiter.skip (wm_out);
       assert (out < zero_frames_out);
 
       zero_frames_out -= out;
       total_output_frames += out;
       zero_frames_in -= skip_frames;
+      mark_frames += wm_out;
     }
   while (true)
     {
@@ -714,15 +923,18 @@ add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream
 
       if (Params::snr)
         {
-          for (size_t i = 0; i < samples.size(); i++)
+          const size_t snr_start = bound (mark_frames, stats.snr_start, mark_frames + to_read);
+          const size_t snr_end   = bound (mark_frames, stats.snr_end, mark_frames + to_read);
+          for (size_t i = (snr_start - mark_frames) * n_channels; i < (snr_end - mark_frames) * n_channels; i++)
             {
               const double orig  = orig_samples[i]; // original sample
               const double delta = samples[i];      // watermark
 
-              snr_delta_power += delta * delta;
-              snr_signal_power += orig * orig;
+              stats.snr_delta_power += delta * delta;
+              stats.snr_signal_power += orig * orig;
             }
         }
+      mark_frames += to_read;
       for (size_t i = 0; i < samples.size(); i++)
         samples[i] += orig_samples[i];
 
@@ -748,8 +960,12 @@ add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream
           return 1;
         }
       total_output_frames += samples.size() / n_channels;
+
+      /* the output stream doesn't need the rest of the input, so we don't need to watermark it */
+      if (out_stream->done())
+        break;
     }
-  if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
+  if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN && !out_stream->done())
     {
       const size_t expect_frames = in_stream->n_frames() + zero_frames;
       if (total_output_frames != expect_frames)
@@ -766,13 +982,389 @@ add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream
       return 1;
     }
 
+  stats.data_blocks = wm_resampler.data_blocks();
+  return 0;
+}
+
+/* in-memory streams, used to run add_stream_watermark_core() for one range of the input */
+class MemInputStream : public AudioInputStream
+{
+  const float *m_samples = nullptr;
+  size_t       m_n_frames = 0;
+  size_t       m_pos = 0;
+  int          m_n_channels = 0;
+  int          m_sample_rate = 0;
+  int          m_bit_depth = 0;
+public:
+  MemInputStream (const float *samples, size_t n_frames, int n_channels, int sample_rate, int bit_depth) :
+    m_samples (samples),
+    m_n_frames (n_frames),
+    m_n_channels (n_channels),
+    m_sample_rate (sample_rate),
+    m_bit_depth (bit_depth)
+  {
+  }
+  int bit_depth() const override    { return m_bit_depth; }
+  int sample_rate() const override  { return m_sample_rate; }
+  int n_channels() const override   { return m_n_channels; }
+  size_t n_frames() const override  { return m_n_frames; }
+
+  Error
+  read_frames (vector<float>& samples, size_t count) override
+  {
+    count = min (count, m_n_frames - m_pos);
+    samples.assign (m_samples + m_pos * m_n_channels, m_samples + (m_pos + count) * m_n_channels);
+    m_pos += count;
+    return Error::Code::NONE;
+  }
+};
+
+class MemOutputStream : public AudioOutputStream
+{
+  int           m_n_channels = 0;
+  int           m_sample_rate = 0;
+  int           m_bit_depth = 0;
+public:
+  vector<float> samples;
+
+  MemOutputStream (int n_channels, int sample_rate, int bit_depth) :
+    m_n_channels (n_channels),
+    m_sample_rate (sample_rate),
+    m_bit_depth (bit_depth)
+  {
+  }
+  int bit_depth() const override    { return m_bit_depth; }
+  int sample_rate() const override  { return m_sample_rate; }
+  int n_channels() const override   { return m_n_channels; }
+
+  Error
+  write_frames (const vector<float>& frames) override
+  {
+    samples.insert (samples.end(), frames.begin(), frames.end());
+    return Error::Code::NONE;
+  }
+  Error
+  close() override
+  {
+    return Error::Code::NONE;
+  }
+};
+
+/* split the input into fixed size ranges and watermark them using a pool of worker threads
+ *
+ * every range starts at the right position of the watermark using the same
+ * zero_frames/skip() mechanism HLS uses; with enough context around each
+ * range (limiter blocks, overlapping frames, resampler) the output of each
+ * range is identical to the output of a serial run
+ *
+ * the input is read range by range, and finished ranges are written in order; only
+ * a few ranges per worker are in memory at the same time, so the memory usage
+ * doesn't depend on the length of the input
+ */
+static int
+add_stream_watermark_jobs (AudioInputStream *in_stream, AudioOutputStream *out_stream, const vector<int>& bitvec, const WatermarkAnalysis *analysis, AddStats& stats)
+{
+  const int n_channels = in_stream->n_channels();
+  const int sample_rate = in_stream->sample_rate();
+  const size_t n_frames = in_stream->n_frames();
+
+  const size_t context = watermark_context_frames (sample_rate);
+  const size_t range_frames = max<size_t> (4 * context, 180 * sample_rate); /* about three minutes */
+
+  /* short inputs: use (up to) one range per job */
+  const size_t n_ranges = max<size_t> ({ 1, n_frames / range_frames, min<size_t> (Params::jobs, n_frames / (4 * context)) });
+  const size_t n_jobs = bound<size_t> (1, n_ranges, Params::jobs);
+  const size_t max_ranges_in_flight = 2 * n_jobs;
+
+  info ("Jobs:         %zd\n", n_jobs);
+
+  struct Range
+  {
+    size_t                           start = 0;
+    size_t                           end = 0;
+    size_t                           ctx_start = 0;
+    vector<float>                    in_samples;
+    std::unique_ptr<MemOutputStream> out;
+    AddStats                         stats;
+    int                              rc = 0;
+    bool                             done = false;
+  };
+  vector<std::unique_ptr<Range>> ranges (n_ranges);
+
+  std::mutex              mutex;
+  std::condition_variable cond;
+  std::deque<Range *>     queue;
+  bool                    input_done = false;
+
+  auto worker = [&] {
+    std::unique_lock<std::mutex> lock (mutex);
+    for (;;)
+      {
+        cond.wait (lock, [&] { return !queue.empty() || input_done; });
+        if (queue.empty())
+          return;
+
+        Range& range = *queue.front();
+        queue.pop_front();
+        lock.unlock();
+
+        const size_t n_in_frames = range.in_samples.size() / n_channels;
+        MemInputStream in (range.in_samples.data(), n_in_frames, n_channels, sample_rate, in_stream->bit_depth());
+
+        range.rc = add_stream_watermark_core (&in, range.out.get(), bitvec, range.ctx_start, 0, analysis, nullptr, range.stats);
+
+        /* free the input as soon as possible */
+        vector<float>().swap (range.in_samples);
+
+        lock.lock();
+        range.done = true;
+        cond.notify_all();
+      }
+  };
+  vector<std::thread> threads;
+  for (size_t t = 0; t < n_jobs; t++)
+    threads.emplace_back (worker);
+
+  /* write output of finished ranges in order, waiting until no more than max_pending ranges are in flight */
+  size_t n_read = 0;
+  size_t next_write = 0;
+  int    rc = 0;
+  auto write_ranges = [&] (size_t max_pending)
+    {
+      while (next_write < n_read && rc == 0)
+        {
+          Range& range = *ranges[next_write];
+          {
+            std::unique_lock<std::mutex> lock (mutex);
+            if (!range.done && n_read - next_write <= max_pending)
+              return;
+            cond.wait (lock, [&] { return range.done; });
+          }
+          rc = range.rc;
+          if (rc != 0)
+            return;
+
+          const auto begin = range.out->samples.begin() + (range.start - range.ctx_start) * n_channels;
+          Error err = out_stream->write_frames (vector<float> (begin, begin + (range.end - range.start) * n_channels));
+          if (err)
+            {
+              error ("audiowmark output write failed: %s\n", err.message());
+              rc = 1;
+              return;
+            }
+          stats.snr_delta_power  += range.stats.snr_delta_power;
+          stats.snr_signal_power += range.stats.snr_signal_power;
+          stats.data_blocks       = range.stats.data_blocks;
+
+          ranges[next_write++].reset();
+        }
+    };
+
+  /* queue each range as soon as its input is read; the overlap is the start of the next range context */
+  vector<float> overlap;
+  vector<float> samples;
+  size_t        read_pos = 0;
+  for (size_t r = 0; r < n_ranges && rc == 0; r++)
+    {
+      write_ranges (max_ranges_in_flight - 1);
+      if (rc != 0)
+        break;
+
+      std::unique_ptr<Range> range (new Range());
+
+      range->start     = n_frames * r / n_ranges;
+      range->end       = n_frames * (r + 1) / n_ranges;
+      range->ctx_start = range->start - min (range->start, context);
+      range->out.reset (new MemOutputStream (n_channels, sample_rate, out_stream->bit_depth()));
+
+      /* first range / last range include the extra frames before / after the input */
+      range->stats.snr_start = r == 0 ? 0 : range->start;
+      range->stats.snr_end   = r + 1 == n_ranges ? SIZE_MAX : range->end;
+
+      const size_t ctx_end = min (range->end + context, n_frames);
+
+      range->in_samples = std::move (overlap);
+      while (read_pos < ctx_end)
+        {
+          Error err = in_stream->read_frames (samples, min<size_t> (ctx_end - read_pos, 65536));
+          if (err)
+            {
+              error ("audiowmark: input stream read failed: %s\n", err.message());
+              rc = 1;
+              break;
+            }
+          if (samples.empty())
+            {
+              error ("audiowmark: error: input stream ended after %zd frames, expected %zd frames\n", read_pos, n_frames);
+              rc = 1;
+              break;
+            }
+          range->in_samples.insert (range->in_samples.end(), samples.begin(), samples.end());
+          read_pos += samples.size() / n_channels;
+        }
+      if (rc != 0)
+        break;
+
+      if (r + 1 < n_ranges)
+        {
+          const size_t next_start     = n_frames * (r + 1) / n_ranges;
+          const size_t next_ctx_start = next_start - min (next_start, context);
+          overlap.assign (range->in_samples.begin() + (next_ctx_start - range->ctx_start) * n_channels, range->in_samples.end());
+        }
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        queue.push_back (range.get());
+      }
+      cond.notify_all();
+      ranges[r] = std::move (range);
+      n_read++;
+    }
+  write_ranges (0);
+
+  /* stop workers (on error, ranges that have not been started yet are dropped) */
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    input_done = true;
+    queue.clear();
+  }
+  cond.notify_all();
+  for (auto& thread : threads)
+    thread.join();
+
+  if (rc != 0)
+    return rc;
+
+  /* the input stream must end where n_frames() said it would */
+  Error err = in_stream->read_frames (samples, 1);
+  if (err)
+    {
+      error ("audiowmark: input stream read failed: %s\n", err.message());
+      return 1;
+    }
+  if (!samples.empty())
+    {
+      error ("audiowmark: error: input stream has more than %zd frames\n", n_frames);
+      return 1;
+    }
+
+  err = out_stream->close();
+  if (err)
+    {
+      error ("audiowmark: closing output stream failed: %s\n", err.message());
+      return 1;
+    }
+  return 0;
+}
+
+int
+add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream, const string& bits, size_t zero_frames, size_t discard_frames,
+                      const WatermarkAnalysis *analysis)
+{
+  auto bitvec = bit_str_to_vec (bits);
+  if (bitvec.empty())
+    {
+      error ("audiowmark: cannot parse bits %s\n", bits.c_str());
+      return 1;
+    }
+  if (Params::payload_short && bitvec.size() != Params::payload_size)
+    {
+      error ("audiowmark: number of message bits must match payload size (%zd bits)\n", Params::payload_size);
+      return 1;
+    }
+  if (bitvec.size() > Params::payload_size)
+    {
+      error ("audiowmark: number of bits in message '%s' larger than payload size\n", bits.c_str());
+      return 1;
+    }
+  if (bitvec.size() < Params::payload_size)
+    {
+      /* expand message automatically; good for testing, maybe not so good for the final product */
+      vector<int> expanded_bitvec;
+      for (size_t i = 0; i < Params::payload_size; i++)
+        expanded_bitvec.push_back (bitvec[i % bitvec.size()]);
+      bitvec = expanded_bitvec;
+    }
+
+  /* sanity checks */
+  if (in_stream->sample_rate() != out_stream->sample_rate())
+    {
+      error ("audiowmark: input sample rate (%d) and output sample rate (%d) don't match\n", in_stream->sample_rate(), out_stream->sample_rate());
+      return 1;
+    }
+  if (in_stream->n_channels() != out_stream->n_channels())
+    {
+      error ("audiowmark: input channels (%d) and output channels (%d) don't match\n", in_stream->n_channels(), out_stream->n_channels());
+      return 1;
+    }
+
+  /* write some informational messages */
+  info ("Message:      %s\n", bit_vec_to_str (bitvec).c_str());
+  info ("Strength:     %.6g\n\n", Params::water_delta * 1000);
+
+  if (in_stream->n_frames() == AudioInputStream::N_FRAMES_UNKNOWN)
+    {
+      info ("Time:         unknown\n");
+    }
+  else
+    {
+      int orig_seconds = in_stream->n_frames() / in_stream->sample_rate();
+      info ("Time:         %d:%02d\n", orig_seconds / 60, orig_seconds % 60);
+    }
+  info ("Sample Rate:  %d\n", in_stream->sample_rate());
+  info ("Channels:     %d\n", in_stream->n_channels());
+
+  AddStats stats;
+  int rc;
+  if (Params::jobs > 1 && zero_frames == 0 && discard_frames == 0 && in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
+    rc = add_stream_watermark_jobs (in_stream, out_stream, bitvec, analysis, stats);
+  else
+    rc = add_stream_watermark_core (in_stream, out_stream, bitvec, zero_frames, discard_frames, analysis, nullptr, stats);
+  if (rc != 0)
+    return rc;
+
   if (Params::snr)
-    info ("SNR:          %f dB\n", 10 * log10 (snr_signal_power / snr_delta_power));
+    info ("SNR:          %f dB\n", 10 * log10 (stats.snr_signal_power / stats.snr_delta_power));
 
-  info ("Data Blocks:  %d\n", wm_resampler.data_blocks());
+  info ("Data Blocks:  %d\n", stats.data_blocks);
   return 0;
 }
 
+/* compute the analysis add_stream_watermark() would compute for the same input (and zero_frames / discard_frames)
+ *
+ * this runs the same code as add_stream_watermark() to get exactly the same frames, only the output is thrown away
+ */
+int
+analyze_stream_watermark (AudioInputStream *in_stream, size_t zero_frames, size_t discard_frames, WatermarkAnalysis& analysis)
+{
+  class NullOutputStream : public AudioOutputStream
+  {
+    int m_n_channels = 0;
+    int m_sample_rate = 0;
+    int m_bit_depth = 0;
+  public:
+    NullOutputStream (int n_channels, int sample_rate, int bit_depth) :
+      m_n_channels (n_channels),
+      m_sample_rate (sample_rate),
+      m_bit_depth (bit_depth)
+    {
+    }
+    int bit_depth() const override    { return m_bit_depth; }
+    int sample_rate() const override  { return m_sample_rate; }
+    int n_channels() const override   { return m_n_channels; }
+
+    Error write_frames (const vector<float>& frames) override { return Error::Code::NONE; }
+    Error close() override                                    { return Error::Code::NONE; }
+  } out_stream (in_stream->n_channels(), in_stream->sample_rate(), in_stream->bit_depth());
+
+  /* the analysis doesn't depend on the payload */
+  const vector<int> bitvec (Params::payload_size);
+
+  analysis = WatermarkAnalysis();
+
+  AddStats stats;
+  return add_stream_watermark_core (in_stream, &out_stream, bitvec, zero_frames, discard_frames, nullptr, &analysis, stats);
+}
+
 int
 add_watermark (const string& infile, const string& outfile, const string& bits)
 {
@@ -795,6 +1387,13 @@ add_watermark (const string& infile, const string& outfile, const string& bits)
       return 1;
     }
 
+  if (Params::async_io)
+    {
+      /* decode input / encode output in background threads, overlapped with watermark generation */
+      in_stream.reset (new AsyncInputStream (std::move (in_stream), Params::frame_size, 64));
+      out_stream.reset (new AsyncOutputStream (std::move (out_stream), 64));
+    }
+
   /* write input/output stream details */
   info ("Input:        %s\n", Params::input_label.size() ? Params::input_label.c_str() : infile.c_str());
   if (Params::input_format == Format::RAW)
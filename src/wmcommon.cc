@@ -19,6 +19,7 @@
 #include "fft.hh"
 #include "convcode.hh"
 #include "shortcode.hh"
+#include "wavdata.hh"
 
 int    Params::frames_per_bit  = 2;
 double Params::water_delta     = 0.01;
@@ -31,8 +32,16 @@ bool   Params::payload_short   = false;
 int    Params::test_cut        = 0; // for sync test
 bool   Params::test_no_sync    = false; // disable sync
 bool   Params::test_no_limiter = false; // disable limiter
+bool   Params::test_no_fast_resampler = false; // use zita-resampler for 48000 Hz, too
 int    Params::test_truncate   = 0;
 
+double Params::limiter_block_size_ms = 1000;
+int    Params::jobs                  = 1;
+bool   Params::async_io              = false;
+bool   Params::output_rf64           = false;
+bool   Params::downmix               = false;
+bool   Params::mp3_jobs              = false;
+
 Format Params::input_format     = Format::AUTO;
 Format Params::output_format    = Format::AUTO;
 
@@ -40,6 +49,11 @@ RawFormat Params::raw_input_format;
 RawFormat Params::raw_output_format;
 
 int    Params::hls_bit_rate = 0;
+bool   Params::hls_exact_bit_rate = false;
+HLSContextFormat Params::hls_context_format = HLSContextFormat::FLAC;
+size_t Params::hls_context_cache_mb = 0;
+bool   Params::hls_analysis = false;
+int    Params::hls_ab_bits = 32;
 
 std::string Params::input_label;
 std::string Params::output_label;
@@ -127,11 +141,16 @@ FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index)
 {
   assert (samples.size() >= (Params::frame_size + start_index) * m_n_channels);
 
+  return run_fft_interleaved (&samples[start_index * m_n_channels]);
+}
+
+vector<vector<complex<float>>>
+FFTAnalyzer::run_fft_interleaved (const float *samples)
+{
   vector<vector<complex<float>>> fft_out;
   for (int ch = 0; ch < m_n_channels; ch++)
     {
-      size_t pos = start_index * m_n_channels + ch;
-      assert (pos + (Params::frame_size - 1) * m_n_channels < samples.size());
+      size_t pos = ch;
 
       /* deinterleave frame data and apply window */
       for (size_t x = 0; x < Params::frame_size; x++)
@@ -171,13 +190,49 @@ FFTAnalyzer::fft_range (const vector<float>& samples, size_t start_index, size_t
   return fft_out;
 }
 
+vector<vector<complex<float>>>
+FFTAnalyzer::run_fft (const WavData& wav_data, size_t start_index)
+{
+  assert (wav_data.n_values() >= (Params::frame_size + start_index) * m_n_channels);
+
+  m_window_samples.resize (Params::frame_size * m_n_channels);
+  wav_data.get_samples (start_index * m_n_channels, m_window_samples.size(), m_window_samples.data());
+
+  return run_fft_interleaved (m_window_samples.data());
+}
+
+vector<vector<complex<float>>>
+FFTAnalyzer::fft_range (const WavData& wav_data, size_t start_index, size_t frame_count)
+{
+  vector<vector<complex<float>>> fft_out;
+
+  /* if there is not enough space for frame_count values, return an error (empty vector) */
+  if (wav_data.n_values() < (start_index + frame_count * Params::frame_size) * m_n_channels)
+    return fft_out;
+
+  for (size_t f = 0; f < frame_count; f++)
+    {
+      const size_t frame_start = (f * Params::frame_size) + start_index;
+
+      vector<vector<complex<float>>> frame_result = run_fft (wav_data, frame_start);
+      for (auto& fr : frame_result)
+        fft_out.emplace_back (std::move (fr));
+    }
+  return fft_out;
+}
+
 int
 frame_pos (int f, bool sync)
 {
   static vector<int> pos_vec;
+  static uint64_t    pos_vec_key_generation;
 
-  if (pos_vec.empty())
+  /* frame positions depend on the key, so recompute them if the global key changed */
+  if (pos_vec.empty() || pos_vec_key_generation != Random::global_key_generation())
     {
+      pos_vec.clear();
+      pos_vec_key_generation = Random::global_key_generation();
+
       int frame_count = mark_data_frame_count() + mark_sync_frame_count();
       for (int i = 0; i < frame_count; i++)
         pos_vec.push_back (i);
@@ -27,6 +27,7 @@
 #include <assert.h>
 
 enum class Format { AUTO = 1, RAW = 2 };
+enum class HLSContextFormat { FLAC, FLOAT, INT16, LZ };
 
 class Params
 {
@@ -55,12 +56,20 @@ public:
   static constexpr size_t frames_pad_start = 250; // padding at start, in case track starts with silence
   static constexpr int mark_sample_rate = 44100; // watermark generation and detection sample rate
 
-  static constexpr double limiter_block_size_ms = 1000;
+  static           double limiter_block_size_ms; // limiter output is delayed by two blocks
+  static constexpr double limiter_block_size_ms_low_latency = 20;
   static constexpr double limiter_ceiling       = 0.99;
 
+  static           int    jobs;                  // number of threads (add: watermarking, get: mp3 decoding)
+  static           bool   async_io;              // read input / write output in background threads
+  static           bool   output_rf64;           // use RF64 header for wav output to stdout
+  static           bool   downmix;               // get: analyze mono mix of all channels (faster, less robust)
+  static           bool   mp3_jobs;              // get: decode long mp3 files with --jobs threads
+
   static           int test_cut; // for sync test
   static           bool test_no_sync;
   static           bool test_no_limiter;
+  static           bool test_no_fast_resampler;
   static           int test_truncate;
 
   static           Format input_format;
@@ -70,6 +79,11 @@ public:
   static           RawFormat raw_output_format;
 
   static           int hls_bit_rate;
+  static           bool hls_exact_bit_rate;             // hls-prepare: detect bit rate from all segments (not a subset)
+  static           HLSContextFormat hls_context_format; // hls-prepare: how to store the audio context
+  static           size_t hls_context_cache_mb;         // hls-add: cache decoded contexts (for long running processes)
+  static           bool hls_analysis;                   // hls-prepare: store precomputed watermark analysis in segments
+  static           int hls_ab_bits;                     // hls-prepare-ab: number of bits in the segment selection pattern
 
   // input/output labels can be set for pretty output for videowmark add
   static           std::string input_label;
@@ -110,18 +124,27 @@ public:
   }
 };
 
+class WavData;
+
 class FFTAnalyzer
 {
   int           m_n_channels = 0;
   std::vector<float> m_window;
+  std::vector<float> m_window_samples;
   float        *m_frame = nullptr;
   float        *m_frame_fft = nullptr;
+
+  std::vector<std::vector<std::complex<float>>> run_fft_interleaved (const float *samples);
 public:
   FFTAnalyzer (int n_channels);
   ~FFTAnalyzer();
 
   std::vector<std::vector<std::complex<float>>> run_fft (const std::vector<float>& samples, size_t start_index);
   std::vector<std::vector<std::complex<float>>> fft_range (const std::vector<float>& samples, size_t start_index, size_t frame_count);
+
+  /* same as above, but only converts the samples of the analysis window to float (for compact WavData) */
+  std::vector<std::vector<std::complex<float>>> run_fft (const WavData& wav_data, size_t start_index);
+  std::vector<std::vector<std::complex<float>>> fft_range (const WavData& wav_data, size_t start_index, size_t frame_count);
 };
 
 struct MixEntry
@@ -163,8 +186,39 @@ randomize_bit_order (const std::vector<T>& bit_vec, bool encode)
   return out_bits;
 }
 
-int add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream, const std::string& bits, size_t zero_frames);
+/* precomputed analysis of the watermark generator input: the fft bins min_band..max_band of each frame
+ *
+ * the analysis doesn't depend on the payload, so hls-prepare can store it, and hls-add only needs to apply the payload
+ */
+struct WatermarkAnalysis
+{
+  static constexpr int n_bins = Params::max_band - Params::min_band + 1;
+
+  size_t                            first_frame = 0; // frame index (counting from the start of the stream) of the first frame
+  int                               n_channels  = 0;
+  std::vector<std::complex<float>>  bins;            // [frame][channel][bin - min_band]
+
+  size_t
+  n_frames() const
+  {
+    return n_channels ? bins.size() / (n_channels * n_bins) : 0;
+  }
+};
+
+/* discard_frames: the caller doesn't use the output for the first discard_frames input frames (silence is written instead)
+ * analysis:       if not null, use precomputed analysis (from analyze_stream_watermark) for the frames it contains
+ */
+int add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream, const std::string& bits, size_t zero_frames,
+                          size_t discard_frames = 0, const WatermarkAnalysis *analysis = nullptr);
+int analyze_stream_watermark (AudioInputStream *in_stream, size_t zero_frames, size_t discard_frames, WatermarkAnalysis& analysis);
 int add_watermark (const std::string& infile, const std::string& outfile, const std::string& bits);
 int get_watermark (const std::string& infile, const std::string& orig_pattern);
 
+struct ABScore
+{
+  double sum   = 0; // sum of (up - down) band differences in dB: < 0 => variant 0, > 0 => variant 1
+  size_t count = 0;
+};
+int get_ab_scores (const std::string& infile, const std::vector<double>& boundaries, std::vector<ABScore>& scores);
+
 #endif /* AUDIOWMARK_WM_COMMON_HH */
@@ -17,6 +17,9 @@
 
 #include <string>
 #include <algorithm>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 #include <zita-resampler/resampler.h>
 #include <zita-resampler/vresampler.h>
@@ -34,7 +37,7 @@ using std::complex;
 
 template<class R>
 static void
-process_resampler (R& resampler, const vector<float>& in, vector<float>& out)
+process_resampler (R& resampler, const WavData& wav_data, vector<float>& out)
 {
   resampler.out_count = out.size() / resampler.nchan();
   resampler.out_data = &out[0];
@@ -44,9 +47,18 @@ process_resampler (R& resampler, const vector<float>& in, vector<float>& out)
   resampler.inp_data  = nullptr;
   resampler.process();
 
-  resampler.inp_count = in.size() / resampler.nchan();
-  resampler.inp_data = (float *) &in[0];
-  resampler.process();
+  /* convert input in chunks, so mapped input files don't need to be converted to float as a whole */
+  const size_t  chunk_values = 65536 * resampler.nchan();
+  vector<float> in;
+  for (size_t pos = 0; pos < wav_data.n_values(); pos += chunk_values)
+    {
+      in.resize (min (chunk_values, wav_data.n_values() - pos));
+      wav_data.get_samples (pos, in.size(), in.data());
+
+      resampler.inp_count = in.size() / resampler.nchan();
+      resampler.inp_data = &in[0];
+      resampler.process();
+    }
 
   /* zita needs k/2 samples after the actual input */
   resampler.inp_count = resampler.inpsize() / 2;
@@ -54,6 +66,142 @@ process_resampler (R& resampler, const vector<float>& in, vector<float>& out)
   resampler.process();
 }
 
+/* resample on demand, in chunks
+ *
+ * zita's Resampler uses a fixed set of filter phases, so if each chunk starts at a multiple
+ * of the resampling period (and gets the input before the chunk as history), the chunks can
+ * be computed independently, with exactly the same result as resampling the whole file
+ *
+ * only the recently used chunks for about two data blocks are kept (the sync search and the
+ * decoders work on one block at a time), so we never need a second copy of the whole audio
+ */
+class ChunkedResampler : public WavDataSource
+{
+  static constexpr int    hlen = 16;
+
+  const WavData&  m_in; // must stay valid while the resampled data is used
+  int             m_rate = 0;
+  int             m_n_channels = 0;
+  size_t          m_period_in = 0;
+  size_t          m_period_out = 0;
+  size_t          m_chunk_frames = 0;
+  size_t          m_n_frames = 0;
+  size_t          m_max_cached_chunks = 0;
+
+  std::mutex                                  m_mutex;
+  std::list<std::pair<size_t, vector<float>>> m_cache; // most recently used chunk first
+
+  void
+  compute_chunk (size_t chunk, vector<float>& out)
+  {
+    Resampler resampler;
+    int r = resampler.setup (m_in.sample_rate(), m_rate, m_n_channels, hlen);
+    assert (r == 0);
+
+    const size_t out_start = chunk * m_chunk_frames;
+    const size_t in_start  = out_start / m_period_out * m_period_in;
+    const size_t history   = resampler.inpsize() / 2 - 1;
+    const size_t in_frames = m_in.n_frames();
+
+    out.assign (min (m_chunk_frames, m_n_frames - out_start) * m_n_channels, 0);
+    resampler.out_count = out.size() / m_n_channels;
+    resampler.out_data  = out.data();
+
+    /* at the start of the file, zita needs k/2 - 1 zero samples before the actual input */
+    if (in_start < history)
+      {
+        resampler.inp_count = history - in_start;
+        resampler.inp_data  = nullptr;
+        resampler.process();
+      }
+    vector<float> in;
+    for (size_t pos = in_start - min (in_start, history); resampler.out_count && pos < in_frames; pos += in.size() / m_n_channels)
+      {
+        in.resize (min<size_t> (4096, in_frames - pos) * m_n_channels);
+        m_in.get_samples (pos * m_n_channels, in.size(), in.data());
+
+        resampler.inp_count = in.size() / m_n_channels;
+        resampler.inp_data  = in.data();
+        resampler.process();
+      }
+    /* at the end of the file, zita needs k/2 samples after the actual input */
+    if (resampler.out_count)
+      {
+        resampler.inp_count = resampler.inpsize() / 2;
+        resampler.inp_data  = nullptr;
+        resampler.process();
+      }
+  }
+  const vector<float>&
+  get_chunk (size_t chunk)
+  {
+    for (auto it = m_cache.begin(); it != m_cache.end(); it++)
+      {
+        if (it->first == chunk)
+          {
+            m_cache.splice (m_cache.begin(), m_cache, it);
+            return m_cache.front().second;
+          }
+      }
+    if (m_cache.size() >= m_max_cached_chunks)
+      m_cache.pop_back();
+
+    m_cache.emplace_front (chunk, vector<float>());
+    compute_chunk (chunk, m_cache.front().second);
+    return m_cache.front().second;
+  }
+public:
+  ChunkedResampler (const WavData& in, int rate) :
+    m_in (in),
+    m_rate (rate),
+    m_n_channels (in.n_channels())
+  {
+    size_t a = in.sample_rate(), b = rate;
+    while (b)
+      {
+        size_t t = a % b;
+        a = b;
+        b = t;
+      }
+    m_period_in    = in.sample_rate() / a;
+    m_period_out   = rate / a;
+    m_chunk_frames = m_period_out * max<size_t> (1, 65536 / m_period_out);
+    m_n_frames     = lrint (in.n_frames() * double (rate) / in.sample_rate());
+
+    const size_t block_frames = (mark_sync_frame_count() + mark_data_frame_count()) * Params::frame_size;
+    m_max_cached_chunks = 2 * block_frames / m_chunk_frames + 4;
+  }
+  static bool
+  supports (const WavData& in, int rate)
+  {
+    Resampler resampler;
+    return resampler.setup (in.sample_rate(), rate, in.n_channels(), hlen) == 0;
+  }
+  size_t
+  n_values() const override
+  {
+    return m_n_frames * m_n_channels;
+  }
+  void
+  get_samples (size_t first_value, size_t n_values, float *out) override
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+
+    const size_t chunk_values = m_chunk_frames * m_n_channels;
+    while (n_values)
+      {
+        const vector<float>& chunk = get_chunk (first_value / chunk_values);
+        const size_t         pos   = first_value % chunk_values;
+        const size_t         n     = min (n_values, chunk.size() - pos);
+
+        std::copy (chunk.begin() + pos, chunk.begin() + pos + n, out);
+        first_value += n;
+        n_values    -= n;
+        out         += n;
+      }
+  }
+};
+
 static WavData
 resample (const WavData& wav_data, int rate)
 {
@@ -65,9 +213,6 @@ resample (const WavData& wav_data, int rate)
   const int hlen = 16;
   const double ratio = double (rate) / wav_data.sample_rate();
 
-  const vector<float>& in = wav_data.samples();
-  vector<float> out (lrint (in.size() / wav_data.n_channels() * ratio) * wav_data.n_channels());
-
   /* zita-resampler provides two resampling algorithms
    *
    * a fast optimized version: Resampler
@@ -77,25 +222,66 @@ resample (const WavData& wav_data, int rate)
    * a slower version: VResampler
    *   this works for arbitary rates (like 33333 -> 44100 resampling)
    *
-   * so we try using Resampler, and if that fails fall back to VResampler
+   * so we try using Resampler (on demand, in chunks), and if that fails fall back to VResampler
    */
-  Resampler resampler;
-  if (resampler.setup (wav_data.sample_rate(), rate, wav_data.n_channels(), hlen) == 0)
+  if (ChunkedResampler::supports (wav_data, rate))
     {
-      process_resampler (resampler, in, out);
-      return WavData (out, wav_data.n_channels(), rate, wav_data.bit_depth());
+      auto source = std::make_shared<ChunkedResampler> (wav_data, rate);
+      return WavData (source, wav_data.n_channels(), rate, wav_data.bit_depth());
     }
 
   VResampler vresampler;
   if (vresampler.setup (ratio, wav_data.n_channels(), hlen) == 0)
     {
-      process_resampler (vresampler, in, out);
+      vector<float> out (lrint (wav_data.n_frames() * ratio) * wav_data.n_channels());
+      process_resampler (vresampler, wav_data, out);
       return WavData (out, wav_data.n_channels(), rate, wav_data.bit_depth());
     }
   error ("audiowmark: resampling from rate %d to rate %d not supported.\n", wav_data.sample_rate(), rate);
   exit (1);
 }
 
+/* mono mix of all channels, computed on demand
+ *
+ * the watermark is the same for all channels, so detection can analyze the mix instead
+ * of each channel, which needs 1/n_channels of the cpu time for ffts and decoding
+ */
+class DownmixSource : public WavDataSource
+{
+  const WavData&  m_in; // must stay valid while the mix is used
+  vector<float>   m_samples;
+  std::mutex      m_mutex;
+public:
+  DownmixSource (const WavData& in) :
+    m_in (in)
+  {
+  }
+  size_t
+  n_values() const override
+  {
+    return m_in.n_frames();
+  }
+  void
+  get_samples (size_t first_value, size_t n_values, float *out) override
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+
+    const int   n_channels = m_in.n_channels();
+    const float scale = 1.0 / n_channels;
+
+    m_samples.resize (n_values * n_channels);
+    m_in.get_samples (first_value * n_channels, m_samples.size(), m_samples.data());
+
+    for (size_t i = 0; i < n_values; i++)
+      {
+        float sum = 0;
+        for (int ch = 0; ch < n_channels; ch++)
+          sum += m_samples[i * n_channels + ch];
+        out[i] = sum * scale;
+      }
+  }
+};
+
 static int
 frame_count (const WavData& wav_data)
 {
@@ -200,6 +386,78 @@ linear_decode (vector<vector<complex<float>>>& fft_out, int n_channels)
   return raw_bit_vec;
 }
 
+/* dB magnitudes of the bands used for sync detection (for each channel) */
+static void
+sync_bands_db (const vector<vector<complex<float>>>& frame_result, float *out)
+{
+  constexpr double min_db = -96;
+
+  for (size_t ch = 0; ch < frame_result.size(); ch++)
+    for (int i = Params::min_band; i <= Params::max_band; i++)
+      *out++ = db_from_factor (abs (frame_result[ch][i]), min_db);
+}
+
+/*
+ * The SyncSpectrogram class contains the sync band magnitudes (dB) of single
+ * frames of the input WavData. Frames are indexed by their start position in
+ * the input, and each frame is only analyzed once, so the BlockDecoder and the
+ * ClipDecoder (which search mostly the same audio for short files) can share
+ * the analysis work. Samples before the start and after the end of the input
+ * are treated as silence, like the zero padding of the ClipDecoder.
+ */
+class SyncSpectrogram
+{
+  const WavData&  m_wav_data; // must stay valid while the spectrogram is used
+  FFTAnalyzer     m_fft_analyzer;
+  vector<float>   m_samples;
+
+  std::unordered_map<long, vector<float>> m_frames;
+public:
+  SyncSpectrogram (const WavData& wav_data) :
+    m_wav_data (wav_data),
+    m_fft_analyzer (wav_data.n_channels())
+  {
+  }
+  size_t
+  n_frames() const
+  {
+    return m_wav_data.n_frames();
+  }
+  /* n_channels * n_bands values for the frame [pos, pos + frame_size) */
+  const float *
+  frame_db (long pos)
+  {
+    vector<float>& db = m_frames[pos];
+    if (db.empty())
+      {
+        const int  n_channels = m_wav_data.n_channels();
+        const long n_frames   = m_wav_data.n_frames();
+        const long frame_size = Params::frame_size;
+
+        vector<vector<complex<float>>> frame_result;
+        if (pos >= 0 && pos + frame_size <= n_frames)
+          {
+            frame_result = m_fft_analyzer.run_fft (m_wav_data, pos);
+          }
+        else
+          {
+            /* frame is (partially) outside the input */
+            const long first = max (pos, 0L);
+            const long last  = min (pos + frame_size, n_frames);
+
+            m_samples.assign (frame_size * n_channels, 0);
+            if (first < last)
+              m_wav_data.get_samples (first * n_channels, (last - first) * n_channels, &m_samples[(first - pos) * n_channels]);
+
+            frame_result = m_fft_analyzer.run_fft (m_samples, 0);
+          }
+        db.resize (n_channels * (Params::max_band - Params::min_band + 1));
+        sync_bands_db (frame_result, db.data());
+      }
+    return db.data();
+  }
+};
+
 /*
  * The SyncFinder class searches for sync bits in an input WavData. It is used
  * by both, the BlockDecoder and ClipDecoder to find a time index where
@@ -239,6 +497,10 @@ linear_decode (vector<vector<complex<float>>>& fft_out, int n_channels)
  * able to match an AB block to the zeropadded file (MATCH). This gives us an
  * index in the zeropadded file that can be used for decoding the available
  * data.
+ *
+ * If a SyncSpectrogram is set with use_spectrogram(), frames are taken from
+ * the spectrogram instead of analyzing them again, which is done for all
+ * frames that don't overlap the boundaries of the clip within the input.
  */
 class SyncFinder
 {
@@ -390,44 +652,105 @@ private:
   void
   scan_silence (const WavData& wav_data)
   {
-    const vector<float>& samples = wav_data.samples();
+    const size_t  n_values = wav_data.n_values();
+    const size_t  chunk_values = 65536;
+    vector<float> samples;
 
     // find first non-zero sample
-    wav_data_first = 0;
-    while (wav_data_first < samples.size() && samples[wav_data_first] == 0)
-      wav_data_first++;
+    wav_data_first = n_values;
+    for (size_t pos = 0; pos < n_values && wav_data_first == n_values; pos += chunk_values)
+      {
+        samples.resize (min (chunk_values, n_values - pos));
+        wav_data.get_samples (pos, samples.size(), samples.data());
+
+        for (size_t i = 0; i < samples.size(); i++)
+          if (samples[i] != 0)
+            {
+              wav_data_first = pos + i;
+              break;
+            }
+      }
 
     // search wav_data_last to get [wav_data_first, wav_data_last) range
-    wav_data_last = samples.size();
-    while (wav_data_last > wav_data_first && samples[wav_data_last - 1] == 0)
-      wav_data_last--;
+    wav_data_last = wav_data_first;
+    for (size_t end = n_values; end > wav_data_first && wav_data_last == wav_data_first; end -= samples.size())
+      {
+        samples.resize (min (chunk_values, end - wav_data_first));
+        wav_data.get_samples (end - samples.size(), samples.size(), samples.data());
+
+        for (size_t i = samples.size(); i > 0; i--)
+          if (samples[i - 1] != 0)
+            {
+              wav_data_last = end - samples.size() + i;
+              break;
+            }
+      }
   }
   vector<Score>
   search_approx (const WavData& wav_data, Mode mode)
   {
-    vector<float> fft_db;
-    vector<char>  have_frames;
     vector<Score> sync_scores;
 
-    // compute multiple time-shifted fft vectors
     size_t n_bands = Params::max_band - Params::min_band + 1;
     int total_frame_count = mark_sync_frame_count() + mark_data_frame_count();
     if (mode == Mode::CLIP)
       total_frame_count *= 2;
+
+    const int n_frames = frame_count (wav_data) - 1;
+    if (n_frames <= total_frame_count)
+      return sync_scores;
+
+    /* compute multiple time-shifted fft vectors
+     *
+     * all shifts are computed in one sweep over the input, one block at a time, so that input which is
+     * resampled on demand (ChunkedResampler) is still in the cache for the other shifts; each start frame
+     * is scored as soon as all frames it needs are available, and frames before it are discarded
+     */
+    struct ShiftFrames
+    {
+      size_t        sync_shift = 0;
+      int           first_frame = 0;
+      vector<float> fft_db;
+      vector<char>  have_frames;
+    };
+    vector<ShiftFrames> shifts;
     for (size_t sync_shift = 0; sync_shift < Params::frame_size; sync_shift += Params::sync_search_step)
       {
-        sync_fft (wav_data, sync_shift, frame_count (wav_data) - 1, fft_db, have_frames, /* want all frames */ {});
-        for (int start_frame = 0; start_frame < frame_count (wav_data); start_frame++)
+        shifts.emplace_back();
+        shifts.back().sync_shift = sync_shift;
+      }
+    const size_t  frame_values = wav_data.n_channels() * n_bands;
+    vector<float> window_db;
+    vector<char>  window_have_frames;
+    int           start_frame = 0;
+    for (int window_start = 0; window_start < n_frames; window_start += total_frame_count)
+      {
+        const int window_end = min (window_start + total_frame_count, n_frames);
+        for (auto& shift : shifts)
           {
-            const size_t sync_index = start_frame * Params::frame_size + sync_shift;
-            if ((start_frame + total_frame_count) * wav_data.n_channels() * n_bands < fft_db.size())
+            sync_fft (wav_data, shift.sync_shift + window_start * Params::frame_size, window_end - window_start,
+                      window_db, window_have_frames, /* want all frames */ {});
+            shift.fft_db.insert (shift.fft_db.end(), window_db.begin(), window_db.end());
+            shift.have_frames.insert (shift.have_frames.end(), window_have_frames.begin(), window_have_frames.end());
+          }
+        for (; start_frame + total_frame_count < min (window_end + 1, n_frames); start_frame++)
+          {
+            for (auto& shift : shifts)
               {
+                const size_t sync_index = start_frame * Params::frame_size + shift.sync_shift;
+
                 ConvBlockType block_type;
-                double quality = sync_decode (wav_data, start_frame, fft_db, have_frames, &block_type);
+                double quality = sync_decode (wav_data, start_frame - shift.first_frame, shift.fft_db, shift.have_frames, &block_type);
                 // printf ("%zd %f\n", sync_index, quality);
                 sync_scores.emplace_back (Score { sync_index, quality, block_type });
               }
           }
+        for (auto& shift : shifts)
+          {
+            shift.fft_db.erase (shift.fft_db.begin(), shift.fft_db.begin() + (start_frame - shift.first_frame) * frame_values);
+            shift.have_frames.erase (shift.have_frames.begin(), shift.have_frames.begin() + (start_frame - shift.first_frame));
+            shift.first_frame = start_frame;
+          }
       }
     sort (sync_scores.begin(), sync_scores.end(), [] (const Score& a, const Score &b) { return a.index < b.index; });
     return sync_scores;
@@ -547,7 +870,38 @@ private:
   // non-zero sample range: [wav_data_first, wav_data_last)
   size_t wav_data_first = 0;
   size_t wav_data_last = 0;
+
+  // shared analysis: wav data frame 0 is at input frame spectrogram_offset, and contains input frames [spectrogram_first, spectrogram_last)
+  SyncSpectrogram *spectrogram = nullptr;
+  long             spectrogram_offset = 0;
+  long             spectrogram_first = 0;
+  long             spectrogram_last = 0;
+
+  const float *
+  shared_frame_db (size_t index)
+  {
+    if (!spectrogram)
+      return nullptr;
+
+    const long pos = long (index) + spectrogram_offset;
+
+    /* if the clip boundary is inside the input, frames overlapping it differ from the input frames */
+    if (pos < spectrogram_first && spectrogram_first > 0)
+      return nullptr;
+    if (pos + long (Params::frame_size) > spectrogram_last && spectrogram_last < long (spectrogram->n_frames()))
+      return nullptr;
+
+    return spectrogram->frame_db (pos);
+  }
 public:
+  void
+  use_spectrogram (SyncSpectrogram *spectrogram, long offset, size_t first, size_t last)
+  {
+    this->spectrogram  = spectrogram;
+    spectrogram_offset = offset;
+    spectrogram_first  = first;
+    spectrogram_last   = last;
+  }
   vector<Score>
   search (const WavData& wav_data, Mode mode)
   {
@@ -565,7 +919,7 @@ public:
       {
         /* in block mode we don't do anything special for silence at beginning/end */
         wav_data_first = 0;
-        wav_data_last  = wav_data.samples().size();
+        wav_data_last  = wav_data.n_values();
       }
     vector<Score> sync_scores = search_approx (wav_data, mode);
 
@@ -589,7 +943,6 @@ private:
       return;
 
     FFTAnalyzer fft_analyzer (wav_data.n_channels());
-    const vector<float>& samples = wav_data.samples();
     const size_t n_bands = Params::max_band - Params::min_band + 1;
     int out_pos = 0;
 
@@ -609,14 +962,20 @@ private:
           }
         else
           {
-            constexpr double min_db = -96;
+            const size_t n_values = n_bands * wav_data.n_channels();
 
-            vector<vector<complex<float>>> frame_result = fft_analyzer.run_fft (samples, index + f * Params::frame_size);
+            if (const float *frame_db = shared_frame_db (index + f * Params::frame_size))
+              {
+                std::copy (frame_db, frame_db + n_values, &fft_out_db[out_pos]);
+              }
+            else
+              {
+                vector<vector<complex<float>>> frame_result = fft_analyzer.run_fft (wav_data, index + f * Params::frame_size);
 
-            /* computing db-magnitude is expensive, so we better do it here */
-            for (int ch = 0; ch < wav_data.n_channels(); ch++)
-              for (int i = Params::min_band; i <= Params::max_band; i++)
-                fft_out_db[out_pos++] = db_from_factor (abs (frame_result[ch][i]), min_db);
+                /* computing db-magnitude is expensive, so we better do it here */
+                sync_bands_db (frame_result, &fft_out_db[out_pos]);
+              }
+            out_pos += n_values;
 
             have_frames[f] = 1;
           }
@@ -752,11 +1111,13 @@ class BlockDecoder
   vector<SyncFinder::Score> sync_scores; // stored here for sync debugging
 public:
   void
-  run (const WavData& wav_data, ResultSet& result_set)
+  run (const WavData& wav_data, ResultSet& result_set, SyncSpectrogram *spectrogram = nullptr)
   {
     int total_count = 0;
 
     SyncFinder sync_finder;
+    if (spectrogram)
+      sync_finder.use_spectrogram (spectrogram, 0, 0, wav_data.n_frames());
     sync_scores = sync_finder.search (wav_data, SyncFinder::Mode::BLOCK);
 
     vector<float> raw_bit_vec_all (code_size (ConvBlockType::ab, Params::payload_size));
@@ -775,7 +1136,7 @@ public:
         const size_t index = sync_score.index;
         const int    ab = (sync_score.block_type == ConvBlockType::b); /* A -> 0, B -> 1 */
 
-        auto fft_range_out = fft_analyzer.fft_range (wav_data.samples(), index, count);
+        auto fft_range_out = fft_analyzer.fft_range (wav_data, index, count);
         if (fft_range_out.size())
           {
             /* ---- retrieve bits from watermark ---- */
@@ -876,6 +1237,52 @@ public:
   }
 };
 
+/* clip with virtual silence before and after it: [pad_start zeros] [samples of wav_data] [pad_end zeros]
+ *
+ * the padding is never stored, so the clip decoder doesn't need to copy the input samples
+ */
+class PaddedSource : public WavDataSource
+{
+  const WavData&  m_in; // must stay valid while the padded data is used
+  size_t          m_first_value = 0;
+  size_t          m_n_in_values = 0;
+  size_t          m_pad_start = 0;
+  size_t          m_pad_end = 0;
+public:
+  PaddedSource (const WavData& in, size_t first_value, size_t last_value, size_t pad_start, size_t pad_end) :
+    m_in (in),
+    m_first_value (first_value),
+    m_n_in_values (last_value - first_value),
+    m_pad_start (pad_start),
+    m_pad_end (pad_end)
+  {
+  }
+  size_t
+  n_values() const override
+  {
+    return m_pad_start + m_n_in_values + m_pad_end;
+  }
+  void
+  get_samples (size_t first_value, size_t n_values, float *out) override
+  {
+    const size_t last_value = first_value + n_values;
+
+    // overlap with input samples: [in_first, in_last)
+    const size_t in_first = max (first_value, m_pad_start);
+    const size_t in_last  = min (last_value, m_pad_start + m_n_in_values);
+    if (in_first < in_last)
+      {
+        std::fill (out, out + (in_first - first_value), 0);
+        m_in.get_samples (m_first_value + in_first - m_pad_start, in_last - in_first, out + (in_first - first_value));
+        std::fill (out + (in_last - first_value), out + n_values, 0);
+      }
+    else
+      {
+        std::fill (out, out + n_values, 0);
+      }
+  }
+};
+
 /*
  * The clip decoder is responsible for decoding short clips. It is designed to
  * handle input sizes that are smaller than one data block. One case is that
@@ -916,9 +1323,8 @@ class ClipDecoder
       return linear_decode (fft_out, n_channels);
   }
   void
-  run_padded (const WavData& wav_data, ResultSet& result_set, double time_offset_sec)
+  run_padded (const WavData& wav_data, ResultSet& result_set, double time_offset_sec, SyncFinder& sync_finder)
   {
-    SyncFinder                sync_finder;
     vector<SyncFinder::Score> sync_scores = sync_finder.search (wav_data, SyncFinder::Mode::CLIP);
     FFTAnalyzer               fft_analyzer (wav_data.n_channels());
 
@@ -926,8 +1332,8 @@ class ClipDecoder
       {
         const size_t count = mark_sync_frame_count() + mark_data_frame_count();
         const size_t index = sync_score.index;
-        auto fft_range_out1 = fft_analyzer.fft_range (wav_data.samples(), index, count);
-        auto fft_range_out2 = fft_analyzer.fft_range (wav_data.samples(), index + count * Params::frame_size, count);
+        auto fft_range_out1 = fft_analyzer.fft_range (wav_data, index, count);
+        auto fft_range_out2 = fft_analyzer.fft_range (wav_data, index + count * Params::frame_size, count);
         if (fft_range_out1.size() && fft_range_out2.size())
           {
             const auto raw_bit_vec1 = randomize_bit_order (mix_or_linear_decode (fft_range_out1, wav_data.n_channels()), /* encode */ false);
@@ -961,7 +1367,7 @@ class ClipDecoder
   }
   enum class Pos { START, END };
   void
-  run_block (const WavData& wav_data, ResultSet& result_set, Pos pos)
+  run_block (const WavData& wav_data, ResultSet& result_set, Pos pos, SyncSpectrogram *spectrogram)
   {
     const size_t n = (frames_per_block + 5) * Params::frame_size * wav_data.n_channels();
 
@@ -989,49 +1395,192 @@ class ClipDecoder
         first_sample = wav_data.n_values() - n;
         last_sample  = wav_data.n_values();
       }
+    const size_t n_channels  = wav_data.n_channels();
+    const size_t first_frame = first_sample / n_channels;
+    if (spectrogram)
+      {
+        // increase padding at start to search the same positions as in the input
+        //   -> sync spectrogram can be shared with the block decoder
+        const size_t step = Params::sync_search_step;
+        pad_samples_start += (first_frame % step + step - pad_samples_start / n_channels % step) % step * n_channels;
+      }
+
     const double time_offset = double (first_sample) / wav_data.sample_rate() / wav_data.n_channels();
-    vector<float> ext_samples (wav_data.samples().begin() + first_sample, wav_data.samples().begin() + last_sample);
 
     if (0)
       {
-        printf ("%d: %f..%f\n", int (pos), time_offset, time_offset + double (ext_samples.size()) / wav_data.sample_rate() / wav_data.n_channels());
+        printf ("%d: %f..%f\n", int (pos), time_offset, time_offset + double (last_sample - first_sample) / wav_data.sample_rate() / wav_data.n_channels());
         printf ("%f< >%f\n",
           double (pad_samples_start) / wav_data.sample_rate() / wav_data.n_channels(),
           double (pad_samples_end) / wav_data.sample_rate() / wav_data.n_channels());
       }
-    ext_samples.insert (ext_samples.begin(), pad_samples_start, 0);
-    ext_samples.insert (ext_samples.end(),   pad_samples_end, 0);
+    auto padded_source = std::make_shared<PaddedSource> (wav_data, first_sample, last_sample, pad_samples_start, pad_samples_end);
 
-    WavData l_wav_data (ext_samples, wav_data.n_channels(), wav_data.sample_rate(), wav_data.bit_depth());
-    run_padded (l_wav_data, result_set, time_offset);
+    WavData l_wav_data (padded_source, wav_data.n_channels(), wav_data.sample_rate(), wav_data.bit_depth());
+
+    SyncFinder sync_finder;
+    if (spectrogram)
+      sync_finder.use_spectrogram (spectrogram, long (first_frame) - long (pad_samples_start / n_channels), first_frame, last_sample / n_channels);
+    run_padded (l_wav_data, result_set, time_offset, sync_finder);
    }
 public:
   ClipDecoder() :
     frames_per_block (mark_sync_frame_count() + mark_data_frame_count())
   {
   }
-  void
-  run (const WavData& wav_data, ResultSet& result_set)
+  bool
+  used_for (const WavData& wav_data) const
   {
     const int wav_frames = wav_data.n_values() / (Params::frame_size * wav_data.n_channels());
-    if (wav_frames < frames_per_block * 3.1) /* clip decoder is only used for small wavs */
+    return wav_frames < frames_per_block * 3.1; /* clip decoder is only used for small wavs */
+  }
+  void
+  run (const WavData& wav_data, ResultSet& result_set, SyncSpectrogram *spectrogram = nullptr)
+  {
+    if (used_for (wav_data))
       {
-        run_block (wav_data, result_set, Pos::START);
-        run_block (wav_data, result_set, Pos::END);
+        run_block (wav_data, result_set, Pos::START, spectrogram);
+        run_block (wav_data, result_set, Pos::END, spectrogram);
       }
   }
 };
 
+/*
+ * A/B variant detection: hls-prepare-ab renders each segment twice, watermarked with an all-zero
+ * and an all-one payload; for a stream assembled from both variants, we need to find out which
+ * variant was used for each time range
+ *
+ * the sync part is identical for both variants, so we can find the blocks as usual; in the data
+ * part, only those coded bits where the all-zero and all-one codewords differ carry information,
+ * and for each of them the (up - down) band energy difference is negative for variant 0 and
+ * positive for variant 1; we assign each of these to the time range the frame is located in
+ *
+ * like in mark_data(), band b of the data part carries coded bit b / bands_per_frame / frames_per_bit,
+ * and an all-zero payload is encoded as an all-zero codeword, so the all-one codeword tells us which
+ * coded bits differ (hls-ab-test.sh checks this end-to-end)
+ */
+static void
+ab_decode (const WavData& wav_data, const vector<double>& boundaries, vector<ABScore>& scores)
+{
+  vector<vector<int>> codewords;
+  for (auto block_type : { ConvBlockType::a, ConvBlockType::b })
+    {
+      vector<int> one_bits (Params::payload_size, 1);
+
+      codewords.push_back (randomize_bit_order (code_encode (block_type, one_bits), /* encode */ true));
+    }
+
+  /* up/down bands and frame position of each data frame band (in mix_decode / linear_decode order) */
+  struct Band
+  {
+    int frame;
+    int up;
+    int down;
+  };
+  vector<Band> bands;
+  if (Params::mix)
+    {
+      for (auto entry : gen_mix_entries())
+        bands.push_back ({ entry.frame, entry.up, entry.down });
+    }
+  else
+    {
+      UpDownGen up_down_gen (Random::Stream::data_up_down);
+      for (size_t f = 0; f < mark_data_frame_count(); f++)
+        {
+          UpDownArray up, down;
+          up_down_gen.get (f, up, down);
+          for (size_t frame_b = 0; frame_b < Params::bands_per_frame; frame_b++)
+            bands.push_back ({ data_frame_pos (f), up[frame_b], down[frame_b] });
+        }
+    }
+
+  SyncFinder    sync_finder;
+  FFTAnalyzer   fft_analyzer (wav_data.n_channels());
+  const int     n_channels = wav_data.n_channels();
+  const size_t  count = mark_sync_frame_count() + mark_data_frame_count();
+
+  for (auto sync_score : sync_finder.search (wav_data, SyncFinder::Mode::BLOCK))
+    {
+      auto fft_range_out = fft_analyzer.fft_range (wav_data, sync_score.index, count);
+      if (fft_range_out.empty())
+        continue;
+
+      const vector<int>& codeword = codewords[sync_score.block_type == ConvBlockType::b];
+      for (size_t b = 0; b < bands.size(); b++)
+        {
+          if (!codeword[b / Params::bands_per_frame / Params::frames_per_bit])
+            continue;
+
+          /* time range containing the center of the frame */
+          const double t = (sync_score.index + (bands[b].frame + 0.5) * Params::frame_size) / double (wav_data.sample_rate());
+          const auto it = std::upper_bound (boundaries.begin(), boundaries.end(), t);
+          if (it == boundaries.begin() || it == boundaries.end())
+            continue;
+
+          ABScore& score = scores[it - boundaries.begin() - 1];
+          for (int ch = 0; ch < n_channels; ch++)
+            {
+              const double min_db = -96;
+              const auto&  fft = fft_range_out[bands[b].frame * n_channels + ch];
+
+              score.sum += db_from_factor (abs (fft[bands[b].up]), min_db) - db_from_factor (abs (fft[bands[b].down]), min_db);
+              score.count++;
+            }
+        }
+    }
+}
+
+static void
+ab_decode_rate (const WavData& wav_data, const vector<double>& boundaries, vector<ABScore>& scores)
+{
+  if (wav_data.sample_rate() == Params::mark_sample_rate)
+    ab_decode (wav_data, boundaries, scores);
+  else
+    ab_decode (resample (wav_data, Params::mark_sample_rate), boundaries, scores);
+}
+
+int
+get_ab_scores (const string& infile, const vector<double>& boundaries, vector<ABScore>& scores)
+{
+  WavData wav_data;
+  Error err = wav_data.load (infile);
+  if (err)
+    {
+      error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+
+  scores.assign (boundaries.size() > 1 ? boundaries.size() - 1 : 0, ABScore());
+
+  if (Params::downmix && wav_data.n_channels() > 1)
+    {
+      auto    source = std::make_shared<DownmixSource> (wav_data);
+      WavData mono_wav_data (source, 1, wav_data.sample_rate(), wav_data.bit_depth());
+
+      ab_decode_rate (mono_wav_data, boundaries, scores);
+    }
+  else
+    {
+      ab_decode_rate (wav_data, boundaries, scores);
+    }
+  return 0;
+}
+
 static int
 decode_and_report (const WavData& wav_data, const string& orig_pattern)
 {
-  ResultSet result_set;
-
+  ResultSet    result_set;
   BlockDecoder block_decoder;
-  block_decoder.run (wav_data, result_set);
+  ClipDecoder  clip_decoder;
+
+  /* for small wavs, both decoders search the same audio for sync blocks, so they share the analysis */
+  std::unique_ptr<SyncSpectrogram> spectrogram;
+  if (clip_decoder.used_for (wav_data))
+    spectrogram.reset (new SyncSpectrogram (wav_data));
 
-  ClipDecoder clip_decoder;
-  clip_decoder.run (wav_data, result_set);
+  block_decoder.run (wav_data, result_set, spectrogram.get());
+  clip_decoder.run (wav_data, result_set, spectrogram.get());
   result_set.print();
 
   if (!orig_pattern.empty())
@@ -1043,6 +1592,19 @@ decode_and_report (const WavData& wav_data, const string& orig_pattern)
   return 0;
 }
 
+static int
+decode_and_report_rate (const WavData& wav_data, const string& orig_pattern)
+{
+  if (wav_data.sample_rate() == Params::mark_sample_rate)
+    {
+      return decode_and_report (wav_data, orig_pattern);
+    }
+  else
+    {
+      return decode_and_report (resample (wav_data, Params::mark_sample_rate), orig_pattern);
+    }
+}
+
 int
 get_watermark (const string& infile, const string& orig_pattern)
 {
@@ -1065,12 +1627,12 @@ get_watermark (const string& infile, const string& orig_pattern)
           wav_data.set_samples (short_samples);
         }
     }
-  if (wav_data.sample_rate() == Params::mark_sample_rate)
+  if (Params::downmix && wav_data.n_channels() > 1)
     {
-      return decode_and_report (wav_data, orig_pattern);
-    }
-  else
-    {
-      return decode_and_report (resample (wav_data, Params::mark_sample_rate), orig_pattern);
+      auto    source = std::make_shared<DownmixSource> (wav_data);
+      WavData mono_wav_data (source, 1, wav_data.sample_rate(), wav_data.bit_depth());
+
+      return decode_and_report_rate (mono_wav_data, orig_pattern);
     }
+  return decode_and_report_rate (wav_data, orig_pattern);
 }